@@ -0,0 +1,94 @@
+#!/usr/bin/env python3
+"""Compare two sets of workload results and flag regressions.
+
+Each input is a JSON-lines file written by `workload -o`. Runs are grouped
+by label, the median of every metric is taken across repeated runs, and
+the candidate is compared against the baseline. Runs recorded as failed
+are left out. The exit status is 1 if
+any metric regressed by more than the threshold.
+
+usage: compare.py [-t PCT] BASELINE.jsonl CANDIDATE.jsonl
+"""
+
+import argparse
+import json
+import statistics
+import sys
+
+def metrics(run):
+    """Map metric name -> (value, higher_is_better) for one run."""
+    m = {
+        'ops_per_s': (run['ops_per_s'], True),
+        'mib_per_s': (run['mib_per_s'], True),
+    }
+    for op, lat in run['latency_us'].items():
+        if lat['count'] == 0:
+            continue
+        m[op + '.p50_us'] = (lat['p50'], False)
+        m[op + '.p99_us'] = (lat['p99'], False)
+    return m
+
+
+def load(path):
+    groups = {}
+    with open(path) as f:
+        for line in f:
+            line = line.strip()
+            if not line:
+                continue
+            run = json.loads(line)
+            if run.get('failed'):
+                continue
+            groups.setdefault(run['label'], []).append(metrics(run))
+    # median per metric across repeated runs of the same label
+    result = {}
+    for label, runs in groups.items():
+        names = set().union(*runs)
+        result[label] = {}
+        for name in names:
+            vals = [r[name][0] for r in runs if name in r]
+            higher = next(r[name][1] for r in runs if name in r)
+            result[label][name] = (statistics.median(vals), higher, len(vals))
+    return result
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    ap.add_argument('-t', '--threshold', type=float, default=5.0,
+                    help='percent change that counts as a regression (default 5)')
+    ap.add_argument('baseline')
+    ap.add_argument('candidate')
+    args = ap.parse_args()
+
+    base = load(args.baseline)
+    cand = load(args.candidate)
+    regressions = 0
+
+    for label in sorted(set(base) & set(cand)):
+        print('%s (baseline runs: %d, candidate runs: %d)' % (
+            label,
+            max(v[2] for v in base[label].values()),
+            max(v[2] for v in cand[label].values())))
+        for name in sorted(set(base[label]) & set(cand[label])):
+            b, higher, _ = base[label][name]
+            c = cand[label][name][0]
+            change = (c - b) / b * 100.0 if b else 0.0
+            worse = -change if higher else change
+            flag = ''
+            if worse > args.threshold:
+                flag = '  REGRESSION'
+                regressions += 1
+            elif -worse > args.threshold:
+                flag = '  improved'
+            print('  %-16s %12.2f -> %12.2f  %+7.1f%%%s' % (name, b, c, change, flag))
+
+    for label in sorted(set(base) ^ set(cand)):
+        print('%s: only in %s' % (label, 'baseline' if label in base else 'candidate'))
+
+    if regressions:
+        print('%d regression(s) over %.1f%%' % (regressions, args.threshold))
+    return 1 if regressions else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,337 @@
+/*
+ *	Tiny File System
+ *	File:	microbench.c
+ *
+ *	Microbenchmarks for the core primitives in libtfs. Each benchmark
+ *	drives one function directly on a temp-file disk image (no FUSE) and
+ *	reports ns/op along with block reads and writes per op, sweeping the
+ *	parameter that matters for that path: directory size, disk fullness,
+ *	path depth or I/O size.
+ *
+ *	-z turns on compression, to weigh its CPU cost against the blocks
+ *	it saves on the read/write benchmarks, and -d deduplication, to
+ *	weigh hashing every written block. -r keeps the image in memory
+ *	(RAM mode), to see what is left once the disk is out of the way.
+ *	-s measures whole lookups and reads again on the finished image,
+ *	locked and then remounted sealed.
+ *
+ *	usage: microbench [-f IMAGE] [-i ITERS] [-b NAME] [-z] [-d] [-r] [-s]
+ */
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "../libtfs.h"
+#include "../tfs_mem.h"
+
+static long iters = 2000;
+static const char *only;
+static int compress, dedup, sealed;
+
+struct sample {
+	uint64_t ns;
+	unsigned long reads, writes;
+};
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void sample_start(struct sample *s) {
+	s->reads = bio_read_count;
+	s->writes = bio_write_count;
+	s->ns = now_ns();
+}
+
+static void sample_end(struct sample *s) {
+	s->ns = now_ns() - s->ns;
+	s->reads = bio_read_count - s->reads;
+	s->writes = bio_write_count - s->writes;
+}
+
+static void report(const char *bench, const char *param, long value, struct sample *s, long n) {
+	printf("%-18s %-10s %8ld %12.1f %10.2f %10.2f\n", bench, param, value,
+		(double)s->ns / n, (double)s->reads / n, (double)s->writes / n);
+}
+
+static int enabled(const char *bench) {
+	return only == NULL || strcmp(only, bench) == 0;
+}
+
+static void die(const char *what, int err) {
+	fprintf(stderr, "microbench: %s failed (%d)\n", what, err);
+	exit(1);
+}
+
+/*
+ * Allocator scan cost as the bitmap fills up. Bits are set directly in
+ * the in-memory bitmap, lowest first, which is the order get_avail_*
+ * hands them out in, and restored afterwards.
+ */
+static void bench_alloc(struct tfs_vol *vol) {
+	static const int pcts[] = { 0, 25, 50, 75, 99 };
+	unsigned char saved_d[BLOCK_SIZE], saved_i[BLOCK_SIZE];
+	struct sample s;
+	int p;
+
+	memcpy(saved_d, vol->data_bm, BLOCK_SIZE);
+	memcpy(saved_i, vol->inode_bm, BLOCK_SIZE);
+	for (p = 0; p < (int)(sizeof(pcts) / sizeof(pcts[0])); p++) {
+		int full, i;
+		long n;
+
+		if (enabled("get_avail_blkno")) {
+			full = (long)vol->sb->max_dnum * pcts[p] / 100;
+			for (i = 0; i < full; i++)
+				set_bitmap(vol->data_bm, i);
+			sample_start(&s);
+			for (n = 0; n < iters; n++)
+				get_avail_blkno(vol);
+			sample_end(&s);
+			report("get_avail_blkno", "full%", pcts[p], &s, iters);
+			memcpy(vol->data_bm, saved_d, BLOCK_SIZE);
+		}
+		if (enabled("get_avail_ino")) {
+			full = (long)vol->sb->max_inum * pcts[p] / 100;
+			for (i = 0; i < full; i++)
+				set_bitmap(vol->inode_bm, i);
+			sample_start(&s);
+			for (n = 0; n < iters; n++)
+				get_avail_ino(vol);
+			sample_end(&s);
+			report("get_avail_ino", "full%", pcts[p], &s, iters);
+			memcpy(vol->inode_bm, saved_i, BLOCK_SIZE);
+		}
+	}
+}
+
+static void bench_inode(struct tfs_vol *vol) {
+	struct inode inode;
+	struct sample s;
+	long n;
+
+	readi(vol, 0, &inode);
+	if (enabled("readi")) {
+		sample_start(&s);
+		for (n = 0; n < iters; n++)
+			readi(vol, 0, &inode);
+		sample_end(&s);
+		report("readi", "-", 0, &s, iters);
+	}
+	if (enabled("writei")) {
+		sample_start(&s);
+		for (n = 0; n < iters; n++)
+			writei(vol, 0, &inode);
+		sample_end(&s);
+		report("writei", "-", 0, &s, iters);
+	}
+}
+
+/*
+ * Lookup cost against directory size: the last entry added (found
+ * after scanning everything before it) and a name that is not there.
+ */
+static void bench_dir(struct tfs_vol *vol) {
+	static const int sizes[] = { 1, 16, 64, 128, 256 };
+	char path[64], name[32];
+	struct inode dir;
+	struct dirent de;
+	struct sample s;
+	int created = 0, k, err;
+	long n;
+
+	if (!enabled("dir_find") && !enabled("dir_find_miss"))
+		return;
+	if ((err = tfs_vol_mkdir(vol, "/dirbench", 0755)) < 0)
+		die("mkdir /dirbench", err);
+	for (k = 0; k < (int)(sizeof(sizes) / sizeof(sizes[0])); k++) {
+		for (; created < sizes[k]; created++) {
+			snprintf(path, sizeof(path), "/dirbench/e%d", created);
+			if ((err = tfs_vol_create(vol, path, 0666, NULL)) < 0)
+				die("create", err);
+		}
+		tfs_vol_lookup(vol, "/dirbench", &dir);
+		snprintf(name, sizeof(name), "e%d", created - 1);
+		if (enabled("dir_find")) {
+			sample_start(&s);
+			for (n = 0; n < iters; n++)
+				dir_find(vol, dir.ino, name, strlen(name), &de);
+			sample_end(&s);
+			report("dir_find", "entries", created, &s, iters);
+		}
+		if (enabled("dir_find_miss")) {
+			sample_start(&s);
+			for (n = 0; n < iters; n++)
+				dir_find(vol, dir.ino, "missing", 7, &de);
+			sample_end(&s);
+			report("dir_find_miss", "entries", created, &s, iters);
+		}
+	}
+}
+
+/* Path resolution cost against path depth */
+static void bench_namei(struct tfs_vol *vol) {
+	char path[256] = "";
+	struct inode inode;
+	struct sample s;
+	int depth, err;
+	long n;
+
+	if (!enabled("get_node_by_path"))
+		return;
+	for (depth = 1; depth <= 16; depth++) {
+		strcat(path, "/d");
+		if ((err = tfs_vol_mkdir(vol, path, 0755)) < 0)
+			die("mkdir", err);
+		if (depth != 1 && depth != 2 && depth != 4 && depth != 8 && depth != 16)
+			continue;
+		sample_start(&s);
+		for (n = 0; n < iters; n++) {
+			get_node_by_path(vol, path, 0, &inode);
+			scratch_reset();	/* the core does this as each operation ends */
+		}
+		sample_end(&s);
+		report("get_node_by_path", "depth", depth, &s, iters);
+	}
+}
+
+/* Data path cost against I/O size, overwriting and reading a 64 KiB file */
+static void bench_rw(struct tfs_vol *vol) {
+	static const int sizes[] = { 512, 4096, 16384, 65536 };
+	const long file_size = 16 * BLOCK_SIZE;
+	char *buf = malloc(file_size);
+	struct sample s;
+	uint16_t ino;
+	int k, err;
+	long n;
+
+	if (!enabled("tfs_vol_write") && !enabled("tfs_vol_read"))
+		goto out;
+	memset(buf, 'x', file_size);
+	if ((err = tfs_vol_create(vol, "/rwbench", 0666, &ino)) < 0)
+		die("create /rwbench", err);
+	if ((err = tfs_vol_write(vol, ino, buf, file_size, 0)) < 0)
+		die("prefill", err);
+	for (k = 0; k < (int)(sizeof(sizes) / sizeof(sizes[0])); k++) {
+		long per_file = file_size / sizes[k];
+
+		if (enabled("tfs_vol_write")) {
+			sample_start(&s);
+			for (n = 0; n < iters; n++)
+				tfs_vol_write(vol, ino, buf, sizes[k], (n % per_file) * sizes[k]);
+			sample_end(&s);
+			report("tfs_vol_write", "io_size", sizes[k], &s, iters);
+		}
+		if (enabled("tfs_vol_read")) {
+			sample_start(&s);
+			for (n = 0; n < iters; n++)
+				tfs_vol_read(vol, ino, buf, sizes[k], (n % per_file) * sizes[k]);
+			sample_end(&s);
+			report("tfs_vol_read", "io_size", sizes[k], &s, iters);
+		}
+	}
+out:
+	free(buf);
+}
+
+/*
+ * Whole read-side operations, lock and all: the deepest path bench_namei
+ * made and reads of the bench_rw file. Run on the normal mount and
+ * then on a sealed one, which takes no lock and writes nothing back.
+ */
+static void bench_ro(struct tfs_vol *vol, const char *mode) {
+	static const int sizes[] = { 4096, 65536 };
+	char *buf = malloc(16 * BLOCK_SIZE), name[32], path[256] = "";
+	struct inode inode;
+	struct sample s;
+	int k;
+	long n;
+
+	for (k = 0; k < 16; k++)
+		strcat(path, "/d");
+	if (enabled("get_node_by_path") && tfs_vol_lookup(vol, path, &inode) == 0) {
+		snprintf(name, sizeof(name), "lookup/%s", mode);
+		sample_start(&s);
+		for (n = 0; n < iters; n++)
+			tfs_vol_lookup(vol, path, &inode);
+		sample_end(&s);
+		report(name, "depth", 16, &s, iters);
+	}
+	if (enabled("tfs_vol_read") && tfs_vol_lookup(vol, "/rwbench", &inode) == 0) {
+		snprintf(name, sizeof(name), "read/%s", mode);
+		for (k = 0; k < (int)(sizeof(sizes) / sizeof(sizes[0])); k++) {
+			sample_start(&s);
+			for (n = 0; n < iters; n++)
+				tfs_vol_read(vol, inode.ino, buf, sizes[k], (n % (16 * BLOCK_SIZE / sizes[k])) * sizes[k]);
+			sample_end(&s);
+			report(name, "io_size", sizes[k], &s, iters);
+		}
+	}
+	free(buf);
+}
+
+int main(int argc, char **argv) {
+	char image[] = "/tmp/tfs_microbench.XXXXXX";
+	const char *path = NULL;
+	struct tfs_vol *vol;
+	int opt, fd;
+
+	while ((opt = getopt(argc, argv, "f:i:b:zdrsh")) != -1) {
+		switch (opt) {
+		case 'f': path = optarg; break;
+		case 'i': iters = atol(optarg); break;
+		case 'b': only = optarg; break;
+		case 'z': compress = 1; break;
+		case 'd': dedup = 1; break;
+		case 'r': dev_ram(1); break;
+		case 's': sealed = 1; break;
+		default:
+			fprintf(stderr, "usage: %s [-f IMAGE] [-i ITERS] [-b BENCH] [-z] [-d] [-r] [-s]\n", argv[0]);
+			return 2;
+		}
+	}
+	if (path == NULL) {
+		if ((fd = mkstemp(image)) < 0) {
+			perror("mkstemp");
+			return 1;
+		}
+		close(fd);
+		path = image;
+	}
+	if (tfs_mkfs(path) < 0 || (vol = tfs_mount(path)) == NULL) {
+		fprintf(stderr, "microbench: cannot create image %s\n", path);
+		return 1;
+	}
+	vol->compress = compress;
+	if (dedup && tfs_vol_dedup(vol) < 0) {
+		fprintf(stderr, "microbench: cannot enable dedup\n");
+		return 1;
+	}
+
+	printf("%-18s %-10s %8s %12s %10s %10s\n", "bench", "param", "value",
+		"ns/op", "reads/op", "writes/op");
+	bench_alloc(vol);
+	bench_inode(vol);
+	bench_dir(vol);
+	bench_namei(vol);
+	bench_rw(vol);
+	if (sealed)
+		bench_ro(vol, "locked");
+
+	tfs_unmount(vol);
+	if (sealed) {
+		if ((vol = tfs_mount_sealed(path)) == NULL)
+			die("sealed mount", -EIO);
+		bench_ro(vol, "sealed");
+		tfs_unmount(vol);
+	}
+	if (path == image)
+		unlink(image);
+	return 0;
+}
@@ -9,8 +9,10 @@
 #include <dirent.h>
 #include <time.h>
 
-/* You need to change this macro to your TFS mount point*/
-#define TESTDIR "/tmp/bpl52/mountdir"
+/* TFS mount point; set with `make TESTDIR=/path` */
+#ifndef TESTDIR
+#define TESTDIR "/tmp/mountdir"
+#endif
 
 #define N_FILES 100
 #define BLOCKSIZE 4096
@@ -23,7 +25,8 @@
 char buf[BLOCKSIZE];
 
 int main(int argc, char **argv) {
-	clock_t begin = clock();
+	struct timespec begin, end;
+	clock_gettime(CLOCK_MONOTONIC, &begin);
 
 	int i, fd = 0, ret = 0;
 	struct stat st;
@@ -213,9 +216,9 @@ int main(int argc, char **argv) {
 
 
 	printf("Benchmark completed \n");
-	clock_t end = clock();
-    	double time = (double) (end-begin)/CLOCKS_PER_SEC;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	double time = (end.tv_sec - begin.tv_sec) + (end.tv_nsec - begin.tv_nsec) / 1e9;
 
-    	printf("Time to complete: %f seconds\n", time);
+	printf("Time to complete: %f seconds\n", time);
 	return 0;
 }
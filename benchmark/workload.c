@@ -0,0 +1,464 @@
+/*
+ *	Tiny File System
+ *	File:	workload.c
+ *
+ *	Parameterized workload driver. Runs a mix of data and metadata
+ *	operations against a directory (normally a TFS mount point) from one
+ *	or more threads, timing every operation with a monotonic wall clock.
+ *	Results are printed as a summary and appended to a JSON-lines file
+ *	that compare.py can diff against another run; a run in which an
+ *	operation failed is recorded with "failed": true.
+ */
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <string.h>
+#include <dirent.h>
+#include <time.h>
+#include <pthread.h>
+
+#ifndef TESTDIR
+#define TESTDIR "/tmp/mountdir"
+#endif
+
+#define FSPATHLEN 512
+#define FILEPERM 0666
+#define DIRPERM 0755
+
+/* Operation classes that get their own latency distribution */
+enum { OP_READ, OP_WRITE, OP_META, OP_NCLASS };
+static const char *op_names[OP_NCLASS] = { "read", "write", "meta" };
+
+struct config {
+	const char *dir;		/* directory the workload runs in */
+	const char *label;		/* free-form name recorded with the results */
+	const char *out;		/* JSON-lines output file, NULL for none */
+	int nfiles;				/* files per thread */
+	size_t file_size;		/* size each file is prefilled to */
+	size_t io_size;			/* bytes per read/write call */
+	int random;				/* 0 = sequential offsets, 1 = random */
+	int threads;
+	long ops;				/* measured operations per thread */
+	int meta_pct;			/* percentage of ops that are metadata ops */
+	int write_pct;			/* percentage of data ops that are writes */
+	unsigned seed;
+};
+
+struct lat {
+	uint64_t *ns;
+	long n;
+};
+
+struct worker {
+	pthread_t tid;
+	int id;
+	const struct config *cfg;
+	char root[FSPATHLEN / 2];
+	int *fds;				/* the thread's files, open for the whole run */
+	uint64_t rng;
+	long file_cur;			/* sequential cursor: file index */
+	size_t off_cur;			/* sequential cursor: offset in file */
+	long meta_seq;			/* unique suffix for create/unlink names */
+	struct lat lat[OP_NCLASS];
+	uint64_t bytes;
+	int failed;
+};
+
+static pthread_barrier_t start_barrier;
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* xorshift64*, seeded per thread so runs are reproducible */
+static uint64_t next_rand(struct worker *w) {
+	w->rng ^= w->rng >> 12;
+	w->rng ^= w->rng << 25;
+	w->rng ^= w->rng >> 27;
+	return w->rng * 2685821657736338717ull;
+}
+
+static size_t parse_size(const char *s) {
+	char *end;
+	size_t v = strtoull(s, &end, 10);
+	switch (*end) {
+	case 'k': case 'K': v <<= 10; break;
+	case 'm': case 'M': v <<= 20; break;
+	case 'g': case 'G': v <<= 30; break;
+	}
+	return v;
+}
+
+static void file_path(struct worker *w, long idx, char *path) {
+	snprintf(path, FSPATHLEN, "%s/f%ld", w->root, idx);
+}
+
+/*
+ * Create this thread's directory and prefill its files (not measured).
+ * The files stay open so data ops time only the read or write.
+ */
+static int setup(struct worker *w) {
+	const struct config *cfg = w->cfg;
+	char path[FSPATHLEN];
+	char *buf = malloc(cfg->io_size);
+	int i;
+
+	memset(buf, 0x61 + w->id % 26, cfg->io_size);
+	w->fds = malloc(cfg->nfiles * sizeof(int));
+	if (mkdir(w->root, DIRPERM) < 0 && errno != EEXIST) {
+		perror(w->root);
+		free(buf);
+		return -1;
+	}
+	for (i = 0; i < cfg->nfiles; i++) {
+		int fd;
+		size_t off;
+
+		file_path(w, i, path);
+		if ((fd = open(path, O_CREAT | O_RDWR | O_TRUNC, FILEPERM)) < 0) {
+			perror(path);
+			free(buf);
+			return -1;
+		}
+		for (off = 0; off < cfg->file_size; off += cfg->io_size) {
+			size_t n = cfg->file_size - off < cfg->io_size ?
+				cfg->file_size - off : cfg->io_size;
+			if (pwrite(fd, buf, n, off) != (ssize_t)n) {
+				perror("prefill");
+				close(fd);
+				free(buf);
+				return -1;
+			}
+		}
+		w->fds[i] = fd;
+	}
+	free(buf);
+	return 0;
+}
+
+static void teardown(struct worker *w) {
+	char path[FSPATHLEN];
+	int i;
+
+	for (i = 0; i < w->cfg->nfiles; i++) {
+		close(w->fds[i]);
+		file_path(w, i, path);
+		unlink(path);
+	}
+	free(w->fds);
+	rmdir(w->root);
+}
+
+/* Pick the file and offset for the next data op */
+static void next_target(struct worker *w, long *file, size_t *off) {
+	const struct config *cfg = w->cfg;
+	size_t slots = cfg->file_size / cfg->io_size;
+
+	if (slots == 0)
+		slots = 1;
+	if (cfg->random) {
+		*file = next_rand(w) % cfg->nfiles;
+		*off = (next_rand(w) % slots) * cfg->io_size;
+		return;
+	}
+	if (w->off_cur >= slots * cfg->io_size) {
+		w->off_cur = 0;
+		w->file_cur = (w->file_cur + 1) % cfg->nfiles;
+	}
+	*file = w->file_cur;
+	*off = w->off_cur;
+	w->off_cur += cfg->io_size;
+}
+
+static int do_data(struct worker *w, char *buf, int is_write, long file, size_t off) {
+	ssize_t n;
+
+	if (is_write)
+		n = pwrite(w->fds[file], buf, w->cfg->io_size, off);
+	else
+		n = pread(w->fds[file], buf, w->cfg->io_size, off);
+	if (n < 0) {
+		perror(is_write ? "pwrite" : "pread");
+		return -1;
+	}
+	w->bytes += n;
+	return 0;
+}
+
+/*
+ * One metadata operation, rotating through stat, create+unlink,
+ * mkdir+rmdir and a full readdir of the thread's directory.
+ */
+static int do_meta(struct worker *w) {
+	char path[FSPATHLEN];
+	struct stat st;
+	DIR *dir;
+	int fd;
+
+	switch (next_rand(w) % 4) {
+	case 0:
+		file_path(w, next_rand(w) % w->cfg->nfiles, path);
+		return stat(path, &st);
+	case 1:
+		snprintf(path, FSPATHLEN, "%s/m%ld", w->root, w->meta_seq++);
+		if ((fd = open(path, O_CREAT | O_WRONLY, FILEPERM)) < 0)
+			return -1;
+		close(fd);
+		return unlink(path);
+	case 2:
+		snprintf(path, FSPATHLEN, "%s/d%ld", w->root, w->meta_seq++);
+		if (mkdir(path, DIRPERM) < 0)
+			return -1;
+		return rmdir(path);
+	default:
+		if ((dir = opendir(w->root)) == NULL)
+			return -1;
+		while (readdir(dir) != NULL)
+			;
+		closedir(dir);
+		return 0;
+	}
+}
+
+static void *run_worker(void *arg) {
+	struct worker *w = arg;
+	const struct config *cfg = w->cfg;
+	char *buf = malloc(cfg->io_size);
+	long i;
+
+	memset(buf, 0x41 + w->id % 26, cfg->io_size);
+	pthread_barrier_wait(&start_barrier);
+	for (i = 0; i < cfg->ops && !w->failed; i++) {
+		int cls, ret;
+		uint64_t t0;
+		long file = 0;
+		size_t off = 0;
+
+		if ((int)(next_rand(w) % 100) < cfg->meta_pct)
+			cls = OP_META;
+		else if ((int)(next_rand(w) % 100) < cfg->write_pct)
+			cls = OP_WRITE;
+		else
+			cls = OP_READ;
+		if (cls != OP_META)
+			next_target(w, &file, &off);
+
+		t0 = now_ns();
+		if (cls == OP_META)
+			ret = do_meta(w);
+		else
+			ret = do_data(w, buf, cls == OP_WRITE, file, off);
+		w->lat[cls].ns[w->lat[cls].n++] = now_ns() - t0;
+		if (ret < 0) {
+			fprintf(stderr, "thread %d: %s op failed: %s\n", w->id,
+				op_names[cls], strerror(errno));
+			w->failed = 1;
+		}
+	}
+	free(buf);
+	return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+struct summary {
+	long count;
+	double mean_us, p50_us, p99_us, max_us;
+};
+
+static double pct(const uint64_t *v, long n, double p) {
+	long idx = (long)(p * (n - 1) + 0.5);
+	return v[idx] / 1000.0;
+}
+
+/* Merge one class across all workers and compute its distribution */
+static struct summary summarize(struct worker *ws, int nw, int cls) {
+	struct summary s = { 0 };
+	uint64_t *all;
+	double sum = 0;
+	long n = 0, i;
+	int t;
+
+	for (t = 0; t < nw; t++)
+		n += ws[t].lat[cls].n;
+	if (n == 0)
+		return s;
+	all = malloc(n * sizeof(uint64_t));
+	n = 0;
+	for (t = 0; t < nw; t++) {
+		memcpy(all + n, ws[t].lat[cls].ns, ws[t].lat[cls].n * sizeof(uint64_t));
+		n += ws[t].lat[cls].n;
+	}
+	qsort(all, n, sizeof(uint64_t), cmp_u64);
+	for (i = 0; i < n; i++)
+		sum += all[i];
+	s.count = n;
+	s.mean_us = sum / n / 1000.0;
+	s.p50_us = pct(all, n, 0.50);
+	s.p99_us = pct(all, n, 0.99);
+	s.max_us = all[n - 1] / 1000.0;
+	free(all);
+	return s;
+}
+
+/* Write s as a JSON string, quoted and escaped */
+static void json_string(FILE *f, const char *s) {
+	fputc('"', f);
+	for (; *s; s++) {
+		if (*s == '"' || *s == '\\')
+			fprintf(f, "\\%c", *s);
+		else if ((unsigned char)*s < 0x20)
+			fprintf(f, "\\u%04x", (unsigned char)*s);
+		else
+			fputc(*s, f);
+	}
+	fputc('"', f);
+}
+
+static void write_json(FILE *f, const struct config *cfg, double elapsed,
+		long total_ops, uint64_t bytes, struct summary *sum, int failed) {
+	int c;
+
+	fprintf(f, "{\"label\":");
+	json_string(f, cfg->label);
+	fprintf(f, ",\"timestamp\":%ld,\"failed\":%s,", (long)time(NULL), failed ? "true" : "false");
+	fprintf(f, "\"config\":{\"nfiles\":%d,\"file_size\":%zu,\"io_size\":%zu,"
+		"\"pattern\":\"%s\",\"threads\":%d,\"ops\":%ld,\"meta_pct\":%d,"
+		"\"write_pct\":%d,\"seed\":%u},",
+		cfg->nfiles, cfg->file_size, cfg->io_size,
+		cfg->random ? "random" : "seq", cfg->threads, cfg->ops,
+		cfg->meta_pct, cfg->write_pct, cfg->seed);
+	fprintf(f, "\"elapsed_s\":%.6f,\"ops_per_s\":%.1f,\"mib_per_s\":%.3f,",
+		elapsed, total_ops / elapsed, bytes / elapsed / (1 << 20));
+	fprintf(f, "\"latency_us\":{");
+	for (c = 0; c < OP_NCLASS; c++) {
+		fprintf(f, "%s\"%s\":{\"count\":%ld,\"mean\":%.2f,\"p50\":%.2f,"
+			"\"p99\":%.2f,\"max\":%.2f}", c ? "," : "", op_names[c],
+			sum[c].count, sum[c].mean_us, sum[c].p50_us, sum[c].p99_us,
+			sum[c].max_us);
+	}
+	fprintf(f, "}}\n");
+}
+
+static void usage(const char *prog) {
+	fprintf(stderr,
+		"usage: %s [options]\n"
+		"  -d DIR     directory to run in (default " TESTDIR ")\n"
+		"  -n N       files per thread (default 8)\n"
+		"  -s SIZE    file size, k/m suffix allowed (default 64k)\n"
+		"  -b SIZE    I/O size per read/write (default 4k)\n"
+		"  -p PAT     seq or random (default seq)\n"
+		"  -t N       threads (default 1)\n"
+		"  -N N       measured ops per thread (default 1000)\n"
+		"  -m PCT     percent of ops that are metadata ops (default 0)\n"
+		"  -w PCT     percent of data ops that are writes (default 50)\n"
+		"  -S SEED    random seed (default 1)\n"
+		"  -l LABEL   label stored with the results\n"
+		"  -o FILE    append JSON results to FILE\n", prog);
+	exit(2);
+}
+
+int main(int argc, char **argv) {
+	struct config cfg = {
+		.dir = TESTDIR, .label = "default", .out = NULL,
+		.nfiles = 8, .file_size = 64 << 10, .io_size = 4 << 10,
+		.random = 0, .threads = 1, .ops = 1000,
+		.meta_pct = 0, .write_pct = 50, .seed = 1,
+	};
+	struct summary sum[OP_NCLASS];
+	struct worker *ws;
+	uint64_t bytes = 0, t0, t1;
+	long total_ops = 0;
+	double elapsed;
+	int opt, t, c, failed = 0;
+
+	while ((opt = getopt(argc, argv, "d:n:s:b:p:t:N:m:w:S:l:o:h")) != -1) {
+		switch (opt) {
+		case 'd': cfg.dir = optarg; break;
+		case 'n': cfg.nfiles = atoi(optarg); break;
+		case 's': cfg.file_size = parse_size(optarg); break;
+		case 'b': cfg.io_size = parse_size(optarg); break;
+		case 'p': cfg.random = strcmp(optarg, "random") == 0; break;
+		case 't': cfg.threads = atoi(optarg); break;
+		case 'N': cfg.ops = atol(optarg); break;
+		case 'm': cfg.meta_pct = atoi(optarg); break;
+		case 'w': cfg.write_pct = atoi(optarg); break;
+		case 'S': cfg.seed = strtoul(optarg, NULL, 10); break;
+		case 'l': cfg.label = optarg; break;
+		case 'o': cfg.out = optarg; break;
+		default: usage(argv[0]);
+		}
+	}
+	if (cfg.nfiles < 1 || cfg.threads < 1 || cfg.io_size == 0 || cfg.ops < 1)
+		usage(argv[0]);
+
+	ws = calloc(cfg.threads, sizeof(struct worker));
+	for (t = 0; t < cfg.threads; t++) {
+		struct worker *w = &ws[t];
+		w->id = t;
+		w->cfg = &cfg;
+		w->rng = (cfg.seed + 1) * 0x9E3779B97F4A7C15ull + t;
+		snprintf(w->root, sizeof(w->root), "%s/wl%d.t%d", cfg.dir, (int)getpid(), t);
+		for (c = 0; c < OP_NCLASS; c++)
+			w->lat[c].ns = malloc(cfg.ops * sizeof(uint64_t));
+		if (setup(w) < 0)
+			return 1;
+	}
+
+	pthread_barrier_init(&start_barrier, NULL, cfg.threads + 1);
+	for (t = 0; t < cfg.threads; t++)
+		pthread_create(&ws[t].tid, NULL, run_worker, &ws[t]);
+	pthread_barrier_wait(&start_barrier);
+	t0 = now_ns();
+	for (t = 0; t < cfg.threads; t++)
+		pthread_join(ws[t].tid, NULL);
+	t1 = now_ns();
+	elapsed = (t1 - t0) / 1e9;
+
+	for (t = 0; t < cfg.threads; t++) {
+		bytes += ws[t].bytes;
+		failed |= ws[t].failed;
+		teardown(&ws[t]);
+	}
+	for (c = 0; c < OP_NCLASS; c++) {
+		sum[c] = summarize(ws, cfg.threads, c);
+		total_ops += sum[c].count;
+	}
+
+	printf("%s: %ld ops in %.3f s, %.1f ops/s, %.2f MiB/s\n", cfg.label,
+		total_ops, elapsed, total_ops / elapsed, bytes / elapsed / (1 << 20));
+	for (c = 0; c < OP_NCLASS; c++) {
+		if (sum[c].count == 0)
+			continue;
+		printf("  %-5s n=%-8ld mean=%.1fus p50=%.1fus p99=%.1fus max=%.1fus\n",
+			op_names[c], sum[c].count, sum[c].mean_us, sum[c].p50_us,
+			sum[c].p99_us, sum[c].max_us);
+	}
+
+	if (cfg.out) {
+		FILE *f = fopen(cfg.out, "a");
+		if (f == NULL) {
+			perror(cfg.out);
+			return 1;
+		}
+		write_json(f, &cfg, elapsed, total_ops, bytes, sum, failed);
+		fclose(f);
+	}
+
+	for (t = 0; t < cfg.threads; t++)
+		for (c = 0; c < OP_NCLASS; c++)
+			free(ws[t].lat[c].ns);
+	free(ws);
+	return failed;
+}
@@ -12,56 +12,563 @@
 #include <string.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
 
 #include "block.h"
 
-//Disk size set to 32MB
+//Disk size set to 32MB, split evenly across the members of a striped disk
 #define DISK_SIZE	32*1024*1024
 
-int diskfile = -1;
-pthread_mutex_t lock;
+/*
+ * The disk is one backing file, or several named in a ':' separated
+ * list and striped RAID-0 style: stripe_unit consecutive blocks on each
+ * member in turn. A single member is laid out exactly as before.
+ *
+ * bio_read and bio_write touch one member and run on the caller's
+ * thread. bio_readv and bio_writev split a run of blocks into one
+ * request per member (a member's share of a logical run is contiguous
+ * in its file) and hand all but the first to the members' own I/O
+ * threads, so the pieces proceed in parallel.
+ *
+ * In RAM mode (dev_ram, before the disk is opened) the whole disk is
+ * loaded into memory when it is opened and every bio_* call is served
+ * from there. The backing files are only written by snapshots, which
+ * dev_snap_copy takes and dev_snap_write stores, and when the disk is
+ * closed. Memory is held in segments of RAM_SEG blocks, allocated as
+ * blocks are first loaded or written, with a bit per block written
+ * since the last snapshot. A snapshot never writes a member in place:
+ * it goes into a copy of the member that is synced and then renamed
+ * over it, so a crash leaves the member as one snapshot or the next.
+ *
+ * A disk opened read-only (dev_open_rdonly) has its members mapped into
+ * memory, so bio_read and bio_readv are a memcpy out of the mapping with
+ * no system call and no I/O thread; writes fail. RAM mode takes the
+ * place of the mapping when both are asked for.
+ */
+
+#define RAM_SEG 256
+
+/* One member's share of a bio_readv/bio_writev */
+struct io_req {
+    struct io_req *next;
+    int write;
+    int fd;
+    off_t pos;
+    struct iovec *iov;
+    int iovcnt;
+    ssize_t ret;
+    struct io_batch *batch;
+};
+
+/* The requests of one call, which waits for them all */
+struct io_batch {
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+    int pending;
+};
+
+struct member {
+    int fd;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cv;
+    struct io_req *head, *tail;
+    int stop;
+    char *map;		//read-only mapping of the member, NULL if none
+    off_t size;		//bytes mapped
+    char *path;		//file name, for snapshots to rename their copy over
+};
+
+static struct member members[DEV_MAX_MEMBERS] = { { .fd = -1 } };
+static int nmembers = 1;
+static int stripe_unit = DEV_STRIPE_UNIT;
+unsigned long bio_read_count = 0;
+unsigned long bio_write_count = 0;
+
+static int ram;
+static int rdonly;
+static char *ram_seg[DEV_RAM_BLOCKS / RAM_SEG];
+static unsigned char ram_dirty[DEV_RAM_BLOCKS / 8];
+static pthread_mutex_t ram_lock = PTHREAD_MUTEX_INITIALIZER;
+/* Blocks copied aside by dev_snap_copy for dev_snap_write */
+static int *snap_blk;
+static char *snap_data;
+static int snap_count;
+
+static int bio_rw(int write, const int block_num, void *const *bufs, int count);
+
+//Map a block number to its member and byte position in that member
+static int locate(const int block_num, off_t *pos) {
+    int stripe = block_num / stripe_unit;
+    *pos = ((off_t)(stripe / nmembers) * stripe_unit + block_num % stripe_unit) * BLOCK_SIZE;
+    return stripe % nmembers;
+}
+
+//Set the stripe unit in blocks; takes effect at the next open
+void dev_stripe_unit(int blocks) {
+    if (blocks > 0) {
+		stripe_unit = blocks;
+    }
+}
+
+//Run one request, reading holes past the end of a member as zeros
+static void do_io(struct io_req *r) {
+    ssize_t got;
+    int i;
+
+    if (r->write) {
+		r->ret = pwritev(r->fd, r->iov, r->iovcnt, r->pos);
+		return;
+    }
+    r->ret = got = preadv(r->fd, r->iov, r->iovcnt, r->pos);
+    if (got < 0) {
+		got = 0;
+    }
+    for (i = 0; i < r->iovcnt; i++) {
+		ssize_t len = r->iov[i].iov_len;
+		if (got < len) {
+			memset((char *)r->iov[i].iov_base + got, 0, len - got);
+		}
+		got = got > len ? got - len : 0;
+    }
+}
+
+static void *member_thread(void *arg) {
+    struct member *mb = arg;
+    struct io_req *r;
+
+    pthread_mutex_lock(&mb->lock);
+    for (;;) {
+		while (mb->head == NULL && !mb->stop) {
+			pthread_cond_wait(&mb->cv, &mb->lock);
+		}
+		if ((r = mb->head) == NULL) {
+			break;
+		}
+		mb->head = r->next;
+		pthread_mutex_unlock(&mb->lock);
+		do_io(r);
+		pthread_mutex_lock(&r->batch->lock);
+		if (--r->batch->pending == 0) {
+			pthread_cond_signal(&r->batch->done);
+		}
+		pthread_mutex_unlock(&r->batch->lock);
+		pthread_mutex_lock(&mb->lock);
+    }
+    pthread_mutex_unlock(&mb->lock);
+    return NULL;
+}
+
+//Address of a block in memory, allocating its segment if create is set
+static char *ram_block(const int block_num, int create) {
+    char **seg, *p;
+
+    if (block_num < 0 || block_num >= DEV_RAM_BLOCKS) {
+		return NULL;
+    }
+    seg = &ram_seg[block_num / RAM_SEG];
+    p = __atomic_load_n(seg, __ATOMIC_ACQUIRE);
+    if (p == NULL && create) {
+		p = calloc(RAM_SEG, BLOCK_SIZE);
+		__atomic_store_n(seg, p, __ATOMIC_RELEASE);
+    }
+    return p ? p + (size_t)(block_num % RAM_SEG) * BLOCK_SIZE : NULL;
+}
+
+static int ram_read(const int block_num, void *buf) {
+    char *p = ram_block(block_num, 0);
+
+    if (p == NULL) {
+		memset(buf, 0, BLOCK_SIZE);
+    } else {
+		memcpy(buf, p, BLOCK_SIZE);
+    }
+    return BLOCK_SIZE;
+}
+
+static int ram_write(const int block_num, const void *buf) {
+    char *p;
+
+    pthread_mutex_lock(&ram_lock);
+    if ((p = ram_block(block_num, 1)) == NULL) {
+		pthread_mutex_unlock(&ram_lock);
+		fprintf(stderr, "block_write failed: block %d is past the RAM disk\n", block_num);
+		return -1;
+    }
+    memcpy(p, buf, BLOCK_SIZE);
+    ram_dirty[block_num / 8] |= 1 << (block_num % 8);
+    pthread_mutex_unlock(&ram_lock);
+    return BLOCK_SIZE;
+}
+
+//Load every member into memory, mapping member blocks back to disk blocks.
+//Blocks that read as zeros are left out until they are written.
+static int ram_load(void) {
+    static const char zero[BLOCK_SIZE];
+    char *buf = malloc(RAM_SEG * BLOCK_SIZE), *p;
+    off_t size, mb, i;
+    ssize_t got;
+    int m, blk;
+
+    for (m = 0; m < nmembers; m++) {
+		size = lseek(members[m].fd, 0, SEEK_END);
+		for (mb = 0; mb * BLOCK_SIZE < size; mb += RAM_SEG) {
+			if ((got = pread(members[m].fd, buf, RAM_SEG * BLOCK_SIZE, mb * BLOCK_SIZE)) < 0) {
+				perror("disk_open failed");
+				free(buf);
+				return -1;
+			}
+			for (i = 0; i < got / BLOCK_SIZE; i++) {
+				if (memcmp(buf + i * BLOCK_SIZE, zero, BLOCK_SIZE) == 0) {
+					continue;
+				}
+				blk = ((mb + i) / stripe_unit * nmembers + m) * stripe_unit + (mb + i) % stripe_unit;
+				if ((p = ram_block(blk, 1)) == NULL) {
+					fprintf(stderr, "disk_open failed: larger than %d blocks\n", DEV_RAM_BLOCKS);
+					free(buf);
+					return -1;
+				}
+				memcpy(p, buf + i * BLOCK_SIZE, BLOCK_SIZE);
+			}
+		}
+    }
+    free(buf);
+    return 0;
+}
+
+static void ram_free(void) {
+    int i;
+
+    for (i = 0; i < DEV_RAM_BLOCKS / RAM_SEG; i++) {
+		free(ram_seg[i]);
+		ram_seg[i] = NULL;
+    }
+    memset(ram_dirty, 0, sizeof(ram_dirty));
+}
+
+//Serve the disk from memory from the next open on
+void dev_ram(int on) {
+    ram = on;
+}
+
+//Copy the blocks written since the last snapshot aside, to be stored by
+//dev_snap_write. Only the copy is done under the lock, so bio_* calls
+//carry on while the snapshot is written out. Returns the number of
+//blocks copied, 0 when not in RAM mode or nothing was written, in which
+//case there is nothing for dev_snap_write to do.
+int dev_snap_copy() {
+    int b, i, n = 0;
+
+    if (!ram || members[0].fd < 0) {
+		return 0;
+    }
+    if (snap_blk != NULL) {
+		fprintf(stderr, "snapshot failed: the last one was not written\n");
+		return -1;
+    }
+    pthread_mutex_lock(&ram_lock);
+    for (b = 0; b < DEV_RAM_BLOCKS / 8; b++) {
+		n += __builtin_popcount(ram_dirty[b]);
+    }
+    if (n == 0) {
+		pthread_mutex_unlock(&ram_lock);
+		return 0;
+    }
+    snap_blk = malloc(n * sizeof(int));
+    snap_data = malloc((size_t)n * BLOCK_SIZE);
+    for (b = 0, i = 0; b < DEV_RAM_BLOCKS && i < n; b++) {
+		if (ram_dirty[b / 8] == 0) {
+			b += 7;
+			continue;
+		}
+		if (ram_dirty[b / 8] & (1 << (b % 8))) {
+			snap_blk[i] = b;
+			memcpy(snap_data + (size_t)i * BLOCK_SIZE, ram_block(b, 0), BLOCK_SIZE);
+			i++;
+		}
+    }
+    memset(ram_dirty, 0, sizeof(ram_dirty));
+    pthread_mutex_unlock(&ram_lock);
+    snap_count = n;
+    return n;
+}
+
+//Copy member m into a new file path.snap next to it, returning its fd
+static int snap_open(int m) {
+    char *buf = malloc(RAM_SEG * BLOCK_SIZE), *tmp = malloc(strlen(members[m].path) + 6);
+    struct stat st;
+    ssize_t got = 0;
+    off_t pos;
+    int fd;
+
+    sprintf(tmp, "%s.snap", members[m].path);
+    fd = open(tmp, O_CREAT | O_TRUNC | O_RDWR, S_IRUSR | S_IWUSR);
+    if (fd >= 0 && fstat(members[m].fd, &st) == 0) {
+		fchmod(fd, st.st_mode & 07777);
+    }
+    for (pos = 0; fd >= 0; pos += got) {
+		if ((got = pread(members[m].fd, buf, RAM_SEG * BLOCK_SIZE, pos)) <= 0 ||
+				pwrite(fd, buf, got, pos) != got) {
+			break;
+		}
+    }
+    if (fd >= 0 && got < 0) {
+		close(fd);
+		unlink(tmp);
+		fd = -1;
+    }
+    if (fd < 0) {
+		perror("snapshot failed");
+    }
+    free(tmp);
+    free(buf);
+    return fd;
+}
+
+//Rename member m's synced copy over the member, or throw the copy away
+static int snap_close(int m, int old, int ok) {
+    char *tmp = malloc(strlen(members[m].path) + 6);
+    int retstat = 0;
+
+    sprintf(tmp, "%s.snap", members[m].path);
+    if (ok && rename(tmp, members[m].path) == 0) {
+		close(old);
+    } else {
+		close(members[m].fd);
+		members[m].fd = old;
+		unlink(tmp);
+		retstat = -1;
+    }
+    free(tmp);
+    return retstat;
+}
+
+//Store the blocks dev_snap_copy took. They are written into a copy of
+//each member, which is synced and renamed over the member. If anything
+//fails the members are left as they were and every block is marked
+//written again for the next snapshot. With several members a crash
+//between two renames can leave them from consecutive snapshots.
+int dev_snap_write() {
+    void *bufs[RAM_SEG];
+    int old[DEV_MAX_MEMBERS];
+    int i, j, k, m, retstat = 0;
+
+    if (snap_blk == NULL) {
+		return 0;
+    }
+    for (m = 0; m < nmembers; m++) {
+		old[m] = members[m].fd;
+		if ((members[m].fd = snap_open(m)) < 0) {
+			members[m].fd = old[m];
+			retstat = -1;
+			break;
+		}
+    }
+    for (i = 0; i < snap_count && retstat == 0; i = j) {
+		for (j = i + 1; j < snap_count && j - i < RAM_SEG && snap_blk[j] == snap_blk[j - 1] + 1; j++)
+			;
+		for (k = i; k < j; k++) {
+			bufs[k - i] = snap_data + (size_t)k * BLOCK_SIZE;
+		}
+		if (bio_rw(1, snap_blk[i], bufs, j - i) < 0) {
+			retstat = -1;
+		}
+    }
+    // The copies are put in place only once every one of them is on disk
+    for (k = 0; k < m && retstat == 0; k++) {
+		if (fsync(members[k].fd) < 0) {
+			retstat = -1;
+		}
+    }
+    for (k = 0; k < m; k++) {
+		if (snap_close(k, old[k], retstat == 0) < 0) {
+			retstat = -1;
+		}
+    }
+    if (retstat < 0) {
+		pthread_mutex_lock(&ram_lock);
+		for (k = 0; k < snap_count; k++) {
+			ram_dirty[snap_blk[k] / 8] |= 1 << (snap_blk[k] % 8);
+		}
+		pthread_mutex_unlock(&ram_lock);
+    }
+    free(snap_blk);
+    free(snap_data);
+    snap_blk = NULL;
+    snap_count = 0;
+    return retstat;
+}
+
+static void close_members(void) {
+    int i;
+
+    for (i = 0; i < nmembers; i++) {
+		if (nmembers > 1) {
+			pthread_mutex_lock(&members[i].lock);
+			members[i].stop = 1;
+			pthread_cond_signal(&members[i].cv);
+			pthread_mutex_unlock(&members[i].lock);
+			pthread_join(members[i].thread, NULL);
+		}
+		if (members[i].map != NULL) {
+			munmap(members[i].map, members[i].size);
+		}
+		if (members[i].fd >= 0) {
+			close(members[i].fd);
+		}
+		free(members[i].path);
+		memset(&members[i], 0, sizeof(struct member));
+		members[i].fd = -1;
+    }
+    nmembers = 1;
+}
+
+//Open every member named in spec, starting their I/O threads if there are several
+static int open_members(const char* spec, int flags) {
+    char *list = strdup(spec), *save, *path;
+    int n = 0, i;
+
+    for (path = strtok_r(list, ":", &save); path != NULL; path = strtok_r(NULL, ":", &save)) {
+		if (n == DEV_MAX_MEMBERS) {
+			fprintf(stderr, "disk_open failed: more than %d members\n", DEV_MAX_MEMBERS);
+			break;
+		}
+		members[n].fd = open(path, flags, S_IRUSR | S_IWUSR);
+		if (members[n].fd < 0) {
+			perror("disk_open failed");
+			break;
+		}
+		members[n].path = strdup(path);
+		n++;
+    }
+    free(list);
+    if (n == 0 || path != NULL) {
+		while (n > 0) {
+			close(members[--n].fd);
+			free(members[n].path);
+			members[n].path = NULL;
+			members[n].fd = -1;
+		}
+		return -1;
+    }
+    nmembers = n;
+    for (i = 0; i < nmembers && nmembers > 1; i++) {
+		pthread_mutex_init(&members[i].lock, NULL);
+		pthread_cond_init(&members[i].cv, NULL);
+		pthread_create(&members[i].thread, NULL, member_thread, &members[i]);
+    }
+    if (ram && ram_load() < 0) {
+		ram_free();
+		close_members();
+		return -1;
+    }
+    // A member that cannot be mapped is read with pread instead
+    for (i = 0; i < nmembers && rdonly && !ram; i++) {
+		members[i].size = lseek(members[i].fd, 0, SEEK_END);
+		members[i].map = members[i].size > 0 ?
+			mmap(NULL, members[i].size, PROT_READ, MAP_SHARED, members[i].fd, 0) : MAP_FAILED;
+		if (members[i].map == MAP_FAILED) {
+			members[i].map = NULL;
+		}
+    }
+    return 0;
+}
 
-//Creates a file which is your new emulated disk
+//Creates the member files of your new emulated disk
 void dev_init(const char* diskfile_path) {
-    if (diskfile >= 0) {
+    off_t stripe = (off_t)stripe_unit * BLOCK_SIZE;
+    int i;
+
+    if (members[0].fd >= 0) {
 		return;
     }
-    
-    diskfile = open(diskfile_path, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
-    if (diskfile < 0) {
-		perror("disk_open failed");
+
+    if (open_members(diskfile_path, O_CREAT | O_RDWR) < 0) {
 		exit(EXIT_FAILURE);
     }
-	
-    ftruncate(diskfile, DISK_SIZE);
+    for (i = 0; i < nmembers; i++) {
+		ftruncate(members[i].fd, (DISK_SIZE / nmembers + stripe - 1) / stripe * stripe);
+    }
 }
 
-//Function to open the disk file
+//Function to open the disk file(s)
 int dev_open(const char* diskfile_path) {
-    if (diskfile >= 0) {
+    if (members[0].fd >= 0) {
+		return 0;
+    }
+    return open_members(diskfile_path, O_RDWR);
+}
+
+//Open the disk file(s) read-only, mapped into memory; dev_close ends it
+int dev_open_rdonly(const char* diskfile_path) {
+    if (members[0].fd >= 0) {
 		return 0;
     }
-    
-    diskfile = open(diskfile_path, O_RDWR, S_IRUSR | S_IWUSR);
-    if (diskfile < 0) {
-		perror("disk_open failed");
+    rdonly = 1;
+    if (open_members(diskfile_path, O_RDONLY) < 0) {
+		rdonly = 0;
 		return -1;
     }
-	return 0;
+    return 0;
 }
 
 void dev_close() {
-    if (diskfile >= 0) {
-		close(diskfile);
+    if (members[0].fd >= 0) {
+		// A RAM disk writes out what the last snapshot missed
+		if (ram && dev_snap_copy() > 0) {
+			dev_snap_write();
+		}
+		if (ram) {
+			ram_free();
+		}
+		close_members();
+		rdonly = 0;
     }
 }
 
+//Flush every member to stable storage
+int dev_sync() {
+    int i, retstat = 0;
+
+    for (i = 0; i < nmembers; i++) {
+		if (members[i].fd >= 0 && fsync(members[i].fd) < 0) {
+			retstat = -1;
+		}
+    }
+    return retstat;
+}
+
+//Copy a block out of a member's mapping, past its end as zeros
+static int map_read(const struct member *mb, off_t pos, void *buf) {
+    off_t len = mb->size - pos;
+
+    if (len >= BLOCK_SIZE) {
+		memcpy(buf, mb->map + pos, BLOCK_SIZE);
+		return BLOCK_SIZE;
+    }
+    len = len > 0 ? len : 0;
+    memcpy(buf, mb->map + pos, len);
+    memset((char *)buf + len, 0, BLOCK_SIZE - len);
+    return BLOCK_SIZE;
+}
+
 //Read a block from the disk
 int bio_read(const int block_num, void *buf) {
     int retstat = 0;
-    retstat = pread(diskfile, buf, BLOCK_SIZE, block_num*BLOCK_SIZE);
+    off_t pos;
+    int m = locate(block_num, &pos);
+    __atomic_add_fetch(&bio_read_count, 1, __ATOMIC_RELAXED);
+    if (ram) {
+		return ram_read(block_num, buf);
+    }
+    if (members[m].map != NULL) {
+		return map_read(&members[m], pos, buf);
+    }
+    retstat = pread(members[m].fd, buf, BLOCK_SIZE, pos);
     if (retstat <= 0) {
 		memset (buf, 0, BLOCK_SIZE);
 		if (retstat < 0)
@@ -71,13 +578,154 @@ int bio_read(const int block_num, void *buf) {
     return retstat;
 }
 
+//Return the file descriptor and byte position backing a block, so callers
+//can move data to or from it without a bio_read/bio_write copy. A RAM
+//disk has no file behind its blocks and returns -1.
+int bio_fd(const int block_num, off_t *pos) {
+    int m = locate(block_num, pos);
+    return ram ? -1 : members[m].fd;
+}
+
 //Write a block to the disk
 int bio_write(const int block_num, const void *buf) {
     int retstat = 0;
-    retstat = pwrite(diskfile, buf, BLOCK_SIZE, block_num*BLOCK_SIZE);
+    off_t pos;
+    int m = locate(block_num, &pos);
+    __atomic_add_fetch(&bio_write_count, 1, __ATOMIC_RELAXED);
+    if (rdonly) {
+		fprintf(stderr, "block_write failed: the disk is read-only\n");
+		return -1;
+    }
+    if (ram) {
+		return ram_write(block_num, buf);
+    }
+    retstat = pwrite(members[m].fd, buf, BLOCK_SIZE, pos);
     if (retstat < 0) {
 		    perror("block_write failed");
     }
     return retstat;
 }
 
+//Move count consecutive blocks, one request per member, in parallel
+static int bio_rw(int write, const int block_num, void *const *bufs, int count) {
+    struct iovec iov[count];
+    struct io_req req[DEV_MAX_MEMBERS];
+    struct io_batch batch;
+    int i, m, first = -1, retstat = 0;
+    off_t pos;
+
+    if (count <= 0) {
+		return 0;
+    }
+    // Each member's blocks, in order, get a slice of iov
+    memset(req, 0, sizeof(req));
+    for (i = 0; i < count; i++) {
+		req[locate(block_num + i, &pos)].iovcnt++;
+    }
+    for (m = 0, i = 0; m < nmembers; m++) {
+		req[m].iov = iov + i;
+		i += req[m].iovcnt;
+		req[m].iovcnt = 0;
+    }
+    for (i = 0; i < count; i++) {
+		m = locate(block_num + i, &pos);
+		if (req[m].iovcnt == 0) {
+			req[m].pos = pos;
+			first = first < 0 ? m : first;
+		}
+		req[m].iov[req[m].iovcnt].iov_base = bufs[i];
+		req[m].iov[req[m].iovcnt].iov_len = BLOCK_SIZE;
+		req[m].iovcnt++;
+    }
+
+    pthread_mutex_init(&batch.lock, NULL);
+    pthread_cond_init(&batch.done, NULL);
+    batch.pending = 0;
+    for (m = 0; m < nmembers; m++) {
+		if (req[m].iovcnt == 0) {
+			continue;
+		}
+		req[m].write = write;
+		req[m].fd = members[m].fd;
+		req[m].batch = &batch;
+		if (m == first) {
+			continue;
+		}
+		batch.pending++;
+		pthread_mutex_lock(&members[m].lock);
+		if (members[m].head == NULL) {
+			members[m].head = &req[m];
+		} else {
+			members[m].tail->next = &req[m];
+		}
+		members[m].tail = &req[m];
+		pthread_cond_signal(&members[m].cv);
+		pthread_mutex_unlock(&members[m].lock);
+    }
+    if (first >= 0) {
+		do_io(&req[first]);
+    }
+    pthread_mutex_lock(&batch.lock);
+    while (batch.pending > 0) {
+		pthread_cond_wait(&batch.done, &batch.lock);
+    }
+    pthread_mutex_unlock(&batch.lock);
+    pthread_cond_destroy(&batch.done);
+    pthread_mutex_destroy(&batch.lock);
+
+    for (m = 0; m < nmembers; m++) {
+		if (req[m].iovcnt > 0 && req[m].ret < 0) {
+			perror(write ? "block_write failed" : "block_read failed");
+			return -1;
+		}
+		retstat += req[m].iovcnt > 0 ? req[m].ret : 0;
+    }
+    return retstat;
+}
+
+//Read count consecutive blocks into separate buffers in one call
+int bio_readv(const int block_num, void *const *bufs, int count) {
+    off_t pos;
+    int i, m;
+
+    __atomic_add_fetch(&bio_read_count, 1, __ATOMIC_RELAXED);
+    if (ram) {
+		for (i = 0; i < count; i++) {
+			ram_read(block_num + i, bufs[i]);
+		}
+		return count * BLOCK_SIZE;
+    }
+    if (members[0].map != NULL) {
+		for (i = 0; i < count; i++) {
+			m = locate(block_num + i, &pos);
+			if (members[m].map == NULL) {
+				break;
+			}
+			map_read(&members[m], pos, bufs[i]);
+		}
+		if (i == count) {
+			return count * BLOCK_SIZE;
+		}
+    }
+    return bio_rw(0, block_num, bufs, count);
+}
+
+//Write count consecutive blocks from separate buffers in one call
+int bio_writev(const int block_num, void *const *bufs, int count) {
+    int i;
+
+    __atomic_add_fetch(&bio_write_count, 1, __ATOMIC_RELAXED);
+    if (rdonly) {
+		fprintf(stderr, "block_write failed: the disk is read-only\n");
+		return -1;
+    }
+    if (ram) {
+		for (i = 0; i < count; i++) {
+			if (ram_write(block_num + i, bufs[i]) < 0) {
+				return -1;
+			}
+		}
+		return count * BLOCK_SIZE;
+    }
+    return bio_rw(1, block_num, bufs, count);
+}
@@ -8,12 +8,49 @@
 #ifndef _BLOCK_H_
 #define _BLOCK_H_
 
+#include <sys/types.h>
+
 #define BLOCK_SIZE 4096
 
+/*
+ * A disk path may name several member files separated by ':', which are
+ * striped in units of DEV_STRIPE_UNIT blocks (see dev_stripe_unit). The
+ * same members and unit must be given every time the disk is opened.
+ */
+#define DEV_MAX_MEMBERS 8
+#define DEV_STRIPE_UNIT 16
+
+/*
+ * RAM mode (dev_ram before opening) loads the whole disk into memory
+ * and serves every bio_* call from there; the files are written by
+ * snapshots and on close. A snapshot is dev_snap_copy, taken while no
+ * operation is changing the disk, then dev_snap_write, which can run
+ * alongside further operations. One snapshot at a time.
+ */
+#define DEV_RAM_BLOCKS (1 << 20)
+
+/*
+ * dev_open_rdonly opens the disk read-only and maps its members, so
+ * reads are served from the mapping; every write fails until dev_close.
+ */
+
 void dev_init(const char* diskfile_path);
 int dev_open(const char* diskfile_path);
+int dev_open_rdonly(const char* diskfile_path);
 void dev_close();
+void dev_stripe_unit(int blocks);
+int dev_sync();
+void dev_ram(int on);
+int dev_snap_copy();
+int dev_snap_write();
 int bio_read(const int block_num, void *buf);
 int bio_write(const int block_num, const void *buf);
+int bio_readv(const int block_num, void *const *bufs, int count);
+int bio_writev(const int block_num, void *const *bufs, int count);
+int bio_fd(const int block_num, off_t *pos);
+
+/* Running totals of bio_read/bio_write calls, for benchmarks */
+extern unsigned long bio_read_count;
+extern unsigned long bio_write_count;
 
 #endif
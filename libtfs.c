@@ -0,0 +1,3426 @@
+/*
+ *	Tiny File System
+ *	File:	libtfs.c
+ *
+ *	File system core: allocation, inodes, directories, namei and the
+ *	read/write data path, operating on a struct tfs_vol. The FUSE daemon
+ *	in tfs.c is a thin adapter over the tfs_vol_* calls here.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <libgen.h>
+#include <math.h>
+#include <sched.h>
+
+#include "libtfs.h"
+#include "tfs_lz.h"
+#include "tfs_mem.h"
+
+static int reclaim(struct tfs_vol *vol, int max);
+static void reclaim_wake(struct tfs_vol *vol);
+static int page_needs_block(struct tfs_vol *vol, const struct inode *inode, int i);
+
+/* First clear bit of b in [from, to), or -1 */
+static int first_free(bitmap_t b, int from, int to) {
+	for(int i=from;i<to;i++){
+		if((i&7)==0 && i+8<=to && b[i/8]==0xff){
+			i+=7;
+			continue;
+		}
+		if(get_bitmap(b,i)==0){
+			return i;
+		}
+	}
+	return -1;
+}
+
+/*
+ * Find a free inode (inodes != 0) or data block, trying goal and what
+ * follows it in goal's group first, then the rest of that group, then
+ * the other groups in turn. Groups whose free count is zero are skipped
+ * without looking at the bitmap.
+ */
+static int find_free(struct tfs_vol *vol, int inodes, int goal) {
+	struct superblock *sb=vol->sb;
+	int n = inodes ? sb->max_inum : sb->max_dnum;
+	bitmap_t bm = inodes ? vol->inode_bm : vol->data_bm;
+	if(goal<0 || goal>=n){
+		goal=0;
+	}
+	int g0=group_of(n,sb->groups,goal);
+	for(int k=0;k<(int)sb->groups;k++){
+		int g=(g0+k)%sb->groups, i=-1;
+		if((inodes ? sb->gd[g].free_inum : sb->gd[g].free_dnum)==0){
+			continue;
+		}
+		if(k==0){
+			i=first_free(bm,goal,group_end(n,sb->groups,g));
+		}
+		if(i<0){
+			i=first_free(bm,group_start(n,sb->groups,g),group_end(n,sb->groups,g));
+		}
+		if(i>=0){
+			return i;
+		}
+	}
+	return -1;
+}
+
+/*
+ * Get available inode number from bitmap
+ * Returns -1 if no empty spot found
+ */
+int get_avail_ino(struct tfs_vol *vol) {
+	if(vol->sb->free_inum==0){
+		reclaim(vol,MAX_INUM);
+	}
+	return find_free(vol,1,0);
+}
+
+/*
+ * Get an inode for a new node in directory parent. A directory goes to
+ * the group with the most free blocks among those with at least the
+ * average share of free inodes, so directories spread out; anything else
+ * goes in its parent's group, or the next group with room.
+ * Returns -1 if no empty spot found
+ */
+int get_avail_ino_for(struct tfs_vol *vol, uint16_t parent, int dir) {
+	struct superblock *sb=vol->sb;
+	int g=group_of(sb->max_inum,sb->groups,parent);
+	if(sb->free_inum==0){
+		reclaim(vol,MAX_INUM);
+	}
+	if(dir){
+		int best=-1;
+		for(int k=0;k<(int)sb->groups;k++){
+			if(sb->gd[k].free_inum>0 && sb->gd[k].free_inum*sb->groups>=sb->free_inum &&
+					(best<0 || sb->gd[k].free_dnum>sb->gd[best].free_dnum)){
+				best=k;
+			}
+		}
+		if(best>=0){
+			g=best;
+		}
+	}
+	return find_free(vol,1,group_start(sb->max_inum,sb->groups,g));
+}
+
+/*
+ * Get available data block number from bitmap. Blocks reserved for
+ * dirty pages (see writeback) are not available.
+ * Returns -1 if no empty spot found
+ */
+int get_avail_blkno(struct tfs_vol *vol) {
+	return get_avail_blkno_near(vol,0);
+}
+
+/* Get a data block at or after goal, or as near it as the groups allow */
+int get_avail_blkno_near(struct tfs_vol *vol, int goal) {
+	// A full disk first gets back what the orphans hold
+	if((int)vol->sb->free_dnum<=vol->reserved){
+		reclaim(vol,MAX_INUM);
+	}
+	if((int)vol->sb->free_dnum<=vol->reserved){
+		return -1;
+	}
+	return find_free(vol,0,goal);
+}
+
+/*
+ * Where to allocate for slot i of inode: just past the nearest block
+ * before it in the file, so a file grows contiguously, or else at the
+ * start of the inode's group.
+ */
+static int data_goal(struct tfs_vol *vol, const struct inode *inode, int i) {
+	for(int j=i-1;j>=0;j--){
+		if(inode->direct_ptr[j]>=0){
+			return inode->direct_ptr[j]+(i-j);
+		}
+	}
+	int g=group_of(vol->sb->max_inum,vol->sb->groups,inode->ino);
+	return group_start(vol->sb->max_dnum,vol->sb->groups,g);
+}
+
+/*
+ * Find free data blocks in a row for n slots: the first run of n at or
+ * after goal, else the first anywhere, else the longest there is. Sets
+ * *got to the run's length (at most n) and returns its start, or -1 if
+ * no block is free. Reserved blocks count as taken.
+ */
+static int find_run(struct tfs_vol *vol, int goal, int n, int *got){
+	int max=vol->sb->max_dnum, best=-1, bestlen=0;
+	if(n>(int)vol->sb->free_dnum-vol->reserved){
+		n=(int)vol->sb->free_dnum-vol->reserved;
+	}
+	if(n<=0){
+		return -1;
+	}
+	if(goal<0 || goal>=max){
+		goal=0;
+	}
+	for(int pass=0;pass<2;pass++){
+		int to = pass ? goal : max;
+		int i=first_free(vol->data_bm, pass ? 0 : goal, to);
+		while(i>=0){
+			int j=i+1;
+			while(j<max && j-i<n && get_bitmap(vol->data_bm,j)==0){
+				j++;
+			}
+			if(j-i>bestlen){
+				best=i;
+				bestlen=j-i;
+			}
+			if(bestlen==n){
+				break;
+			}
+			i = j<to ? first_free(vol->data_bm,j,to) : -1;
+		}
+		if(bestlen==n){
+			break;
+		}
+	}
+	*got=bestlen;
+	return best;
+}
+
+/*
+ * Give every slot of inode set in mask (bit i for direct_ptr[i]) a new
+ * data block, taking the longest free runs there are so the slots land
+ * contiguously. Returns 0, or -ENOSPC with the slots not reached left -1.
+ */
+static int fill_slots(struct tfs_vol *vol, struct inode *inode, unsigned mask){
+	int i=0;
+	while(mask!=0){
+		int n=0, got;
+		for(int k=0;k<16;k++){
+			n += (mask>>k)&1;
+		}
+		while(!(mask&(1u<<i))){
+			i++;
+		}
+		int blk=find_run(vol,data_goal(vol,inode,i),n,&got);
+		if(blk<0){
+			return -ENOSPC;
+		}
+		for(;got>0;got--,blk++){
+			while(!(mask&(1u<<i))){
+				i++;
+			}
+			alloc_blkno(vol,blk);
+			inode->direct_ptr[i]=blk;
+			mask&=~(1u<<i);
+		}
+	}
+	return 0;
+}
+
+/* Write zeros over the blocks of the slots of inode set in mask, a contiguous stretch per write */
+static void zero_slots(struct tfs_vol *vol, struct inode *inode, unsigned mask){
+	char* zero=slab_zalloc(SLAB_BLOCK);
+	void* zeros[16];
+	for(int i=0;i<16;i++){
+		zeros[i]=zero;
+	}
+	for(int i=0;i<16;){
+		int j=i+1;
+		if(!(mask&(1u<<i)) || inode->direct_ptr[i]<0){
+			i++;
+			continue;
+		}
+		while(j<16 && (mask&(1u<<j)) && inode->direct_ptr[j]==inode->direct_ptr[i]+(j-i)){
+			j++;
+		}
+		bio_writev(vol->sb->d_start_blk+inode->direct_ptr[i],zeros,j-i);
+		i=j;
+	}
+	slab_free(SLAB_BLOCK,zero);
+}
+
+/* Count each group's free inodes and blocks from the bitmaps into gd */
+void tfs_group_counts(const struct superblock *sb, bitmap_t inode_bm, bitmap_t data_bm, struct group_desc *gd) {
+	memset(gd,0,sb->groups*sizeof(struct group_desc));
+	for(int i=0;i<sb->max_inum;i++){
+		gd[group_of(sb->max_inum,sb->groups,i)].free_inum += !get_bitmap(inode_bm,i);
+	}
+	for(int i=0;i<sb->max_dnum;i++){
+		gd[group_of(sb->max_dnum,sb->groups,i)].free_dnum += !get_bitmap(data_bm,i);
+	}
+}
+
+/*
+ * Block sharing
+ *
+ * The dedup table (see tfs.h) is loaded at mount and lives in memory;
+ * operations mark the table blocks they touch and end() writes those
+ * back with the bitmaps. Blocks are found by content through an open
+ * addressed index from hash to block number, rebuilt from the table at
+ * mount. Only one block per hash is indexed: a block whose hash matches
+ * a different block's content stays unindexed.
+ */
+struct tfs_dedup {
+	struct dedup_ent	*ents;		/* the table, one entry per data block */
+	unsigned char		*dirty;		/* table blocks to write back */
+	int					nblk;		/* table size in blocks */
+	int					*index;		/* hash -> data block, -1 if empty */
+	unsigned			mask;		/* index size - 1 */
+};
+
+static uint64_t block_hash(const char *data){
+	uint64_t h=0x9e3779b97f4a7c15ull, w;
+	for(int i=0;i<BLOCK_SIZE;i+=sizeof(w)){
+		memcpy(&w,data+i,sizeof(w));
+		h=(h^w)*0xff51afd7ed558ccdull;
+		h^=h>>32;
+	}
+	return h ? h : 1;
+}
+
+static struct tfs_dedup *dedup_alloc(int max_dnum){
+	struct tfs_dedup *dd=calloc(1,sizeof(struct tfs_dedup));
+	dd->nblk=(max_dnum+DEDUP_PER_BLOCK-1)/DEDUP_PER_BLOCK;
+	dd->ents=calloc(dd->nblk*DEDUP_PER_BLOCK,sizeof(struct dedup_ent));
+	dd->dirty=calloc(dd->nblk,1);
+	for(dd->mask=1; dd->mask<2u*max_dnum; dd->mask<<=1);
+	dd->index=malloc(dd->mask*sizeof(int));
+	memset(dd->index,0xff,dd->mask*sizeof(int));
+	dd->mask--;
+	return dd;
+}
+
+static void dedup_free(struct tfs_dedup *dd){
+	if(dd==NULL){
+		return;
+	}
+	free(dd->ents);
+	free(dd->dirty);
+	free(dd->index);
+	free(dd);
+}
+
+static void dedup_dirty(struct tfs_dedup *dd, int blkno){
+	dd->dirty[blkno/DEDUP_PER_BLOCK]=1;
+}
+
+/* Block indexed under hash h, or -1 */
+static int dedup_lookup(struct tfs_dedup *dd, uint64_t h){
+	for(unsigned i=h&dd->mask; dd->index[i]>=0; i=(i+1)&dd->mask){
+		if(dd->ents[dd->index[i]].hash==h){
+			return dd->index[i];
+		}
+	}
+	return -1;
+}
+
+/* Index blkno under h; nothing else may be indexed under h */
+static void dedup_insert(struct tfs_dedup *dd, int blkno, uint64_t h){
+	unsigned i=h&dd->mask;
+	while(dd->index[i]>=0){
+		i=(i+1)&dd->mask;
+	}
+	dd->index[i]=blkno;
+	dd->ents[blkno].hash=h;
+	dedup_dirty(dd,blkno);
+}
+
+/* Take blkno out of the index, before its content changes or it is freed */
+static void dedup_unindex(struct tfs_dedup *dd, int blkno){
+	uint64_t h=dd->ents[blkno].hash;
+	unsigned i, j;
+	if(h==0){
+		return;
+	}
+	for(i=h&dd->mask; dd->index[i]!=blkno; i=(i+1)&dd->mask);
+	// Shift later entries of the probe run back over the gap
+	for(j=(i+1)&dd->mask; dd->index[j]>=0; j=(j+1)&dd->mask){
+		unsigned home=dd->ents[dd->index[j]].hash&dd->mask;
+		if(i<j ? (home<=i || home>j) : (home<=i && home>j)){
+			dd->index[i]=dd->index[j];
+			i=j;
+		}
+	}
+	dd->index[i]=-1;
+	dd->ents[blkno].hash=0;
+	dedup_dirty(dd,blkno);
+}
+
+/* Read the volume's dedup table and index its hashed blocks */
+static struct tfs_dedup *dedup_load(struct tfs_vol *vol){
+	struct tfs_dedup *dd=dedup_alloc(vol->sb->max_dnum);
+	for(int b=0;b<dd->nblk;b++){
+		bio_read(vol->sb->dedup_blk+b,dd->ents+b*DEDUP_PER_BLOCK);
+	}
+	for(int i=0;i<vol->sb->max_dnum;i++){
+		uint64_t h=dd->ents[i].hash;
+		if(h!=0){
+			dd->ents[i].hash=0;
+			if(dedup_lookup(dd,h)<0){
+				dedup_insert(dd,i,h);
+			}
+		}
+	}
+	memset(dd->dirty,0,dd->nblk);
+	return dd;
+}
+
+static int shared_blkno(struct tfs_vol *vol, int blkno){
+	return vol->dd!=NULL && vol->dd->ents[blkno].refs>1;
+}
+
+/*
+ * Mark an inode or data block used or free, keeping the superblock's
+ * free counts in step with the bitmaps so statfs never has to scan them.
+ * The group counts follow along. Freeing something already free is a
+ * no-op. A newly used data block has one reference.
+ */
+void alloc_ino(struct tfs_vol *vol, int ino) {
+	if(get_bitmap(vol->inode_bm,ino)==0){
+		set_bitmap(vol->inode_bm,ino);
+		vol->sb->free_inum--;
+		vol->sb->gd[group_of(vol->sb->max_inum,vol->sb->groups,ino)].free_inum--;
+	}
+}
+
+void free_ino(struct tfs_vol *vol, int ino) {
+	if(get_bitmap(vol->inode_bm,ino)==1){
+		unset_bitmap(vol->inode_bm,ino);
+		vol->sb->free_inum++;
+		vol->sb->gd[group_of(vol->sb->max_inum,vol->sb->groups,ino)].free_inum++;
+	}
+}
+
+void alloc_blkno(struct tfs_vol *vol, int blkno) {
+	if(get_bitmap(vol->data_bm,blkno)==0){
+		set_bitmap(vol->data_bm,blkno);
+		vol->sb->free_dnum--;
+		vol->sb->gd[group_of(vol->sb->max_dnum,vol->sb->groups,blkno)].free_dnum--;
+		if(vol->dd){
+			vol->dd->ents[blkno].refs=1;
+			dedup_dirty(vol->dd,blkno);
+		}
+	}
+}
+
+void free_blkno(struct tfs_vol *vol, int blkno) {
+	if(get_bitmap(vol->data_bm,blkno)==1){
+		unset_bitmap(vol->data_bm,blkno);
+		vol->sb->free_dnum++;
+		vol->sb->gd[group_of(vol->sb->max_dnum,vol->sb->groups,blkno)].free_dnum++;
+		if(vol->dd){
+			dedup_unindex(vol->dd,blkno);
+			vol->dd->ents[blkno].refs=0;
+			dedup_dirty(vol->dd,blkno);
+		}
+	}
+}
+
+/* Drop a file's reference to a data block, freeing it with the last one */
+void put_blkno(struct tfs_vol *vol, int blkno) {
+	if(shared_blkno(vol,blkno)){
+		vol->dd->ents[blkno].refs--;
+		dedup_dirty(vol->dd,blkno);
+		return;
+	}
+	free_blkno(vol,blkno);
+}
+
+/*
+ * Sealed volumes
+ *
+ * A volume mounted with tfs_mount_sealed never changes, so at mount the
+ * whole inode table is read into memory and every directory gets an
+ * index of its entries sorted by name. readi and dir_find are then
+ * served from those without touching the disk, and the read-only
+ * operations run without the volume lock or the start()/end() round
+ * trip: all they share is immutable, and file data comes straight from
+ * the mapped image.
+ */
+struct sealed_ent {
+	const char			*name;
+	uint16_t			ino;
+};
+
+/* A directory's entries sorted by name, their names stored after ent[] */
+struct sealed_dir {
+	int					n;
+	struct sealed_ent	ent[];
+};
+
+struct tfs_sealed {
+	int					nino;		/* entries in both tables */
+	struct inode		*itab;		/* the inode table */
+	struct sealed_dir	**dirs;		/* per inode, NULL for anything but a directory */
+};
+
+static int by_name(const void *a, const void *b) {
+	return strcmp(((const struct sealed_ent *)a)->name,((const struct sealed_ent *)b)->name);
+}
+
+/* Index directory inode from its entry blocks, read into blocks (room for 16) */
+static struct sealed_dir *seal_dir(struct tfs_vol *vol, const struct inode *inode, struct dirent *blocks) {
+	int n=0, nb=0;
+	size_t bytes=0;
+	for(int i=0;i<16;i++){
+		if(inode->direct_ptr[i]>=0){
+			bio_read(vol->sb->d_start_blk+inode->direct_ptr[i],blocks+nb*DIRENTS_PER_BLOCK);
+			nb++;
+		}
+	}
+	for(int j=0;j<nb*DIRENTS_PER_BLOCK;j++){
+		if(blocks[j].valid && blocks[j].ino<vol->sb->max_inum){
+			blocks[j].name[sizeof(blocks[j].name)-1]='\0';
+			bytes+=strlen(blocks[j].name)+1;
+			n++;
+		}
+	}
+	struct sealed_dir *d=malloc(sizeof(struct sealed_dir)+n*sizeof(struct sealed_ent)+bytes);
+	char *names=(char *)&d->ent[n];
+	d->n=0;
+	for(int j=0;j<nb*DIRENTS_PER_BLOCK;j++){
+		if(blocks[j].valid && blocks[j].ino<vol->sb->max_inum){
+			d->ent[d->n].name=names;
+			d->ent[d->n].ino=blocks[j].ino;
+			names=stpcpy(names,blocks[j].name)+1;
+			d->n++;
+		}
+	}
+	qsort(d->ent,d->n,sizeof(struct sealed_ent),by_name);
+	return d;
+}
+
+static struct tfs_sealed *seal_load(struct tfs_vol *vol) {
+	struct superblock *sb=vol->sb;
+	int nblk=(sb->max_inum+INODES_PER_BLOCK-1)/INODES_PER_BLOCK;
+	int nino=nblk*INODES_PER_BLOCK>MAX_INUM ? nblk*INODES_PER_BLOCK : MAX_INUM;
+	struct tfs_sealed *sl=calloc(1,sizeof(struct tfs_sealed));
+	sl->nino=nino;
+	sl->itab=calloc(nino,sizeof(struct inode));
+	sl->dirs=calloc(nino,sizeof(struct sealed_dir *));
+	void **bufs=scratch_alloc(nblk*sizeof(void *));
+	for(int b=0;b<nblk;b++){
+		bufs[b]=(char *)sl->itab+b*BLOCK_SIZE;
+	}
+	bio_readv(sb->i_start_blk,bufs,nblk);
+	// One buffer serves every directory in turn
+	struct dirent* blocks=scratch_alloc(16*BLOCK_SIZE);
+	for(int ino=0;ino<sb->max_inum;ino++){
+		if(sl->itab[ino].valid && sl->itab[ino].type==TFS_DIRECTORY){
+			sl->dirs[ino]=seal_dir(vol,&sl->itab[ino],blocks);
+		}
+	}
+	scratch_reset();
+	return sl;
+}
+
+static void seal_free(struct tfs_sealed *sl) {
+	if(sl==NULL){
+		return;
+	}
+	for(int ino=0;ino<sl->nino;ino++){
+		free(sl->dirs[ino]);
+	}
+	free(sl->dirs);
+	free(sl->itab);
+	free(sl);
+}
+
+/* Entry fname of directory ino, as dir_find returns it */
+static int seal_find(struct tfs_sealed *sl, uint16_t ino, const char *fname, struct dirent *dirent) {
+	struct sealed_dir *d= ino<sl->nino ? sl->dirs[ino] : NULL;
+	if(d==NULL){
+		return -2;
+	}
+	int lo=0, hi=d->n-1;
+	while(lo<=hi){
+		int mid=(lo+hi)/2, c=strcmp(fname,d->ent[mid].name);
+		if(c==0){
+			memset(dirent,0,sizeof(struct dirent));
+			dirent->ino=d->ent[mid].ino;
+			dirent->valid=1;
+			dirent->len=strlen(d->ent[mid].name);
+			memcpy(dirent->name,d->ent[mid].name,dirent->len);
+			return 0;
+		}
+		if(c<0){
+			hi=mid-1;
+		}else{
+			lo=mid+1;
+		}
+	}
+	return -1;
+}
+
+/*
+ * inode operations
+ */
+int readi(struct tfs_vol *vol, uint16_t ino, struct inode *inode) {
+	if(ino>=MAX_INUM){
+		memset(inode,0,sizeof(struct inode));
+		return -EINVAL;
+	}
+
+	// A sealed volume keeps the whole table in memory
+	if(vol->sealed!=NULL){
+		if(ino<vol->sealed->nino){
+			*inode=vol->sealed->itab[ino];
+		}else{
+			memset(inode,0,sizeof(struct inode));
+		}
+		return 0;
+	}
+
+	// Open files are served from the open-file table
+	if(vol->onodes!=NULL && vol->onodes[ino]!=NULL){
+		*inode=vol->onodes[ino]->inode;
+		return 0;
+	}
+
+	// Step 1: Get the inode's on-disk block number
+	int onDiskBM=(ino/INODES_PER_BLOCK)+vol->sb->i_start_blk;
+	// Step 2: Get offset of the inode in the inode on-disk block
+	int offset=ino%INODES_PER_BLOCK;
+
+	// Step 3: Read the block from disk and then copy into inode structure
+	struct inode* data=slab_alloc(SLAB_BLOCK);
+	bio_read(onDiskBM,data);
+	memcpy(inode,data+offset,sizeof(struct inode));
+	slab_free(SLAB_BLOCK,data);
+	return 0;
+}
+
+int writei(struct tfs_vol *vol, uint16_t ino, struct inode *inode) {
+
+	// Step 1: Get the block number where this inode resides on disk
+	int onDiskBM=(ino/INODES_PER_BLOCK)+vol->sb->i_start_blk;
+	// Step 2: Get the offset in the block where this inode resides on disk
+	int offset=ino%INODES_PER_BLOCK;
+
+	// Step 3: Write inode to disk
+	struct inode* data=slab_alloc(SLAB_BLOCK);
+	int readRet=bio_read(onDiskBM,data);
+	if(readRet<0){
+		printf("Error reading from disk\n");
+		slab_free(SLAB_BLOCK,data);
+		return readRet;
+	}
+	memcpy(data+offset,inode,sizeof(struct inode));
+
+	bio_write(onDiskBM,data);
+	slab_free(SLAB_BLOCK,data);
+
+	// Step 4: Keep the cached copy of an open file current
+	if(vol->onodes!=NULL && vol->onodes[ino]!=NULL){
+		vol->onodes[ino]->inode=*inode;
+	}
+	return 0;
+}
+
+
+/*
+ * directory operations
+ */
+
+/*
+ * Look up fname in directory ino and copy its entry into dirent.
+ * Returns 0 if found, -1 if not found, -2 if ino is not a directory.
+ */
+int dir_find(struct tfs_vol *vol, uint16_t ino, const char *fname, size_t name_len, struct dirent *dirent) {
+	if(vol->sealed!=NULL){
+		return seal_find(vol->sealed,ino,fname,dirent);
+	}
+	struct inode* root=slab_alloc(SLAB_INODE);
+	struct dirent* temp_dirent;
+	int readRet=readi(vol,ino,root);
+	//If there was an error finding the inode, return an error
+	if(readRet<0){
+		slab_free(SLAB_INODE,root);
+		return -2;
+	}
+	//If the parameter ino is a file, return an error.
+	if(root->type==TFS_FILE){
+		slab_free(SLAB_INODE,root);
+		return -2;
+	}
+
+	struct dirent* currentBlock=slab_alloc(SLAB_BLOCK);
+	//Goes through all the datablocks of the current inode.
+	for(int i=0;i<16;i++){
+		if(root->direct_ptr[i]==-1){
+			//This index does not have an attached datablock
+			continue;
+		}
+		//A datablock was found, putting its data in currentblock
+		bio_read(vol->sb->d_start_blk+root->direct_ptr[i],currentBlock);
+		//Going through all possible dirents in the current datablock
+		for(int j=0;j<DIRENTS_PER_BLOCK;j++){
+			temp_dirent=currentBlock+j;
+			if(temp_dirent->valid==0){
+				continue;
+			}
+			if(strcmp(temp_dirent->name,fname)==0){
+				//If the name matches, then copy directory entry to dirent structure
+				*dirent=*temp_dirent;
+				slab_free(SLAB_INODE,root);
+				slab_free(SLAB_BLOCK,currentBlock);
+				return 0;
+			}
+		}
+	}
+	//A directory/file with the given name was not found
+	slab_free(SLAB_INODE,root);
+	slab_free(SLAB_BLOCK,currentBlock);
+	return -1;
+}
+
+//Method to read sb and bitmaps from disk at the start of an operation
+static void start(struct tfs_vol *vol){
+	int sb_success=bio_read(0,vol->sb);
+	int inode_success=bio_read(1,vol->inode_bm);
+	int data_success=bio_read(2,vol->data_bm);
+	if(sb_success<0||inode_success<0||data_success<0){
+		printf("Error in start\n");
+	}
+}
+
+//Method to write sb and bitmaps back to disk at the end of an operation
+static void end(struct tfs_vol *vol){
+	bio_write(0,vol->sb);
+	bio_write(1,vol->inode_bm);
+	bio_write(2,vol->data_bm);
+	if(vol->dd){
+		for(int b=0;b<vol->dd->nblk;b++){
+			if(vol->dd->dirty[b]){
+				bio_write(vol->sb->dedup_blk+b,vol->dd->ents+b*DEDUP_PER_BLOCK);
+				vol->dd->dirty[b]=0;
+			}
+		}
+	}
+	// Scratch memory lives for one operation
+	scratch_reset();
+}
+
+/*
+ * The read-only operations bracket themselves with these instead: on a
+ * sealed volume there is nothing to lock, reread or write back.
+ */
+static void ro_begin(struct tfs_vol *vol){
+	if(vol->sealed==NULL){
+		pthread_mutex_lock(&vol->lock);
+		start(vol);
+	}
+}
+
+static void ro_end(struct tfs_vol *vol){
+	if(vol->sealed==NULL){
+		end(vol);
+		pthread_mutex_unlock(&vol->lock);
+		return;
+	}
+	scratch_reset();
+}
+
+/*
+ * Add an entry for f_ino named fname to dir_inode, growing the directory
+ * by one block if every existing block is full. f_ino may already be
+ * linked elsewhere, which is how rename moves an entry.
+ * Returns 0 on success, -1 if the directory is full, -2 on bad arguments.
+ */
+static int dir_link(struct tfs_vol *vol, struct inode dir_inode, uint16_t f_ino, const char *fname, size_t name_len) {
+	int added=0;
+	if(dir_inode.type==TFS_FILE){
+		printf("dir_inode file type is not a directory \n");
+		return -2;
+	}
+	if(dir_inode.valid==0){
+		printf("dir_inode is not valid\n");
+		return -2;
+	}
+	if(name_len>=sizeof(((struct dirent *)0)->name)){
+		return -2;
+	}
+	struct dirent* tempDirent=slab_alloc(SLAB_DIRENT);
+	int found=dir_find(vol,dir_inode.ino,fname,name_len,tempDirent);
+	slab_free(SLAB_DIRENT,tempDirent);
+	if(found!=-1){
+		return -2;
+	}
+	int set=0;
+	struct dirent* currentBlock=slab_alloc(SLAB_BLOCK);
+	struct dirent* newDirent=slab_alloc(SLAB_DIRENT);
+	newDirent->valid=1;
+	newDirent->len=name_len;
+	newDirent->ino=f_ino;
+	strcpy(newDirent->name,fname);
+	for(int i=0;i<16;i++){
+		if(set==1){
+			break;
+		}
+		if(dir_inode.direct_ptr[i]==-1){
+			continue;
+		}
+		bio_read(vol->sb->d_start_blk+dir_inode.direct_ptr[i],currentBlock);
+		for(int j=0;j<DIRENTS_PER_BLOCK;j++){
+			struct dirent* curr=currentBlock+j;
+			if(curr->valid==0){
+				set=1;
+				currentBlock[j]=*newDirent;
+				bio_write(vol->sb->d_start_blk+dir_inode.direct_ptr[i],currentBlock);
+				added=1;
+				break;
+			}
+		}
+	}
+	//Goes here if there is no datablocks for this directory that are empty.
+	//In this case, have to update this inode, so gotta biowrite for inode;
+	if(set==0){
+		for(int i=0;i<16;i++){
+			if(dir_inode.direct_ptr[i]==-1){
+				int blockNum=get_avail_blkno_near(vol,data_goal(vol,&dir_inode,i));
+				if(blockNum<0){
+					break;
+				}
+				dir_inode.direct_ptr[i]=blockNum;
+				memset(currentBlock,0,BLOCK_SIZE);
+				currentBlock[0]=*newDirent;
+				bio_write(vol->sb->d_start_blk+dir_inode.direct_ptr[i],currentBlock);
+				writei(vol,dir_inode.ino,&dir_inode);
+				alloc_blkno(vol,blockNum);
+				added=1;
+				break;
+			}
+		}
+	}
+	slab_free(SLAB_BLOCK,currentBlock);
+	slab_free(SLAB_DIRENT,newDirent);
+
+	//Goes here if all of the datablocks for this inode are full
+	if(added==0){
+		printf("All datablocks for this inode are full\n");
+		return -1;
+	}
+	struct inode* parent_inode=slab_alloc(SLAB_INODE);
+	readi(vol,dir_inode.ino,parent_inode);
+	parent_inode->size+=sizeof(struct dirent);
+	time(& (parent_inode->vstat.st_mtime));
+	writei(vol,parent_inode->ino,parent_inode);
+	slab_free(SLAB_INODE,parent_inode);
+	return 0;
+}
+
+/*
+ * Add an entry for a new inode f_ino, which must not be in use yet.
+ * Returns 0 on success, -1 if the directory is full, -2 on bad arguments.
+ */
+int dir_add(struct tfs_vol *vol, struct inode dir_inode, uint16_t f_ino, const char *fname, size_t name_len) {
+	if(get_bitmap(vol->inode_bm,f_ino)==1){
+		printf("The new directories inode is already used somewhere\n");
+		return -2;
+	}
+	return dir_link(vol,dir_inode,f_ino,fname,name_len);
+}
+
+//Deleting leads to empty block, remove from parents inode and make it empty in the bitmap
+static int remove_block(struct tfs_vol *vol, struct inode dir_inode, struct dirent* currentBlock, int i){
+	for(int j=0; j<DIRENTS_PER_BLOCK; j++){
+		struct dirent* temp = currentBlock+j;
+
+		//Return if the block is not empty
+		if(temp->valid!=0){
+			return -1;
+		}
+	}
+
+	//Remove from parents inode and unset from bitmap
+	free_blkno(vol, dir_inode.direct_ptr[i]);
+	dir_inode.direct_ptr[i] = -1;
+	writei(vol, dir_inode.ino, &dir_inode);
+
+	return 0;
+}
+
+/*
+ * Point the entry named fname in dir_inode at new_ino, or clear it if
+ * new_ino is -1 (dropping the directory block if that empties it). The
+ * inode the entry named is returned in *old_ino and left alone.
+ * Returns 0 on success, -1 if not found, -2 if dir_inode is a file.
+ */
+static int dir_update(struct tfs_vol *vol, struct inode dir_inode, const char *fname, int new_ino, uint16_t *old_ino) {
+	if(dir_inode.type==TFS_FILE){
+		printf("Given inode is for a file, not a directory\n");
+		return -2;
+	}
+	struct dirent* currentBlock=slab_alloc(SLAB_BLOCK);
+
+	for(int i=0;i<16;i++){
+		if(dir_inode.direct_ptr[i]==-1){
+			continue;
+		}
+		bio_read(vol->sb->d_start_blk+dir_inode.direct_ptr[i], currentBlock);
+		for(int j=0;j<DIRENTS_PER_BLOCK;j++){
+			struct dirent* temp=currentBlock+j;
+			if(temp->valid==0){
+				continue;
+			}
+			if(strcmp(temp->name,fname)==0){
+				*old_ino=temp->ino;
+				if(new_ino<0){
+					temp->valid=0;
+				}
+				else{
+					temp->ino=new_ino;
+				}
+				bio_write(vol->sb->d_start_blk+dir_inode.direct_ptr[i],currentBlock);
+
+				//If datablocks are all empty, unmap from bitmap and inode
+				if(new_ino<0){
+					remove_block(vol, dir_inode, currentBlock, i);
+				}
+				slab_free(SLAB_BLOCK,currentBlock);
+				return 0;
+			}
+		}
+	}
+	slab_free(SLAB_BLOCK,currentBlock);
+	return -1;
+}
+
+/*
+ * Remove the entry named fname from dir_inode and invalidate its inode.
+ * Returns 0 on success, -1 if not found, -2 if dir_inode is a file.
+ */
+int dir_remove(struct tfs_vol *vol, struct inode dir_inode, const char *fname, size_t name_len) {
+	uint16_t ino;
+	int ret=dir_update(vol,dir_inode,fname,-1,&ino);
+	if(ret<0){
+		return ret;
+	}
+	//Set the inode invalid and free it in the bitmap
+	struct inode* toDelete=slab_alloc(SLAB_INODE);
+	readi(vol,ino,toDelete);
+	toDelete->valid=0;
+	writei(vol,ino,toDelete);
+	slab_free(SLAB_INODE,toDelete);
+	free_ino(vol,ino);
+	return 0;
+}
+
+
+/*
+ * namei operation
+ * Returns 0 and fills inode if path resolves, -1 otherwise.
+ */
+int get_node_by_path(struct tfs_vol *vol, const char *path, uint16_t ino, struct inode *inode) {
+	if(strcmp(path,"/")==0){
+		readi(vol,0,inode);
+		return 0;
+	}
+	char* temp=scratch_strdup(path);
+	char* save;
+	char* name=strtok_r(temp,"/",&save);
+	//Splits the path up into names
+	struct dirent* crtDirent=slab_alloc(SLAB_DIRENT);
+	//Initialize crtInode to the root of the directory
+	struct inode* crtInode= slab_alloc(SLAB_INODE);
+	readi(vol,ino,crtInode);
+	while(name!=NULL){
+		int findRet=dir_find(vol,crtInode->ino,name,strlen(name),crtDirent);
+		if(findRet<0){
+			slab_free(SLAB_INODE,crtInode);
+			slab_free(SLAB_DIRENT,crtDirent);
+			return -1;
+		}
+		readi(vol,crtDirent->ino,crtInode);
+		name=strtok_r(NULL,"/",&save);
+	}
+	*inode=*crtInode;
+	slab_free(SLAB_INODE,crtInode);
+	slab_free(SLAB_DIRENT,crtDirent);
+	return 0;
+}
+
+/*
+ * Make file system
+ * Creates (or overwrites) the image at diskfile_path and leaves the
+ * device open.
+ */
+int tfs_mkfs(const char *diskfile_path) {
+	// Call dev_init() to initialize (Create) Diskfile
+	dev_init(diskfile_path);
+	if(dev_open(diskfile_path)<0){
+		return -1;
+	}
+	// write superblock information
+	struct superblock* sb = calloc(1, BLOCK_SIZE);
+	sb->magic_num = MAGIC_NUM;
+	sb->max_inum = MAX_INUM;
+	sb->max_dnum = MAX_DNUM;
+	sb->i_bitmap_blk=1;
+	sb->d_bitmap_blk=2;
+	sb->i_start_blk=3;
+	int x=(int)ceil(((double)(MAX_INUM*sizeof(struct inode)))/(double)BLOCK_SIZE);
+	sb->d_start_blk=sb->i_start_blk+x;
+	sb->free_inum=MAX_INUM-1;	// everything but the root
+	sb->free_dnum=MAX_DNUM;
+	sb->groups=TFS_GROUPS;
+
+	// initialize inode and data block bitmaps
+	bitmap_t inode_bm = calloc(1, BLOCK_SIZE);
+	bitmap_t data_bm = calloc(1, BLOCK_SIZE);
+
+	// update inode for root directory
+	struct inode* root_inode=calloc(1, sizeof(struct inode));
+	root_inode->ino=0;
+	root_inode->valid=1;
+	root_inode->type=TFS_DIRECTORY;
+	root_inode->link=2;
+	root_inode->vstat.st_mode= S_IFDIR |0755;
+	time(& root_inode->vstat.st_mtime);
+	root_inode->size=0;
+	for(int i=0;i<16;i++){
+		root_inode->direct_ptr[i]=-1;
+	}
+
+	// update bitmap information for root directory
+	set_bitmap(inode_bm,0);
+	tfs_group_counts(sb,inode_bm,data_bm,sb->gd);
+	bio_write(0,(void*)(sb));
+	bio_write(1,(void*)(inode_bm));
+	bio_write(2,(void*)(data_bm));
+
+	// writei() only needs the inode region start from the volume
+	struct tfs_vol tmp = { .sb = sb };
+	writei(&tmp,0,root_inode);
+
+	free(root_inode);
+	free(inode_bm);
+	free(data_bm);
+	free(sb);
+	return 0;
+}
+
+/* Set up a volume on the open device from its superblock and bitmaps */
+static struct tfs_vol *vol_load(void) {
+	struct tfs_vol *vol=calloc(1, sizeof(struct tfs_vol));
+	vol->sb=(struct superblock*) malloc(BLOCK_SIZE);
+	vol->inode_bm=malloc(BLOCK_SIZE);
+	vol->data_bm=malloc(BLOCK_SIZE);
+	vol->onodes=calloc(MAX_INUM, sizeof(struct tfs_onode *));
+	pthread_mutex_init(&vol->lock, NULL);
+	pthread_cond_init(&vol->flush_cv, NULL);
+	pthread_mutex_init(&vol->snap_lock, NULL);
+	pthread_cond_init(&vol->snap_cv, NULL);
+	pthread_cond_init(&vol->reclaim_cv, NULL);
+	pthread_cond_init(&vol->defrag_cv, NULL);
+
+	int sb_success=bio_read(0,vol->sb);
+	int inode_success=bio_read(1,vol->inode_bm);
+	int data_success=bio_read(2,vol->data_bm);
+	if(sb_success<0||inode_success<0||data_success<0||vol->sb->magic_num!=MAGIC_NUM){
+		printf("Couldn't find superblock or bitmap nodes\n");
+		tfs_unmount(vol);
+		return NULL;
+	}
+	return vol;
+}
+
+/*
+ * Open the image at diskfile_path, creating a fresh file system if it
+ * does not exist yet. Returns NULL on failure.
+ */
+struct tfs_vol *tfs_mount(const char *diskfile_path) {
+	// If disk file is not found, call mkfs
+	if(dev_open(diskfile_path)<0 && tfs_mkfs(diskfile_path)<0){
+		return NULL;
+	}
+	struct tfs_vol *vol=vol_load();
+	if(vol==NULL){
+		return NULL;
+	}
+	// Images from before block groups get them now, counted from the bitmaps
+	if(vol->sb->groups==0 || vol->sb->groups>TFS_GROUPS){
+		vol->sb->groups=TFS_GROUPS;
+		tfs_group_counts(vol->sb,vol->inode_bm,vol->data_bm,vol->sb->gd);
+		bio_write(0,vol->sb);
+	}
+	if(vol->sb->dedup_blk!=0){
+		vol->dd=dedup_load(vol);
+	}
+	// Pick up the orphans the last mount did not get to; a damaged list is left to fsck
+	if(vol->sb->norphans>MAX_INUM){
+		vol->sb->norphans=0;
+	}
+	if(vol->sb->norphans>0){
+		pthread_mutex_lock(&vol->lock);
+		reclaim_wake(vol);
+		pthread_mutex_unlock(&vol->lock);
+	}
+	return vol;
+}
+
+/*
+ * Open the image at diskfile_path read-only and index it, see the
+ * sealed volumes section. Nothing is ever written to it. Returns NULL
+ * on failure.
+ */
+struct tfs_vol *tfs_mount_sealed(const char *diskfile_path) {
+	if(dev_open_rdonly(diskfile_path)<0){
+		return NULL;
+	}
+	struct tfs_vol *vol=vol_load();
+	if(vol==NULL){
+		return NULL;
+	}
+	if(vol->sb->groups==0 || vol->sb->groups>TFS_GROUPS){
+		vol->sb->groups=TFS_GROUPS;
+		tfs_group_counts(vol->sb,vol->inode_bm,vol->data_bm,vol->sb->gd);
+	}
+	vol->sealed=seal_load(vol);
+	return vol;
+}
+
+void tfs_unmount(struct tfs_vol *vol) {
+	// Stop the flusher, the snapshots, the reclaimer and the defragger, and write back what is still cached
+	pthread_mutex_lock(&vol->lock);
+	int flushing=vol->flushing, snapping=vol->snap_secs>0, reclaiming=vol->reclaiming;
+	int defragging=vol->defrag_secs>0;
+	vol->flushing=0;
+	vol->snap_secs=0;
+	vol->reclaiming=0;
+	vol->defrag_secs=0;
+	pthread_cond_signal(&vol->flush_cv);
+	pthread_cond_signal(&vol->snap_cv);
+	pthread_cond_signal(&vol->reclaim_cv);
+	pthread_cond_signal(&vol->defrag_cv);
+	pthread_mutex_unlock(&vol->lock);
+	if(defragging){
+		pthread_join(vol->defragger,NULL);
+	}
+	if(flushing){
+		pthread_join(vol->flusher,NULL);
+	}
+	if(snapping){
+		pthread_join(vol->snapper,NULL);
+	}
+	if(reclaiming){
+		pthread_join(vol->reclaimer,NULL);
+	}
+	tfs_vol_sync(vol);
+
+	// A RAM disk takes its last snapshot as it closes
+	pthread_mutex_lock(&vol->lock);
+	dev_close();
+	pthread_mutex_unlock(&vol->lock);
+	pthread_cond_destroy(&vol->flush_cv);
+	pthread_cond_destroy(&vol->snap_cv);
+	pthread_cond_destroy(&vol->reclaim_cv);
+	pthread_cond_destroy(&vol->defrag_cv);
+	pthread_mutex_destroy(&vol->snap_lock);
+	pthread_mutex_destroy(&vol->lock);
+	free(vol->sb);
+	free(vol->inode_bm);
+	free(vol->data_bm);
+	for(int i=0;i<MAX_INUM;i++){
+		free(vol->onodes[i]);
+	}
+	free(vol->onodes);
+	dedup_free(vol->dd);
+	seal_free(vol->sealed);
+	free(vol);
+}
+
+
+/*
+ * File system operations
+ */
+
+void tfs_inode_stat(const struct inode *inode, struct stat *stbuf) {
+	memset(stbuf, 0, sizeof(struct stat));
+	stbuf->st_mode=inode->vstat.st_mode;
+	stbuf->st_nlink=inode->link;
+	stbuf->st_size=inode->size;
+	stbuf->st_ino=inode->ino;
+	stbuf->st_uid=getuid();
+	stbuf->st_gid=getgid();
+	stbuf->st_mtime=inode->vstat.st_mtime;
+}
+
+/*
+ * File system statistics from the superblock counters. The in-memory
+ * superblock is current whenever the lock is free, so this reads no
+ * blocks at all.
+ */
+void tfs_vol_statfs(struct tfs_vol *vol, struct statvfs *stbuf) {
+	memset(stbuf, 0, sizeof(struct statvfs));
+	if(vol->sealed!=NULL){
+		stbuf->f_flag=ST_RDONLY;
+	}else{
+		pthread_mutex_lock(&vol->lock);
+	}
+	stbuf->f_bsize=BLOCK_SIZE;
+	stbuf->f_frsize=BLOCK_SIZE;
+	stbuf->f_blocks=vol->sb->max_dnum;
+	stbuf->f_bfree=vol->sb->free_dnum;
+	stbuf->f_bavail=vol->sb->free_dnum;
+	stbuf->f_files=vol->sb->max_inum;
+	stbuf->f_ffree=vol->sb->free_inum;
+	stbuf->f_favail=vol->sb->free_inum;
+	stbuf->f_namemax=sizeof(((struct dirent *)0)->name)-1;
+	if(vol->sealed==NULL){
+		pthread_mutex_unlock(&vol->lock);
+	}
+}
+
+int tfs_vol_lookup(struct tfs_vol *vol, const char *path, struct inode *inode) {
+	ro_begin(vol);
+	int ret=get_node_by_path(vol,path,0,inode);
+	ro_end(vol);
+	return ret<0 ? -ENOENT : 0;
+}
+
+int tfs_vol_getinode(struct tfs_vol *vol, uint16_t ino, struct inode *inode) {
+	if(ino>=MAX_INUM){
+		return -ENOENT;
+	}
+	ro_begin(vol);
+	readi(vol,ino,inode);
+	ro_end(vol);
+	return inode->valid ? 0 : -ENOENT;
+}
+
+int tfs_vol_lookupat(struct tfs_vol *vol, uint16_t dir_ino, const char *name, struct inode *inode) {
+	struct dirent dirent;
+	ro_begin(vol);
+	int ret=dir_find(vol,dir_ino,name,strlen(name),&dirent);
+	if(ret==0){
+		readi(vol,dirent.ino,inode);
+	}
+	ro_end(vol);
+	if(ret==-2){
+		return -ENOTDIR;
+	}
+	return ret<0 ? -ENOENT : 0;
+}
+
+int tfs_vol_readdir(struct tfs_vol *vol, uint16_t ino, tfs_filldir_t filler, void *ctx) {
+	ro_begin(vol);
+
+	struct inode* node = slab_alloc(SLAB_INODE);
+	readi(vol, ino, node);
+	if(node->valid==0||node->type!=TFS_DIRECTORY){
+		slab_free(SLAB_INODE,node);
+		ro_end(vol);
+		return -ENOTDIR;
+	}
+
+	// A sealed directory is listed from its index, in name order
+	int stop = filler(ctx, ".", ino) || filler(ctx, "..", ino);
+	if(vol->sealed!=NULL){
+		struct sealed_dir *d=vol->sealed->dirs[ino];
+		for(int k=0;k<d->n && !stop;k++){
+			stop = filler(ctx, d->ent[k].name, d->ent[k].ino);
+		}
+		stop = 1;
+	}
+
+	// Read directory entries from its data blocks, and copy them to filler
+	struct dirent* currentBlock=slab_alloc(SLAB_BLOCK);
+	for(int i=0; i<16 && !stop; i++){
+		if(node->direct_ptr[i] == -1){
+			continue;
+		}
+		bio_read(vol->sb->d_start_blk+node->direct_ptr[i], currentBlock);
+		for(int j=0;j<DIRENTS_PER_BLOCK && !stop;j++){
+			struct dirent* temp=currentBlock+j;
+			if(temp->valid!=0){
+				stop = filler(ctx, temp->name, temp->ino);
+			}
+		}
+	}
+	slab_free(SLAB_BLOCK,currentBlock);
+	slab_free(SLAB_INODE,node);
+	ro_end(vol);
+	return 0;
+}
+
+/*
+ * Split path into a copy of its last component and the inode of its
+ * parent directory. *name is scratch memory, valid until the operation
+ * ends.
+ */
+static int resolve_parent(struct tfs_vol *vol, const char *path, struct inode *parent, char **name) {
+	// Use dirname() and basename() to separate parent directory path and target name
+	char* dirc = scratch_strdup(path);
+	char* basec = scratch_strdup(path);
+
+	char* dir_name = dirname(dirc);
+	*name = basename(basec);
+
+	// Call get_node_by_path() to get inode of parent directory
+	int ret = get_node_by_path(vol, dir_name, 0, parent);
+	if(ret == -1){
+		*name = NULL;
+		return -ENOENT;
+	}
+	return 0;
+}
+
+/*
+ * Shared body of mkdir and create: allocate an inode of the given type
+ * and link it into parent_inode under base_name.
+ */
+static int make_node(struct tfs_vol *vol, struct inode *parent_inode, const char *base_name, uint32_t type, mode_t st_mode, uint32_t link, uint16_t *out_ino) {
+	if(parent_inode->valid==0||parent_inode->type!=TFS_DIRECTORY){
+		return -ENOTDIR;
+	}
+	if(strlen(base_name)>=sizeof(((struct dirent *)0)->name)){
+		return -ENAMETOOLONG;
+	}
+
+	// Step 1: Get an available inode number, placed by the group policy
+	int avail_ino = get_avail_ino_for(vol, parent_inode->ino, type==TFS_DIRECTORY);
+	if(avail_ino < 0){
+		return -ENOSPC;
+	}
+	struct inode* new_inode = slab_zalloc(SLAB_INODE);
+	new_inode->vstat.st_mode = st_mode;
+	time(& new_inode->vstat.st_mtime);
+	new_inode->ino = avail_ino;
+	new_inode->size=0;
+	new_inode->link = link;
+	new_inode->valid = 1;
+	new_inode->type = type;
+	for(int i=0; i<16; i++){
+		new_inode->direct_ptr[i] = -1;
+	}
+
+	// Step 2: Call dir_add() to add directory entry of target to parent directory
+	struct dirent* temp = slab_alloc(SLAB_DIRENT);
+	int exists = dir_find(vol, parent_inode->ino, base_name, strlen(base_name), temp)==0;
+	slab_free(SLAB_DIRENT,temp);
+	int dir_ret = exists ? -2 : dir_add(vol, *parent_inode, avail_ino, base_name, strlen(base_name));
+	if(dir_ret < 0){
+		slab_free(SLAB_INODE,new_inode);
+		return exists ? -EEXIST : -ENOSPC;
+	}
+
+	// Step 3: Update inode bitmap for target
+	alloc_ino(vol,new_inode->ino);
+	// Step 4: Call writei() to write inode to disk
+	writei(vol, avail_ino, new_inode);
+	slab_free(SLAB_INODE,new_inode);
+	if(out_ino){
+		*out_ino = avail_ino;
+	}
+	return 0;
+}
+
+/*
+ * Discard the dirty pages of an open file in logical blocks [from, to),
+ * with the block reserved for each one that had none to go to
+ */
+static void drop_pages(struct tfs_vol *vol, struct tfs_onode *on, int from, int to){
+	for(int i=from;i<to;i++){
+		if(on->page[i]!=NULL){
+			slab_free(SLAB_BLOCK,on->page[i]);
+			on->page[i]=NULL;
+			on->ndirty--;
+			vol->dirty--;
+			if(on->reserved>0 && page_needs_block(vol,&on->inode,i)){
+				on->reserved--;
+				vol->reserved--;
+			}
+		}
+	}
+	if(on->ndirty==0){
+		vol->reserved-=on->reserved;
+		on->reserved=0;
+	}
+}
+
+/* Drop an inode's references to its data blocks, freeing those no other file shares */
+static void put_blocks(struct tfs_vol *vol, struct inode *inode) {
+	for(int i=0;i<16;i++){
+		if(inode->direct_ptr[i]<0){
+			continue;
+		}
+		put_blkno(vol,inode->direct_ptr[i]);
+		inode->direct_ptr[i]=-1;
+	}
+}
+
+/* Free an inode whose last entry is gone, and its data blocks */
+static void release_inode(struct tfs_vol *vol, struct inode *inode) {
+	if(vol->onodes[inode->ino]!=NULL){
+		drop_pages(vol,vol->onodes[inode->ino],0,16);
+	}
+	put_blocks(vol,inode);
+	free_ino(vol,inode->ino);
+	// Write back the freed inode so it no longer claims its old blocks
+	inode->valid=0;
+	writei(vol,inode->ino,inode);
+}
+
+/* A directory with data blocks still has entries (empty blocks are dropped) */
+static int dir_empty(const struct inode *inode) {
+	for(int i=0;i<16;i++){
+		if(inode->direct_ptr[i]>=0){
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/*
+ * Deferred deletion
+ *
+ * An inode whose last entry is removed goes on the superblock's orphan
+ * list instead of being freed in the operation that removed it; the
+ * reclaimer thread frees orphans in batches. The list is written with
+ * the superblock at the end of every operation, so orphans outlive a
+ * remount, and an entry whose inode is already free (a crash between
+ * fsck and the list, say) is simply dropped.
+ */
+
+static int by_ino(const void *a, const void *b) {
+	return *(const uint16_t *)a-*(const uint16_t *)b;
+}
+
+/*
+ * Free up to max orphans that are not open, each inode block read and
+ * written once however many of them it holds. The bitmaps and the list
+ * go out with the caller's end(), once for the whole batch.
+ * Returns the number of orphans freed.
+ */
+static int reclaim(struct tfs_vol *vol, int max) {
+	struct superblock *sb=vol->sb;
+	uint16_t* batch=scratch_alloc((sb->norphans+1)*sizeof(uint16_t));
+	int n=0, kept=0, freed=0;
+	for(int k=0;k<sb->norphans;k++){
+		uint16_t ino=sb->orphans[k];
+		if(ino>=sb->max_inum){
+			continue;
+		}
+		if(n<max && vol->onodes[ino]==NULL){
+			batch[n++]=ino;
+		}else{
+			sb->orphans[kept++]=ino;
+		}
+	}
+	sb->norphans=kept;
+	if(n==0){
+		return 0;
+	}
+	qsort(batch,n,sizeof(uint16_t),by_ino);
+
+	struct inode* block=slab_alloc(SLAB_BLOCK);
+	for(int k=0;k<n;){
+		int b=batch[k]/INODES_PER_BLOCK;
+		bio_read(sb->i_start_blk+b,block);
+		for(;k<n && batch[k]/INODES_PER_BLOCK==b;k++){
+			struct inode *inode=&block[batch[k]%INODES_PER_BLOCK];
+			if(!inode->valid || !get_bitmap(vol->inode_bm,batch[k])){
+				continue;
+			}
+			put_blocks(vol,inode);
+			free_ino(vol,batch[k]);
+			inode->valid=0;
+			freed++;
+		}
+		bio_write(sb->i_start_blk+b,block);
+	}
+	slab_free(SLAB_BLOCK,block);
+	return freed;
+}
+
+/* Whether any orphan can be reclaimed now */
+static int reclaimable(struct tfs_vol *vol) {
+	for(int k=0;k<vol->sb->norphans;k++){
+		if(vol->sb->orphans[k]>=vol->sb->max_inum || vol->onodes[vol->sb->orphans[k]]==NULL){
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* Reclaimer thread: a batch at a time, letting other operations in between */
+static void *reclaimer(void *arg){
+	struct tfs_vol *vol=arg;
+	pthread_mutex_lock(&vol->lock);
+	while(vol->reclaiming){
+		if(!reclaimable(vol)){
+			pthread_cond_wait(&vol->reclaim_cv,&vol->lock);
+			continue;
+		}
+		start(vol);
+		reclaim(vol,TFS_RECLAIM_BATCH);
+		end(vol);
+		pthread_mutex_unlock(&vol->lock);
+		sched_yield();
+		pthread_mutex_lock(&vol->lock);
+	}
+	pthread_mutex_unlock(&vol->lock);
+	return NULL;
+}
+
+/* Tell the reclaimer there is work, starting it the first time */
+static void reclaim_wake(struct tfs_vol *vol) {
+	if(vol->reclaiming){
+		pthread_cond_signal(&vol->reclaim_cv);
+		return;
+	}
+	// If the thread cannot start, orphans wait for a full disk or the next mount
+	vol->reclaiming=1;
+	if(pthread_create(&vol->reclaimer,NULL,reclaimer,vol)!=0){
+		vol->reclaiming=0;
+	}
+}
+
+/*
+ * The last entry of inode is gone. An open file, or one with data
+ * blocks, becomes an orphan; anything else has nothing to free and
+ * is released now.
+ */
+static void retire_inode(struct tfs_vol *vol, struct inode *inode) {
+	struct tfs_onode *on=vol->onodes[inode->ino];
+	if((on==NULL && dir_empty(inode)) || vol->sb->norphans>=MAX_INUM){
+		release_inode(vol,inode);
+		return;
+	}
+	vol->sb->orphans[vol->sb->norphans++]=inode->ino;
+	if(on!=NULL){
+		// Freed once the last handle is closed
+		on->unlinked=1;
+		return;
+	}
+	reclaim_wake(vol);
+}
+
+int tfs_vol_reclaim(struct tfs_vol *vol) {
+	int n=0;
+	if(vol->sealed!=NULL){
+		return 0;
+	}
+	pthread_mutex_lock(&vol->lock);
+	if(reclaimable(vol)){
+		start(vol);
+		n=reclaim(vol,MAX_INUM);
+		end(vol);
+	}
+	pthread_mutex_unlock(&vol->lock);
+	return n;
+}
+
+/*
+ * Shared body of rmdir and unlink: remove target from parentInode,
+ * freeing the data blocks of a file. Directories must be empty.
+ */
+static int remove_node(struct tfs_vol *vol, struct inode *parentInode, const char *target, int want_dir) {
+	int ret = 0;
+	uint16_t ino;
+	struct dirent* targetDirent=slab_alloc(SLAB_DIRENT);
+	struct inode* targetInode=slab_alloc(SLAB_INODE);
+	if(dir_find(vol,parentInode->ino,target,strlen(target),targetDirent)<0){
+		ret = -ENOENT;
+		goto out;
+	}
+
+	readi(vol,targetDirent->ino,targetInode);
+	if(want_dir && targetInode->type!=TFS_DIRECTORY){
+		ret = -ENOTDIR;
+		goto out;
+	}
+	if(!want_dir && targetInode->type==TFS_DIRECTORY){
+		ret = -EISDIR;
+		goto out;
+	}
+	// Refuse to remove a directory that still has data blocks
+	if(want_dir && !dir_empty(targetInode)){
+		ret = -ENOTEMPTY;
+		goto out;
+	}
+
+	// Remove the directory entry of target in its parent directory
+	dir_update(vol,*parentInode,target,-1,&ino);
+	retire_inode(vol,targetInode);
+out:
+	slab_free(SLAB_INODE,targetInode);
+	slab_free(SLAB_DIRENT,targetDirent);
+	return ret;
+}
+
+/* Whether directory ino is dir or somewhere below it */
+static int in_subtree(struct tfs_vol *vol, uint16_t dir, uint16_t ino) {
+	uint16_t* stack=scratch_alloc(MAX_INUM*sizeof(uint16_t));
+	struct dirent* currentBlock=slab_alloc(SLAB_BLOCK);
+	struct inode node;
+	int n=0, found=0;
+	stack[n++]=dir;
+	while(n>0 && !found){
+		uint16_t d=stack[--n];
+		if(d==ino){
+			found=1;
+			break;
+		}
+		readi(vol,d,&node);
+		for(int i=0;i<16;i++){
+			if(node.direct_ptr[i]<0){
+				continue;
+			}
+			bio_read(vol->sb->d_start_blk+node.direct_ptr[i],currentBlock);
+			for(int j=0;j<DIRENTS_PER_BLOCK && n<MAX_INUM;j++){
+				struct inode child;
+				if(currentBlock[j].valid==0){
+					continue;
+				}
+				readi(vol,currentBlock[j].ino,&child);
+				if(child.type==TFS_DIRECTORY){
+					stack[n++]=child.ino;
+				}
+			}
+		}
+	}
+	slab_free(SLAB_BLOCK,currentBlock);
+	return found;
+}
+
+/*
+ * Move the entry oldname in oldParent to newname in newParent without
+ * touching the inode or its data. An existing newname is replaced in
+ * place, so it never goes missing, and then released; otherwise the new
+ * entry is added before the old one is removed, so a full directory
+ * leaves the tree as it was. A directory is only moved onto an empty
+ * directory and never below itself.
+ */
+static int rename_node(struct tfs_vol *vol, struct inode *oldParent, const char *oldname,
+		struct inode *newParent, const char *newname, unsigned int flags) {
+	struct dirent src, dst;
+	struct inode srcInode, dstInode;
+	uint16_t ino;
+
+	if(flags & ~RENAME_NOREPLACE){
+		return -EINVAL;
+	}
+	if(oldParent->type!=TFS_DIRECTORY || newParent->type!=TFS_DIRECTORY){
+		return -ENOTDIR;
+	}
+	if(strlen(newname)>=sizeof(dst.name)){
+		return -ENAMETOOLONG;
+	}
+	if(dir_find(vol,oldParent->ino,oldname,strlen(oldname),&src)<0){
+		return -ENOENT;
+	}
+	readi(vol,src.ino,&srcInode);
+	if(srcInode.type==TFS_DIRECTORY && oldParent->ino!=newParent->ino &&
+			in_subtree(vol,srcInode.ino,newParent->ino)){
+		return -EINVAL;
+	}
+
+	if(dir_find(vol,newParent->ino,newname,strlen(newname),&dst)==0){
+		if(dst.ino==src.ino){
+			return 0;
+		}
+		if(flags & RENAME_NOREPLACE){
+			return -EEXIST;
+		}
+		readi(vol,dst.ino,&dstInode);
+		if(srcInode.type==TFS_DIRECTORY && dstInode.type!=TFS_DIRECTORY){
+			return -ENOTDIR;
+		}
+		if(srcInode.type!=TFS_DIRECTORY && dstInode.type==TFS_DIRECTORY){
+			return -EISDIR;
+		}
+		if(dstInode.type==TFS_DIRECTORY && !dir_empty(&dstInode)){
+			return -ENOTEMPTY;
+		}
+		dir_update(vol,*newParent,newname,src.ino,&ino);
+		readi(vol,oldParent->ino,oldParent);
+		dir_update(vol,*oldParent,oldname,-1,&ino);
+		retire_inode(vol,&dstInode);
+		return 0;
+	}
+
+	if(dir_link(vol,*newParent,src.ino,newname,strlen(newname))<0){
+		return -ENOSPC;
+	}
+	// dir_link may have grown the directory, so reread before removing
+	readi(vol,oldParent->ino,oldParent);
+	dir_update(vol,*oldParent,oldname,-1,&ino);
+	return 0;
+}
+
+int tfs_vol_mkdir(struct tfs_vol *vol, const char *path, mode_t mode) {
+	if(vol->sealed){
+		return -EROFS;
+	}
+	struct inode parent;
+	char *name;
+	pthread_mutex_lock(&vol->lock);
+	start(vol);
+	int ret = resolve_parent(vol, path, &parent, &name);
+	if(ret == 0){
+		ret = make_node(vol, &parent, name, TFS_DIRECTORY, S_IFDIR | 0755, 2, NULL);
+	}
+	end(vol);
+	pthread_mutex_unlock(&vol->lock);
+	return ret;
+}
+
+int tfs_vol_create(struct tfs_vol *vol, const char *path, mode_t mode, uint16_t *ino) {
+	if(vol->sealed){
+		return -EROFS;
+	}
+	struct inode parent;
+	char *name;
+	pthread_mutex_lock(&vol->lock);
+	start(vol);
+	int ret = resolve_parent(vol, path, &parent, &name);
+	if(ret == 0){
+		ret = make_node(vol, &parent, name, TFS_FILE, S_IFREG | 0666, 1, ino);
+	}
+	end(vol);
+	pthread_mutex_unlock(&vol->lock);
+	return ret;
+}
+
+int tfs_vol_rmdir(struct tfs_vol *vol, const char *path) {
+	if(vol->sealed){
+		return -EROFS;
+	}
+	struct inode parent;
+	char *name;
+	pthread_mutex_lock(&vol->lock);
+	start(vol);
+	int ret = resolve_parent(vol, path, &parent, &name);
+	if(ret == 0){
+		ret = remove_node(vol, &parent, name, 1);
+	}
+	end(vol);
+	pthread_mutex_unlock(&vol->lock);
+	return ret;
+}
+
+int tfs_vol_unlink(struct tfs_vol *vol, const char *path) {
+	if(vol->sealed){
+		return -EROFS;
+	}
+	struct inode parent;
+	char *name;
+	pthread_mutex_lock(&vol->lock);
+	start(vol);
+	int ret = resolve_parent(vol, path, &parent, &name);
+	if(ret == 0){
+		ret = remove_node(vol, &parent, name, 0);
+	}
+	end(vol);
+	pthread_mutex_unlock(&vol->lock);
+	return ret;
+}
+
+int tfs_vol_mkdirat(struct tfs_vol *vol, uint16_t dir_ino, const char *name, mode_t mode, uint16_t *ino) {
+	if(vol->sealed){
+		return -EROFS;
+	}
+	struct inode parent;
+	pthread_mutex_lock(&vol->lock);
+	start(vol);
+	readi(vol, dir_ino, &parent);
+	int ret = make_node(vol, &parent, name, TFS_DIRECTORY, S_IFDIR | 0755, 2, ino);
+	end(vol);
+	pthread_mutex_unlock(&vol->lock);
+	return ret;
+}
+
+int tfs_vol_createat(struct tfs_vol *vol, uint16_t dir_ino, const char *name, mode_t mode, uint16_t *ino) {
+	if(vol->sealed){
+		return -EROFS;
+	}
+	struct inode parent;
+	pthread_mutex_lock(&vol->lock);
+	start(vol);
+	readi(vol, dir_ino, &parent);
+	int ret = make_node(vol, &parent, name, TFS_FILE, S_IFREG | 0666, 1, ino);
+	end(vol);
+	pthread_mutex_unlock(&vol->lock);
+	return ret;
+}
+
+int tfs_vol_rmdirat(struct tfs_vol *vol, uint16_t dir_ino, const char *name) {
+	if(vol->sealed){
+		return -EROFS;
+	}
+	struct inode parent;
+	pthread_mutex_lock(&vol->lock);
+	start(vol);
+	readi(vol, dir_ino, &parent);
+	int ret = remove_node(vol, &parent, name, 1);
+	end(vol);
+	pthread_mutex_unlock(&vol->lock);
+	return ret;
+}
+
+int tfs_vol_unlinkat(struct tfs_vol *vol, uint16_t dir_ino, const char *name) {
+	if(vol->sealed){
+		return -EROFS;
+	}
+	struct inode parent;
+	pthread_mutex_lock(&vol->lock);
+	start(vol);
+	readi(vol, dir_ino, &parent);
+	int ret = remove_node(vol, &parent, name, 0);
+	end(vol);
+	pthread_mutex_unlock(&vol->lock);
+	return ret;
+}
+
+int tfs_vol_rename(struct tfs_vol *vol, const char *from, const char *to, unsigned int flags) {
+	if(vol->sealed){
+		return -EROFS;
+	}
+	struct inode oldParent, newParent;
+	char *oldname, *newname;
+	pthread_mutex_lock(&vol->lock);
+	start(vol);
+	int ret = resolve_parent(vol, from, &oldParent, &oldname);
+	if(ret == 0){
+		if((ret = resolve_parent(vol, to, &newParent, &newname)) == 0){
+			ret = rename_node(vol, &oldParent, oldname, &newParent, newname, flags);
+		}
+	}
+	end(vol);
+	pthread_mutex_unlock(&vol->lock);
+	return ret;
+}
+
+int tfs_vol_renameat(struct tfs_vol *vol, uint16_t olddir_ino, const char *oldname, uint16_t newdir_ino, const char *newname, unsigned int flags) {
+	if(vol->sealed){
+		return -EROFS;
+	}
+	struct inode oldParent, newParent;
+	pthread_mutex_lock(&vol->lock);
+	start(vol);
+	readi(vol, olddir_ino, &oldParent);
+	readi(vol, newdir_ino, &newParent);
+	int ret = rename_node(vol, &oldParent, oldname, &newParent, newname, flags);
+	end(vol);
+	pthread_mutex_unlock(&vol->lock);
+	return ret;
+}
+
+/*
+ * Look for a block on the volume holding exactly data, whose hash is *h.
+ * Returns the block or -1; *h is cleared if a different block already
+ * holds that hash, so the caller knows not to index under it.
+ */
+static int dedup_find(struct tfs_vol *vol, uint64_t *h, const char *data){
+	int blk=dedup_lookup(vol->dd,*h);
+	if(blk<0){
+		return -1;
+	}
+	char* other=slab_alloc(SLAB_BLOCK);
+	bio_read(vol->sb->d_start_blk+blk,other);
+	if(memcmp(other,data,BLOCK_SIZE)!=0){
+		*h=0;
+		blk=-1;
+	}
+	slab_free(SLAB_BLOCK,other);
+	return blk;
+}
+
+/*
+ * Make data, a whole block, the content of logical block i of inode.
+ * With dedup on, a block already holding the same bytes is shared
+ * rather than written. A block shared with other files is never written
+ * in place; the slot gets a block of its own instead.
+ * Returns 0 or -ENOSPC.
+ */
+static int store_block(struct tfs_vol *vol, struct inode *inode, int i, const char *data){
+	int old=inode->direct_ptr[i], blk;
+	uint64_t h=0;
+	if(vol->dd && vol->dedup){
+		h=block_hash(data);
+		if((blk=dedup_find(vol,&h,data))>=0){
+			if(blk!=old){
+				vol->dd->ents[blk].refs++;
+				dedup_dirty(vol->dd,blk);
+				if(old>=0){
+					put_blkno(vol,old);
+				}
+				inode->direct_ptr[i]=blk;
+			}
+			return 0;
+		}
+	}
+	if(old>=0 && !shared_blkno(vol,old)){
+		blk=old;
+		if(vol->dd){
+			dedup_unindex(vol->dd,blk);
+		}
+	}
+	else{
+		if((blk=get_avail_blkno_near(vol,data_goal(vol,inode,i)))<0){
+			return -ENOSPC;
+		}
+		alloc_blkno(vol,blk);
+		if(old>=0){
+			put_blkno(vol,old);
+		}
+		inode->direct_ptr[i]=blk;
+	}
+	bio_write(vol->sb->d_start_blk+blk,data);
+	if(h!=0){
+		dedup_insert(vol->dd,blk,h);
+	}
+	return 0;
+}
+
+/*
+ * Give logical block i of inode a block only it uses, copying a shared
+ * one, so the caller can write to it directly. The block leaves the
+ * index since its content is about to change.
+ * Returns 0 or -ENOSPC.
+ */
+static int own_block(struct tfs_vol *vol, struct inode *inode, int i){
+	int old=inode->direct_ptr[i];
+	if(vol->dd==NULL){
+		return 0;
+	}
+	if(!shared_blkno(vol,old)){
+		dedup_unindex(vol->dd,old);
+		return 0;
+	}
+	int blk=get_avail_blkno_near(vol,data_goal(vol,inode,i));
+	if(blk<0){
+		return -ENOSPC;
+	}
+	char* data=slab_alloc(SLAB_BLOCK);
+	bio_read(vol->sb->d_start_blk+old,data);
+	alloc_blkno(vol,blk);
+	bio_write(vol->sb->d_start_blk+blk,data);
+	slab_free(SLAB_BLOCK,data);
+	put_blkno(vol,old);
+	inode->direct_ptr[i]=blk;
+	return 0;
+}
+
+/*
+ * Compressed clusters
+ *
+ * With compression on, file data is written a cluster (TFS_CLUSTER_BLOCKS
+ * blocks) at a time. A cluster that compresses into fewer blocks is
+ * stored as a zhdr followed by the compressed bytes in its first slots,
+ * the remaining slots set to TFS_ZSLOT; anything else is stored raw.
+ */
+#define CLUSTER_SIZE (TFS_CLUSTER_BLOCKS*BLOCK_SIZE)
+#define ZMAGIC 0x5A43
+
+struct zhdr {
+	uint32_t	magic;
+	uint32_t	clen;		/* compressed bytes following the header */
+	uint32_t	ulen;		/* bytes they decompress to */
+};
+
+static int cluster_compressed(const struct inode *inode, int c){
+	for(int j=0;j<TFS_CLUSTER_BLOCKS;j++){
+		if(inode->direct_ptr[c*TFS_CLUSTER_BLOCKS+j]==TFS_ZSLOT){
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static int range_compressed(const struct inode *inode, off_t offset, size_t size){
+	for(int c=offset/CLUSTER_SIZE; c<=(int)((offset+size-1)/CLUSTER_SIZE); c++){
+		if(cluster_compressed(inode,c)){
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Read the first n slots of a cluster into buf, skipping holes. Each run
+ * of physically consecutive blocks is one bio_readv, which a striped
+ * disk spreads over its members.
+ */
+static void read_slots(struct tfs_vol *vol, const int *slot, int n, char *buf){
+	void* bufs[TFS_CLUSTER_BLOCKS];
+	for(int j=0;j<n; ){
+		int k=j+1;
+		if(slot[j]<0){
+			j++;
+			continue;
+		}
+		while(k<n && slot[k]==slot[k-1]+1){
+			k++;
+		}
+		for(int i=j;i<k;i++){
+			bufs[i-j]=buf+i*BLOCK_SIZE;
+		}
+		bio_readv(vol->sb->d_start_blk+slot[j],bufs,k-j);
+		j=k;
+	}
+}
+
+/* Read cluster c of inode into buf, holes and the tail past ulen as zeros */
+static int load_cluster(struct tfs_vol *vol, const struct inode *inode, int c, char *buf){
+	const int *slot=&inode->direct_ptr[c*TFS_CLUSTER_BLOCKS];
+	memset(buf,0,CLUSTER_SIZE);
+	if(!cluster_compressed(inode,c)){
+		read_slots(vol,slot,TFS_CLUSTER_BLOCKS,buf);
+		return 0;
+	}
+	char* z=scratch_alloc(CLUSTER_SIZE);
+	int n=0;
+	while(n<TFS_CLUSTER_BLOCKS && slot[n]>=0){
+		n++;
+	}
+	read_slots(vol,slot,n,z);
+	struct zhdr* h=(struct zhdr*)z;
+	int ret=0;
+	if(n==0 || h->magic!=ZMAGIC || h->ulen>CLUSTER_SIZE || h->clen>n*BLOCK_SIZE-sizeof(struct zhdr) ||
+			tfs_lz_decompress(h+1,h->clen,buf,h->ulen)!=(int)h->ulen){
+		printf("Corrupt compressed cluster %d in inode %d\n",c,inode->ino);
+		ret=-EIO;
+	}
+	return ret;
+}
+
+/*
+ * Store buf as cluster c of inode, covering the file up to fsize.
+ * Compresses when the volume asks for it and that saves a block, and
+ * allocates or frees data blocks to match. On -ENOSPC the cluster is
+ * left as it was.
+ */
+static int store_cluster(struct tfs_vol *vol, struct inode *inode, int c, const char *buf, off_t fsize){
+	int *slot=&inode->direct_ptr[c*TFS_CLUSTER_BLOCKS];
+	off_t left=fsize-(off_t)c*CLUSTER_SIZE;
+	int nraw = left>=CLUSTER_SIZE ? TFS_CLUSTER_BLOCKS : (int)((left+BLOCK_SIZE-1)/BLOCK_SIZE);
+	int n=nraw, clen=0;
+	char* z=NULL;
+
+	// Step 1: Compress, and keep the result only if it needs fewer blocks
+	if(vol->compress && nraw>1){
+		z=scratch_alloc(CLUSTER_SIZE);
+		memset(z,0,CLUSTER_SIZE);
+		clen=tfs_lz_compress(buf,nraw*BLOCK_SIZE,z+sizeof(struct zhdr),(nraw-1)*BLOCK_SIZE-sizeof(struct zhdr));
+		if(clen>0){
+			struct zhdr* h=(struct zhdr*)z;
+			h->magic=ZMAGIC;
+			h->clen=clen;
+			h->ulen=nraw*BLOCK_SIZE;
+			n=(sizeof(struct zhdr)+clen+BLOCK_SIZE-1)/BLOCK_SIZE;
+		}
+	}
+
+	// A raw cluster replacing a raw one is just its blocks, which can be shared
+	if(clen==0 && !cluster_compressed(inode,c)){
+		for(int j=0;j<nraw;j++){
+			int ret=store_block(vol,inode,c*TFS_CLUSTER_BLOCKS+j,buf+j*BLOCK_SIZE);
+			if(ret<0){
+				return ret;
+			}
+		}
+		return 0;
+	}
+
+	// Step 2: Back the first n slots with data blocks no other file uses
+	int blk[TFS_CLUSTER_BLOCKS];
+	for(int j=0;j<n;j++){
+		blk[j]=slot[j];
+		if(blk[j]>=0 && !shared_blkno(vol,blk[j])){
+			if(vol->dd){
+				dedup_unindex(vol->dd,blk[j]);
+			}
+			continue;
+		}
+		int goal = j>0 ? blk[j-1]+1 : data_goal(vol,inode,c*TFS_CLUSTER_BLOCKS);
+		if((blk[j]=get_avail_blkno_near(vol,goal))<0){
+			for(int k=0;k<j;k++){
+				if(blk[k]!=slot[k]){
+					free_blkno(vol,blk[k]);
+				}
+			}
+			return -ENOSPC;
+		}
+		alloc_blkno(vol,blk[j]);
+	}
+
+	// Step 3: Write the data and settle the slots
+	for(int j=0;j<n;j++){
+		if(slot[j]>=0 && slot[j]!=blk[j]){
+			put_blkno(vol,slot[j]);
+		}
+		slot[j]=blk[j];
+		bio_write(vol->sb->d_start_blk+slot[j], clen>0 ? z+j*BLOCK_SIZE : buf+j*BLOCK_SIZE);
+	}
+	// Past n the cluster needs no blocks: any there held compressed bytes
+	for(int j=n;j<TFS_CLUSTER_BLOCKS;j++){
+		if(slot[j]>=0){
+			put_blkno(vol,slot[j]);
+		}
+		slot[j] = clen>0 && j<nraw ? TFS_ZSLOT : -1;
+	}
+	return 0;
+}
+
+/*
+ * Cluster-at-a-time write: load, patch and store each cluster the range
+ * touches, growing the file as each one lands. Used when the volume
+ * compresses or the range already holds compressed clusters.
+ * Returns bytes written or a negative errno.
+ */
+static int write_clusters(struct tfs_vol *vol, struct inode *inode, const char *buffer, size_t size, off_t offset){
+	char* buf=scratch_alloc(CLUSTER_SIZE);
+	size_t done=0;
+	int ret=0;
+	for(int c=offset/CLUSTER_SIZE; done<size; c++){
+		size_t coff=offset+done-(off_t)c*CLUSTER_SIZE;
+		size_t n = CLUSTER_SIZE-coff < size-done ? CLUSTER_SIZE-coff : size-done;
+		off_t fsize = offset+done+n > inode->size ? offset+done+n : inode->size;
+		if((ret=load_cluster(vol,inode,c,buf))<0){
+			break;
+		}
+		memcpy(buf+coff,buffer+done,n);
+		if((ret=store_cluster(vol,inode,c,buf,fsize))<0){
+			break;
+		}
+		inode->size=fsize;
+		done+=n;
+	}
+	if(done>0){
+		time(&inode->vstat.st_mtime);
+	}
+	writei(vol,inode->ino,inode);
+	return done>0 ? (int)done : ret;
+}
+
+/*
+ * Delayed allocation
+ *
+ * With vol->delalloc set, a write to an open file only patches pages in
+ * its onode and reserves a data block for each page that will need a
+ * new one; nothing is allocated or written. Writeback then stores the
+ * pages: compressed clusters and deduplicated blocks through the usual
+ * store paths, everything else by allocating the file's new blocks in
+ * as few runs as free space allows (see fill_slots) and writing each
+ * physically contiguous stretch with a single bio_writev.
+ */
+
+/* Whether writing logical block i of inode will take a new data block */
+static int page_needs_block(struct tfs_vol *vol, const struct inode *inode, int i){
+	return inode->direct_ptr[i]<0 || shared_blkno(vol,inode->direct_ptr[i]);
+}
+
+/* Read the current content of logical block i of inode into page */
+static int read_page(struct tfs_vol *vol, const struct inode *inode, int i, char *page){
+	int c=i/TFS_CLUSTER_BLOCKS, ret=0;
+	if(cluster_compressed(inode,c)){
+		char* cluster=scratch_alloc(CLUSTER_SIZE);
+		if((ret=load_cluster(vol,inode,c,cluster))==0){
+			memcpy(page,cluster+(i%TFS_CLUSTER_BLOCKS)*BLOCK_SIZE,BLOCK_SIZE);
+		}
+	}
+	else if(inode->direct_ptr[i]>=0){
+		bio_read(vol->sb->d_start_blk+inode->direct_ptr[i],page);
+	}
+	else{
+		memset(page,0,BLOCK_SIZE);
+	}
+	return ret;
+}
+
+/*
+ * Write the dirty pages of an open file below logical block to to disk,
+ * allocating what they need, and write its inode; pages from to on stay
+ * cached. The pages written are gone afterwards even if some could not
+ * be stored, which is reported as -ENOSPC or -EIO.
+ */
+static int writeback(struct tfs_vol *vol, struct tfs_onode *on, int to){
+	struct inode inode=on->inode;
+	int ret=0, n=0;
+	for(int i=0;i<to;i++){
+		n += on->page[i]!=NULL;
+	}
+	if(n==0){
+		return 0;
+	}
+	// The reservation turns into real blocks now
+	vol->reserved-=on->reserved;
+	on->reserved=0;
+
+	// Step 1: Compressed clusters, and every cluster of a compressing volume
+	char* cluster=NULL;
+	for(int c=0;c*TFS_CLUSTER_BLOCKS<to;c++){
+		int j, err, cend = (c+1)*TFS_CLUSTER_BLOCKS<to ? (c+1)*TFS_CLUSTER_BLOCKS : to;
+		if(!vol->compress && !cluster_compressed(&inode,c)){
+			continue;
+		}
+		for(j=c*TFS_CLUSTER_BLOCKS;j<cend && on->page[j]==NULL;j++);
+		if(j==cend){
+			continue;
+		}
+		if(cluster==NULL){
+			cluster=scratch_alloc(CLUSTER_SIZE);
+		}
+		if((err=load_cluster(vol,&inode,c,cluster))==0){
+			for(j=c*TFS_CLUSTER_BLOCKS;j<cend;j++){
+				if(on->page[j]!=NULL){
+					memcpy(cluster+(j-c*TFS_CLUSTER_BLOCKS)*BLOCK_SIZE,on->page[j],BLOCK_SIZE);
+				}
+			}
+			err=store_cluster(vol,&inode,c,cluster,inode.size);
+		}
+		if(err<0 && ret==0){
+			ret=err;
+		}
+		drop_pages(vol,on,c*TFS_CLUSTER_BLOCKS,cend);
+	}
+
+	// Step 2: Deduplicated blocks are placed by their content
+	if(vol->dd && vol->dedup){
+		for(int i=0;i<to;i++){
+			int err;
+			if(on->page[i]!=NULL && (err=store_block(vol,&inode,i,on->page[i]))<0 && ret==0){
+				ret=err;
+			}
+		}
+		drop_pages(vol,on,0,to);
+	}
+
+	// Step 3: Give every remaining page a block of its own, new ones in runs
+	unsigned holes=0;
+	for(int i=0;i<to;i++){
+		if(on->page[i]==NULL){
+			continue;
+		}
+		if(inode.direct_ptr[i]<0){
+			holes|=1u<<i;
+		}
+		else if(own_block(vol,&inode,i)<0){
+			ret=-ENOSPC;
+			drop_pages(vol,on,i,i+1);
+		}
+	}
+	if(fill_slots(vol,&inode,holes)<0){
+		ret=-ENOSPC;
+		for(int i=0;i<to;i++){
+			if(on->page[i]!=NULL && inode.direct_ptr[i]<0){
+				drop_pages(vol,on,i,i+1);
+			}
+		}
+	}
+
+	// Step 4: One write per physically contiguous stretch of pages
+	for(int i=0;i<to;){
+		int j=i+1;
+		if(on->page[i]==NULL){
+			i++;
+			continue;
+		}
+		while(j<to && on->page[j]!=NULL && inode.direct_ptr[j]==inode.direct_ptr[i]+(j-i)){
+			j++;
+		}
+		if(bio_writev(vol->sb->d_start_blk+inode.direct_ptr[i],(void *const *)&on->page[i],j-i)<0 && ret==0){
+			ret=-EIO;
+		}
+		i=j;
+	}
+	drop_pages(vol,on,0,to);
+	writei(vol,inode.ino,&inode);
+
+	// Pages still cached keep their reservation
+	for(int i=to;i<16;i++){
+		if(on->page[i]!=NULL && page_needs_block(vol,&on->inode,i)){
+			on->reserved++;
+			vol->reserved++;
+		}
+	}
+	return ret;
+}
+
+/* Write back the open file with the most dirty pages */
+static void writeback_largest(struct tfs_vol *vol){
+	struct tfs_onode *best=NULL;
+	for(int i=0;i<MAX_INUM;i++){
+		struct tfs_onode *on=vol->onodes[i];
+		if(on!=NULL && (best==NULL || on->ndirty>best->ndirty)){
+			best=on;
+		}
+	}
+	if(best!=NULL){
+		writeback(vol,best,16);
+	}
+}
+
+/* Write back every open file whose oldest dirty page is from cutoff or before */
+static int writeback_all(struct tfs_vol *vol, time_t cutoff){
+	int ret=0;
+	for(int i=0;i<MAX_INUM && vol->dirty>0;i++){
+		struct tfs_onode *on=vol->onodes[i];
+		int err;
+		if(on!=NULL && on->ndirty>0 && on->dirtied<=cutoff && (err=writeback(vol,on,16))<0 && ret==0){
+			ret=err;
+		}
+	}
+	return ret;
+}
+
+/*
+ * Patch size bytes at offset into the page cache of an open file,
+ * reading in the rest of a page the first time it is partly written.
+ * Returns bytes written, or -ENOSPC once nothing is left to reserve.
+ */
+static int cache_write(struct tfs_vol *vol, struct tfs_onode *on, const char *buffer, size_t size, off_t offset){
+	struct inode *inode=&on->inode;
+	size_t done=0;
+	int ret=0;
+	for(int i=offset/BLOCK_SIZE; done<size; i++){
+		size_t blockOffset=(offset+done)%BLOCK_SIZE;
+		size_t toWrite=BLOCK_SIZE-blockOffset<size-done ? BLOCK_SIZE-blockOffset : size-done;
+		if(on->page[i]==NULL){
+			int need=page_needs_block(vol,inode,i);
+			if(need && (int)vol->sb->free_dnum-vol->reserved<=0){
+				ret=-ENOSPC;
+				break;
+			}
+			char* page=slab_alloc(SLAB_BLOCK);
+			if(toWrite<BLOCK_SIZE && (ret=read_page(vol,inode,i,page))<0){
+				slab_free(SLAB_BLOCK,page);
+				break;
+			}
+			on->page[i]=page;
+			if(on->ndirty++==0){
+				time(&on->dirtied);
+			}
+			vol->dirty++;
+			on->reserved+=need;
+			vol->reserved+=need;
+		}
+		memcpy(on->page[i]+blockOffset,buffer+done,toWrite);
+		done+=toWrite;
+	}
+	if(offset+(off_t)done>inode->size){
+		inode->size=offset+done;
+	}
+	if(done>0){
+		time(&inode->vstat.st_mtime);
+	}
+	return done>0 ? (int)done : ret;
+}
+
+/* Flusher thread: once a second, write back pages older than TFS_DIRTY_AGE */
+static void *flusher(void *arg){
+	struct tfs_vol *vol=arg;
+	pthread_mutex_lock(&vol->lock);
+	while(vol->flushing){
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME,&ts);
+		ts.tv_sec++;
+		pthread_cond_timedwait(&vol->flush_cv,&vol->lock,&ts);
+		if(vol->flushing && vol->dirty>0){
+			start(vol);
+			writeback_all(vol,time(NULL)-TFS_DIRTY_AGE);
+			end(vol);
+		}
+	}
+	pthread_mutex_unlock(&vol->lock);
+	return NULL;
+}
+
+int tfs_vol_delalloc(struct tfs_vol *vol) {
+	if(vol->sealed){
+		return -EROFS;
+	}
+	int ret=0;
+	pthread_mutex_lock(&vol->lock);
+	if(!vol->flushing){
+		vol->flushing=1;
+		if((ret=-pthread_create(&vol->flusher,NULL,flusher,vol))<0){
+			vol->flushing=0;
+		}
+	}
+	vol->delalloc = ret==0;
+	pthread_mutex_unlock(&vol->lock);
+	return ret;
+}
+
+int tfs_vol_sync(struct tfs_vol *vol) {
+	int ret=0;
+	pthread_mutex_lock(&vol->lock);
+	if(vol->dirty>0){
+		start(vol);
+		ret=writeback_all(vol,time(NULL));
+		end(vol);
+	}
+	pthread_mutex_unlock(&vol->lock);
+	return ret;
+}
+
+/*
+ * RAM-resident volumes
+ *
+ * On a disk opened in RAM mode (dev_ram) every operation runs at memory
+ * speed and the image file only changes when a snapshot is taken. The
+ * blocks written since the last snapshot are copied aside under the
+ * volume lock, between operations, so the snapshot is a consistent
+ * image; writing them out happens after the lock is dropped.
+ */
+
+int tfs_vol_snapshot(struct tfs_vol *vol) {
+	int ret=0;
+	pthread_mutex_lock(&vol->snap_lock);
+	pthread_mutex_lock(&vol->lock);
+	int n=dev_snap_copy();
+	pthread_mutex_unlock(&vol->lock);
+	if(n<0 || (n>0 && dev_snap_write()<0)){
+		ret=-EIO;
+	}
+	pthread_mutex_unlock(&vol->snap_lock);
+	return ret;
+}
+
+/* Snapshot thread: every snap_secs seconds while snap_secs is set */
+static void *snapshotter(void *arg){
+	struct tfs_vol *vol=arg;
+	pthread_mutex_lock(&vol->lock);
+	while(vol->snap_secs>0){
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME,&ts);
+		ts.tv_sec+=vol->snap_secs;
+		if(pthread_cond_timedwait(&vol->snap_cv,&vol->lock,&ts)==ETIMEDOUT && vol->snap_secs>0){
+			pthread_mutex_unlock(&vol->lock);
+			tfs_vol_snapshot(vol);
+			pthread_mutex_lock(&vol->lock);
+		}
+	}
+	pthread_mutex_unlock(&vol->lock);
+	return NULL;
+}
+
+int tfs_vol_autosnap(struct tfs_vol *vol, int secs) {
+	if(vol->sealed){
+		return -EROFS;
+	}
+	int ret=0;
+	if(secs<=0){
+		return -EINVAL;
+	}
+	pthread_mutex_lock(&vol->lock);
+	int running=vol->snap_secs>0;
+	vol->snap_secs=secs;
+	if(!running && (ret=-pthread_create(&vol->snapper,NULL,snapshotter,vol))<0){
+		vol->snap_secs=0;
+	}
+	pthread_mutex_unlock(&vol->lock);
+	return ret;
+}
+
+/*
+ * Read up to size bytes at offset from file ino into buffer. Reads are
+ * clamped to the file size and unallocated blocks read as zeros, so
+ * kernel readahead and page-cache fills past EOF get a short read
+ * rather than an error.
+ * Returns the number of bytes read or a negative errno.
+ */
+int tfs_vol_read(struct tfs_vol *vol, uint16_t ino, char *buffer, size_t size, off_t offset) {
+	if(ino>=MAX_INUM){
+		return -EINVAL;
+	}
+	if(size==0){
+		return 0;
+	}
+	ro_begin(vol);
+	struct inode* inode = slab_alloc(SLAB_INODE);
+	readi(vol, ino, inode);
+	if(inode->type==TFS_DIRECTORY){
+		slab_free(SLAB_INODE,inode);
+		ro_end(vol);
+		return -EISDIR;
+	}
+
+	// Step 1: Clamp the request to the end of the file
+	if(offset>=inode->size){
+		size=0;
+	}
+	else if(offset+size>inode->size){
+		size=inode->size-offset;
+	}
+
+	// Step 2: copy the correct amount of data from offset to buffer
+	int block_num = (int)offset/BLOCK_SIZE;
+	int block_offset = offset%BLOCK_SIZE;
+	size_t bytes_left = size;
+	size_t bytesRead = 0;
+
+	struct tfs_onode *on=vol->onodes[ino];
+	char* currentBlock=slab_alloc(SLAB_BLOCK);
+	char* cluster=NULL;
+	int loaded=-1, err=0;
+	for(int i=block_num; bytes_left>0 && i<16; i++){
+		size_t bytes_to_read = BLOCK_SIZE-block_offset < bytes_left ? BLOCK_SIZE-block_offset : bytes_left;
+		int c=i/TFS_CLUSTER_BLOCKS;
+		if(on!=NULL && on->page[i]!=NULL){
+			// Dirty pages are newer than anything on disk
+			memcpy(buffer+bytesRead, on->page[i]+block_offset, bytes_to_read);
+		}
+		else if(cluster_compressed(inode,c)){
+			// Decompress each cluster once and copy out of it
+			if(cluster==NULL){
+				cluster=scratch_alloc(CLUSTER_SIZE);
+			}
+			if(c!=loaded && (err=load_cluster(vol,inode,c,cluster))<0){
+				break;
+			}
+			loaded=c;
+			memcpy(buffer+bytesRead, cluster+(i%TFS_CLUSTER_BLOCKS)*BLOCK_SIZE+block_offset, bytes_to_read);
+		}
+		else if(inode->direct_ptr[i]==-1){
+			memset(buffer+bytesRead, 0, bytes_to_read);
+		}
+		else{
+			bio_read(vol->sb->d_start_blk+ inode->direct_ptr[i], currentBlock);
+			memcpy(buffer+bytesRead, currentBlock+block_offset , bytes_to_read);
+		}
+		bytes_left -= bytes_to_read;
+		bytesRead += bytes_to_read;
+		block_offset = 0;
+	}
+	slab_free(SLAB_BLOCK,currentBlock);
+	slab_free(SLAB_INODE,inode);
+
+	ro_end(vol);
+	return err<0 && bytesRead==0 ? err : (int)bytesRead;
+}
+
+/*
+ * Write size bytes from buffer at offset into file ino, allocating data
+ * blocks as needed, or into its page cache when the volume delays
+ * allocation and the file is open.
+ *
+ * Appends to an open file go through the page cache either way: full
+ * blocks are written back straight away, but a partial tail block stays
+ * cached until it fills up or the file is synced or closed, so a run of
+ * small appends costs a memcpy each instead of a read, a write and an
+ * inode write.
+ * Returns the number of bytes written or a negative errno.
+ */
+int tfs_vol_write(struct tfs_vol *vol, uint16_t ino, const char *buffer, size_t size, off_t offset) {
+	if(ino>=MAX_INUM){
+		return -EINVAL;
+	}
+	if(vol->sealed){
+		return -EROFS;
+	}
+	if(size==0){
+		return 0;
+	}
+	if(size+offset>16*BLOCK_SIZE){
+		return -EFBIG;
+	}
+	pthread_mutex_lock(&vol->lock);
+	// A write inside a cached page that leaves nothing to write back touches no block
+	struct tfs_onode *on=vol->onodes[ino];
+	size_t blockOffset=offset%BLOCK_SIZE;
+	if(on!=NULL && on->page[offset/BLOCK_SIZE]!=NULL &&
+			(vol->delalloc ? blockOffset+size<=BLOCK_SIZE : blockOffset+size<BLOCK_SIZE)){
+		if(on->inode.type==TFS_DIRECTORY){
+			pthread_mutex_unlock(&vol->lock);
+			return -EISDIR;
+		}
+		memcpy(on->page[offset/BLOCK_SIZE]+blockOffset,buffer,size);
+		if(offset+(off_t)size>on->inode.size){
+			on->inode.size=offset+size;
+		}
+		time(&on->inode.vstat.st_mtime);
+		pthread_mutex_unlock(&vol->lock);
+		return size;
+	}
+	start(vol);
+	struct inode* inode=slab_alloc(SLAB_INODE);
+	readi(vol,ino,inode);
+	if(inode->type==TFS_DIRECTORY){
+		slab_free(SLAB_INODE,inode);
+		end(vol);
+		pthread_mutex_unlock(&vol->lock);
+		return -EISDIR;
+	}
+	if(on!=NULL && (vol->delalloc || offset==inode->size)){
+		int ret=cache_write(vol,on,buffer,size,offset);
+		if(!vol->delalloc && ret>0){
+			writeback(vol,on,(offset+ret)/BLOCK_SIZE);
+		}
+		while(vol->dirty>TFS_DIRTY_MAX){
+			writeback_largest(vol);
+		}
+		slab_free(SLAB_INODE,inode);
+		end(vol);
+		pthread_mutex_unlock(&vol->lock);
+		return ret;
+	}
+	// Anything else goes to disk, so a cached tail has to get there first
+	if(on!=NULL && on->ndirty>0){
+		writeback(vol,on,16);
+		readi(vol,ino,inode);
+	}
+	if(vol->compress || range_compressed(inode,offset,size)){
+		int ret=write_clusters(vol,inode,buffer,size,offset);
+		slab_free(SLAB_INODE,inode);
+		end(vol);
+		pthread_mutex_unlock(&vol->lock);
+		return ret;
+	}
+	// Patch each block the range touches and store it whole
+	char* currentBlock=slab_alloc(SLAB_BLOCK);
+	size_t done=0;
+	int ret=0;
+	for(int i=offset/BLOCK_SIZE; done<size; i++){
+		blockOffset=(offset+done)%BLOCK_SIZE;
+		size_t toWrite=BLOCK_SIZE-blockOffset<size-done ? BLOCK_SIZE-blockOffset : size-done;
+		if(toWrite<BLOCK_SIZE){
+			if(inode->direct_ptr[i]>=0){
+				bio_read(vol->sb->d_start_blk+inode->direct_ptr[i],currentBlock);
+			}
+			else{
+				memset(currentBlock,0,BLOCK_SIZE);
+			}
+		}
+		memcpy(currentBlock+blockOffset,buffer+done,toWrite);
+		if((ret=store_block(vol,inode,i,currentBlock))<0){
+			break;
+		}
+		done+=toWrite;
+	}
+	if(offset+(off_t)done>inode->size){
+		inode->size=offset+done;
+	}
+	if(done>0){
+		time(&inode->vstat.st_mtime);
+	}
+	writei(vol,inode->ino,inode);
+	slab_free(SLAB_BLOCK,currentBlock);
+	slab_free(SLAB_INODE,inode);
+
+	end(vol);
+	pthread_mutex_unlock(&vol->lock);
+	return done>0 ? (int)done : ret;
+}
+
+/*
+ * Set the size of file ino. Blocks wholly past the new end are released,
+ * dropping only this file's reference to shared ones, and the tail of
+ * the last block is zeroed so a later extension reads zeros.
+ * Returns 0 or a negative errno.
+ */
+int tfs_vol_truncate(struct tfs_vol *vol, uint16_t ino, off_t size) {
+	if(ino>=MAX_INUM){
+		return -EINVAL;
+	}
+	if(vol->sealed){
+		return -EROFS;
+	}
+	if(size<0){
+		return -EINVAL;
+	}
+	if(size>16*BLOCK_SIZE){
+		return -EFBIG;
+	}
+	pthread_mutex_lock(&vol->lock);
+	start(vol);
+	struct inode inode;
+	int ret=0;
+	readi(vol,ino,&inode);
+	if(inode.type==TFS_DIRECTORY){
+		end(vol);
+		pthread_mutex_unlock(&vol->lock);
+		return -EISDIR;
+	}
+	// Cached pages past the new end go, and the one it falls in is cut short
+	struct tfs_onode *on=vol->onodes[ino];
+	if(on!=NULL && on->ndirty>0 && size<inode.size){
+		int last=size/BLOCK_SIZE;
+		drop_pages(vol,on,(size+BLOCK_SIZE-1)/BLOCK_SIZE,16);
+		if(size%BLOCK_SIZE && on->page[last]!=NULL){
+			memset(on->page[last]+size%BLOCK_SIZE,0,BLOCK_SIZE-size%BLOCK_SIZE);
+		}
+	}
+	// Blocks freed here are no longer a pending balloc's to give back
+	if(on!=NULL){
+		on->fresh&=(1u<<((size+BLOCK_SIZE-1)/BLOCK_SIZE))-1;
+	}
+	char* buf=scratch_alloc(CLUSTER_SIZE);
+	for(int c=size/CLUSTER_SIZE; size<inode.size && c<16/TFS_CLUSTER_BLOCKS; c++){
+		off_t cstart=(off_t)c*CLUSTER_SIZE;
+		if(cluster_compressed(&inode,c) && cstart<size){
+			// A compressed cluster the new end falls inside is stored again
+			if((ret=load_cluster(vol,&inode,c,buf))<0){
+				break;
+			}
+			memset(buf+(size-cstart),0,CLUSTER_SIZE-(size-cstart));
+			if((ret=store_cluster(vol,&inode,c,buf,size))<0){
+				break;
+			}
+			continue;
+		}
+		for(int j=0;j<TFS_CLUSTER_BLOCKS;j++){
+			int i=c*TFS_CLUSTER_BLOCKS+j;
+			off_t bstart=(off_t)i*BLOCK_SIZE;
+			if(bstart>=size){
+				if(inode.direct_ptr[i]>=0){
+					put_blkno(vol,inode.direct_ptr[i]);
+				}
+				inode.direct_ptr[i]=-1;
+			}
+			else if(bstart+BLOCK_SIZE>size && inode.direct_ptr[i]>=0){
+				bio_read(vol->sb->d_start_blk+inode.direct_ptr[i],buf);
+				memset(buf+(size-bstart),0,BLOCK_SIZE-(size-bstart));
+				if((ret=store_block(vol,&inode,i,buf))<0){
+					break;
+				}
+			}
+		}
+		if(ret<0){
+			break;
+		}
+	}
+	if(ret==0){
+		inode.size=size;
+		time(&inode.vstat.st_mtime);
+	}
+	writei(vol,ino,&inode);
+	end(vol);
+	pthread_mutex_unlock(&vol->lock);
+	return ret;
+}
+
+/*
+ * Zero [from, to) of file inode, which lies within one cluster: freeing
+ * whole raw blocks, patching partial ones, and storing a compressed
+ * cluster again. Returns 0 or a negative errno.
+ */
+static int punch_range(struct tfs_vol *vol, struct inode *inode, off_t from, off_t to, char *buf){
+	int c=from/CLUSTER_SIZE, ret=0;
+	off_t cstart=(off_t)c*CLUSTER_SIZE;
+	if(cluster_compressed(inode,c)){
+		if((ret=load_cluster(vol,inode,c,buf))<0){
+			return ret;
+		}
+		memset(buf+(from-cstart),0,to-from);
+		return store_cluster(vol,inode,c,buf,inode->size);
+	}
+	for(int i=from/BLOCK_SIZE; (off_t)i*BLOCK_SIZE<to; i++){
+		off_t bstart=(off_t)i*BLOCK_SIZE;
+		off_t lo = from>bstart ? from : bstart, hi = to<bstart+BLOCK_SIZE ? to : bstart+BLOCK_SIZE;
+		if(inode->direct_ptr[i]<0){
+			continue;
+		}
+		if(lo==bstart && hi==bstart+BLOCK_SIZE){
+			put_blkno(vol,inode->direct_ptr[i]);
+			inode->direct_ptr[i]=-1;
+			continue;
+		}
+		bio_read(vol->sb->d_start_blk+inode->direct_ptr[i],buf);
+		memset(buf+(lo-bstart),0,hi-lo);
+		if((ret=store_block(vol,inode,i,buf))<0){
+			return ret;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Preallocate or punch out [offset, offset+len) of file ino, as
+ * fallocate(2) does. Mode 0 gives every hole in the range a zeroed
+ * block, taking the longest free runs so the range ends up contiguous,
+ * and extends the file over it; FALLOC_FL_KEEP_SIZE leaves the size
+ * alone. FALLOC_FL_PUNCH_HOLE (with KEEP_SIZE) frees the blocks wholly
+ * inside the range and zeros the rest of it. Later writes into
+ * preallocated blocks write them in place.
+ * Returns 0 or a negative errno.
+ */
+int tfs_vol_fallocate(struct tfs_vol *vol, uint16_t ino, int mode, off_t offset, off_t len) {
+	if(vol->sealed){
+		return -EROFS;
+	}
+	if(ino>=MAX_INUM || offset<0 || len<=0){
+		return -EINVAL;
+	}
+	if(mode & ~(FALLOC_FL_KEEP_SIZE|FALLOC_FL_PUNCH_HOLE)){
+		return -EOPNOTSUPP;
+	}
+	if((mode & FALLOC_FL_PUNCH_HOLE) && !(mode & FALLOC_FL_KEEP_SIZE)){
+		return -EOPNOTSUPP;
+	}
+	if(!(mode & FALLOC_FL_PUNCH_HOLE) && offset+len>16*BLOCK_SIZE){
+		return -EFBIG;
+	}
+	if(offset>=16*BLOCK_SIZE){
+		return 0;
+	}
+	off_t last = offset+len<16*BLOCK_SIZE ? offset+len : 16*BLOCK_SIZE;
+	struct inode inode;
+	int ret=0;
+	pthread_mutex_lock(&vol->lock);
+	start(vol);
+	// Work on what is on disk: write back cached pages first
+	if(vol->onodes[ino]!=NULL && vol->onodes[ino]->ndirty>0){
+		writeback(vol,vol->onodes[ino],16);
+	}
+	readi(vol,ino,&inode);
+	if(!inode.valid){
+		ret=-ENOENT;
+	}
+	else if(inode.type==TFS_DIRECTORY){
+		ret=-EISDIR;
+	}
+	else if(mode & FALLOC_FL_PUNCH_HOLE){
+		char* buf=scratch_alloc(CLUSTER_SIZE);
+		for(off_t from=offset; from<last && ret==0; ){
+			off_t cend=(from/CLUSTER_SIZE+1)*CLUSTER_SIZE;
+			off_t to = last<cend ? last : cend;
+			ret=punch_range(vol,&inode,from,to,buf);
+			from=to;
+		}
+		for(int i=0;i<16 && vol->onodes[ino]!=NULL;i++){
+			if(inode.direct_ptr[i]<0){
+				vol->onodes[ino]->fresh&=~(1u<<i);
+			}
+		}
+		time(&inode.vstat.st_mtime);
+		writei(vol,ino,&inode);
+	}
+	else{
+		// Holes only: compressed clusters and existing blocks are already backed
+		unsigned holes=0;
+		for(int i=offset/BLOCK_SIZE; (off_t)i*BLOCK_SIZE<last; i++){
+			if(inode.direct_ptr[i]==-1){
+				holes|=1u<<i;
+			}
+		}
+		if(fill_slots(vol,&inode,holes)<0){
+			ret=-ENOSPC;
+		}
+		zero_slots(vol,&inode,holes);
+		if(ret==0 && !(mode & FALLOC_FL_KEEP_SIZE) && last>inode.size){
+			inode.size=last;
+			time(&inode.vstat.st_mtime);
+		}
+		writei(vol,ino,&inode);
+	}
+	end(vol);
+	pthread_mutex_unlock(&vol->lock);
+	return ret;
+}
+
+/*
+ * Map logical blocks [first, first+count) of file ino to device block
+ * numbers, -1 for holes and TFS_ZSLOT inside compressed clusters and
+ * for pages still in the page cache.
+ * Returns count or a negative errno.
+ */
+int tfs_vol_bmap(struct tfs_vol *vol, uint16_t ino, int first, int count, int *blocks) {
+	if(ino>=MAX_INUM){
+		return -EINVAL;
+	}
+	struct inode inode;
+	ro_begin(vol);
+	readi(vol, ino, &inode);
+	struct tfs_onode *on=vol->onodes[ino];
+	for(int i=0; i<count; i++){
+		int l=first+i;
+		if(l<16 && on!=NULL && on->page[l]!=NULL){
+			blocks[i]=TFS_ZSLOT;
+		}
+		else if(l>=16 || inode.direct_ptr[l]==-1){
+			blocks[i]=-1;
+		}
+		else if(cluster_compressed(&inode,l/TFS_CLUSTER_BLOCKS)){
+			blocks[i]=TFS_ZSLOT;
+		}
+		else{
+			blocks[i]=vol->sb->d_start_blk+inode.direct_ptr[l];
+		}
+	}
+	ro_end(vol);
+	return count;
+}
+
+/*
+ * Allocate any missing blocks backing [offset, offset+size) of open file
+ * ino and return the device block numbers in blocks. The caller writes
+ * the data itself, which is how the FUSE adapters splice writes straight
+ * into the disk image, then calls tfs_vol_bdone. New blocks are zeroed
+ * before they go into the block map and the size is left alone until
+ * then, so nothing freed earlier shows through a write that fails.
+ * Returns the number of blocks or a negative errno.
+ */
+int tfs_vol_balloc(struct tfs_vol *vol, uint16_t ino, off_t offset, size_t size, int *blocks) {
+	if(ino>=MAX_INUM){
+		return -EINVAL;
+	}
+	if(vol->sealed){
+		return -EROFS;
+	}
+	if(size==0){
+		return 0;
+	}
+	if(offset+size>16*BLOCK_SIZE){
+		return -EFBIG;
+	}
+	int first=offset/BLOCK_SIZE;
+	int count=(offset+size-1)/BLOCK_SIZE-first+1;
+	struct inode inode;
+	pthread_mutex_lock(&vol->lock);
+	start(vol);
+	readi(vol, ino, &inode);
+	if(inode.type==TFS_DIRECTORY){
+		end(vol);
+		pthread_mutex_unlock(&vol->lock);
+		return -EISDIR;
+	}
+	struct tfs_onode *on=vol->onodes[ino];
+	if(on==NULL || vol->compress || vol->dedup || vol->delalloc || range_compressed(&inode,offset,size)){
+		end(vol);
+		pthread_mutex_unlock(&vol->lock);
+		return -EOPNOTSUPP;
+	}
+	// A cached append tail must not land on top of what the caller writes
+	if(on->ndirty>0){
+		writeback(vol,on,16);
+		readi(vol,ino,&inode);
+	}
+	unsigned fresh=0;
+	for(int i=0; i<count; i++){
+		int l=first+i;
+		if(inode.direct_ptr[l]==-1){
+			int blk=get_avail_blkno_near(vol,data_goal(vol,&inode,l));
+			if(blk<0){
+				// keep what was allocated so far, it is recorded below
+				count=i;
+				break;
+			}
+			inode.direct_ptr[l]=blk;
+			alloc_blkno(vol,blk);
+			fresh|=1u<<l;
+		}
+		else if(own_block(vol,&inode,l)<0){
+			count=i;
+			break;
+		}
+		blocks[i]=vol->sb->d_start_blk+inode.direct_ptr[l];
+	}
+	zero_slots(vol,&inode,fresh);
+	writei(vol, ino, &inode);
+	// Given back by tfs_vol_bdone if the caller's write does not reach them
+	if(count>0){
+		on->fresh|=fresh;
+	}
+	end(vol);
+	pthread_mutex_unlock(&vol->lock);
+	return count>0 ? count : -ENOSPC;
+}
+
+/*
+ * The caller of a tfs_vol_balloc of [offset, offset+size) on ino has
+ * written its first written bytes. Extend the file over them and free
+ * the blocks the balloc allocated that the write stopped short of.
+ */
+void tfs_vol_bdone(struct tfs_vol *vol, uint16_t ino, off_t offset, size_t size, size_t written) {
+	if(ino>=MAX_INUM){
+		return;
+	}
+	struct inode inode;
+	pthread_mutex_lock(&vol->lock);
+	start(vol);
+	struct tfs_onode *on=vol->onodes[ino];
+	readi(vol,ino,&inode);
+	if(written>0 && offset+(off_t)written>inode.size){
+		inode.size=offset+written;
+		time(&inode.vstat.st_mtime);
+	}
+	int keep=(inode.size+BLOCK_SIZE-1)/BLOCK_SIZE;
+	for(int l=offset/BLOCK_SIZE; size>0 && (off_t)l*BLOCK_SIZE<offset+(off_t)size; l++){
+		if(on==NULL || !(on->fresh&(1u<<l))){
+			continue;
+		}
+		on->fresh&=~(1u<<l);
+		if(l>=keep && inode.direct_ptr[l]>=0){
+			put_blkno(vol,inode.direct_ptr[l]);
+			inode.direct_ptr[l]=-1;
+		}
+	}
+	writei(vol,ino,&inode);
+	end(vol);
+	pthread_mutex_unlock(&vol->lock);
+}
+
+/*
+ * Create the dedup table in the first run of free data blocks long
+ * enough to hold it. Blocks already in use start with one reference.
+ */
+static int dedup_create(struct tfs_vol *vol){
+	struct tfs_dedup *dd=dedup_alloc(vol->sb->max_dnum);
+	int run=0, i;
+	for(i=0; i<vol->sb->max_dnum && run<dd->nblk; i++){
+		run = get_bitmap(vol->data_bm,i) ? 0 : run+1;
+	}
+	if(run<dd->nblk){
+		dedup_free(dd);
+		return -ENOSPC;
+	}
+	for(int b=0;b<vol->sb->max_dnum;b++){
+		dd->ents[b].refs=get_bitmap(vol->data_bm,b);
+	}
+	memset(dd->dirty,1,dd->nblk);
+	vol->dd=dd;
+	for(int b=i-dd->nblk;b<i;b++){
+		alloc_blkno(vol,b);
+	}
+	vol->sb->dedup_blk=vol->sb->d_start_blk+i-dd->nblk;
+	return 0;
+}
+
+int tfs_vol_dedup(struct tfs_vol *vol) {
+	if(vol->sealed){
+		return -EROFS;
+	}
+	int ret=0;
+	pthread_mutex_lock(&vol->lock);
+	start(vol);
+	if(vol->dd!=NULL || (ret=dedup_create(vol))==0){
+		vol->dedup=1;
+	}
+	end(vol);
+	pthread_mutex_unlock(&vol->lock);
+	return ret;
+}
+
+/*
+ * Clones
+ *
+ * A clone points at the source's data blocks, compressed clusters
+ * included, taking a reference on each; neither file writes a shared
+ * block in place, so they diverge a block at a time as either is
+ * written. Cloning costs the inode and table writes, whatever the size.
+ */
+static int clone_blocks(struct tfs_vol *vol, const struct inode *src, struct inode *dst){
+	int ret;
+	if(src->type!=TFS_FILE || dst->type!=TFS_FILE){
+		return -EISDIR;
+	}
+	if(vol->dd==NULL && (ret=dedup_create(vol))<0){
+		return ret;
+	}
+	for(int i=0;i<16;i++){
+		if(src->direct_ptr[i]>=0){
+			vol->dd->ents[src->direct_ptr[i]].refs++;
+			dedup_dirty(vol->dd,src->direct_ptr[i]);
+		}
+	}
+	for(int i=0;i<16;i++){
+		if(dst->direct_ptr[i]>=0){
+			put_blkno(vol,dst->direct_ptr[i]);
+		}
+		dst->direct_ptr[i]=src->direct_ptr[i];
+	}
+	dst->size=src->size;
+	time(&dst->vstat.st_mtime);
+	writei(vol,dst->ino,dst);
+	return 0;
+}
+
+/*
+ * Clones share what is on disk: write back the source's dirty pages
+ * first, and drop the destination's, whose contents are being replaced
+ */
+static int clone_prepare(struct tfs_vol *vol, struct inode *src, struct inode *dst){
+	int ret=0;
+	if(vol->onodes[src->ino]!=NULL && vol->onodes[src->ino]->ndirty>0){
+		ret=writeback(vol,vol->onodes[src->ino],16);
+		readi(vol,src->ino,src);
+	}
+	if(dst!=NULL && vol->onodes[dst->ino]!=NULL){
+		drop_pages(vol,vol->onodes[dst->ino],0,16);
+	}
+	return ret;
+}
+
+/* Replace the contents of file dst_ino with a clone of src_ino */
+int tfs_vol_clone(struct tfs_vol *vol, uint16_t src_ino, uint16_t dst_ino) {
+	if(vol->sealed){
+		return -EROFS;
+	}
+	struct inode src, dst;
+	int ret=0;
+	if(src_ino>=MAX_INUM || dst_ino>=MAX_INUM){
+		return -ENOENT;
+	}
+	pthread_mutex_lock(&vol->lock);
+	start(vol);
+	readi(vol,src_ino,&src);
+	readi(vol,dst_ino,&dst);
+	if(!src.valid || !dst.valid){
+		ret=-ENOENT;
+	}
+	else if(src_ino!=dst_ino && (ret=clone_prepare(vol,&src,&dst))==0){
+		ret=clone_blocks(vol,&src,&dst);
+	}
+	end(vol);
+	pthread_mutex_unlock(&vol->lock);
+	return ret;
+}
+
+/* Create name in directory dir_ino as a clone of src_ino */
+int tfs_vol_cloneat(struct tfs_vol *vol, uint16_t src_ino, uint16_t dir_ino, const char *name, uint16_t *ino) {
+	if(vol->sealed){
+		return -EROFS;
+	}
+	struct inode src, parent, dst;
+	uint16_t new_ino;
+	if(src_ino>=MAX_INUM){
+		return -ENOENT;
+	}
+	pthread_mutex_lock(&vol->lock);
+	start(vol);
+	readi(vol,src_ino,&src);
+	readi(vol,dir_ino,&parent);
+	int ret = !src.valid ? -ENOENT : src.type!=TFS_FILE ? -EISDIR : 0;
+	if(ret==0){
+		ret=clone_prepare(vol,&src,NULL);
+	}
+	if(ret==0 && vol->dd==NULL){
+		ret=dedup_create(vol);
+	}
+	if(ret==0){
+		ret=make_node(vol,&parent,name,TFS_FILE,src.vstat.st_mode,1,&new_ino);
+	}
+	if(ret==0){
+		readi(vol,new_ino,&dst);
+		clone_blocks(vol,&src,&dst);
+		if(ino){
+			*ino=new_ino;
+		}
+	}
+	end(vol);
+	pthread_mutex_unlock(&vol->lock);
+	return ret;
+}
+
+/*
+ * Defragmentation
+ *
+ * A fragmented file is moved whole into a free run of its size, looked
+ * for from the start of its inode's group: its blocks are read a run at
+ * a time, written to the new run with one bio_writev, the new map goes
+ * out with writei (which also updates an open file's cached inode), and
+ * only then are the old blocks freed, all in one operation under the
+ * volume lock. A pass moves one file per operation, so other operations
+ * get in between.
+ *
+ * Files with blocks shared by dedup or clones are left alone, as are
+ * orphans and open files: the FUSE adapters map an open file's blocks
+ * with tfs_vol_bmap and tfs_vol_balloc and move its data after the
+ * volume lock is let go, so its blocks stay put until the last close.
+ */
+
+/* Runs the data blocks of inode form, in file order, and how many blocks in *blocks */
+static int count_runs(const struct inode *inode, int *blocks){
+	int runs=0, n=0, prev=-2;
+	for(int i=0;i<16;i++){
+		int b=inode->direct_ptr[i];
+		if(b<0){
+			continue;
+		}
+		if(b!=prev+1){
+			runs++;
+		}
+		prev=b;
+		n++;
+	}
+	*blocks=n;
+	return runs;
+}
+
+static int by_runs(const void *a, const void *b){
+	const struct tfs_frag *x=a, *y=b;
+	return x->runs!=y->runs ? y->runs-x->runs : y->blocks-x->blocks;
+}
+
+/* Fill frags with every file's runs, most fragmented first, from the inode table */
+static int frag_scan(struct tfs_vol *vol, struct tfs_frag *frags){
+	struct inode* block=slab_alloc(SLAB_BLOCK);
+	int n=0;
+	for(int b=0;b*INODES_PER_BLOCK<vol->sb->max_inum;b++){
+		bio_read(vol->sb->i_start_blk+b,block);
+		for(int j=0;j<INODES_PER_BLOCK && b*INODES_PER_BLOCK+j<vol->sb->max_inum;j++){
+			if(!block[j].valid || block[j].type!=TFS_FILE || !get_bitmap(vol->inode_bm,b*INODES_PER_BLOCK+j)){
+				continue;
+			}
+			frags[n].ino=b*INODES_PER_BLOCK+j;
+			frags[n].runs=count_runs(&block[j],&frags[n].blocks);
+			n++;
+		}
+	}
+	slab_free(SLAB_BLOCK,block);
+	qsort(frags,n,sizeof(struct tfs_frag),by_runs);
+	return n;
+}
+
+static int is_orphan(struct tfs_vol *vol, uint16_t ino){
+	for(int k=0;k<vol->sb->norphans;k++){
+		if(vol->sb->orphans[k]==ino){
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Move file ino into a single free run, if it is in more than one and
+ * a run that long is free. Returns 1 if it was moved, else 0.
+ */
+static int defrag_file(struct tfs_vol *vol, uint16_t ino){
+	struct inode inode;
+	void* bufs[16];
+	int old[16], n, got;
+
+	if(!get_bitmap(vol->inode_bm,ino) || is_orphan(vol,ino) || vol->onodes[ino]!=NULL){
+		return 0;
+	}
+	readi(vol,ino,&inode);
+	if(!inode.valid || inode.type!=TFS_FILE || count_runs(&inode,&n)<2){
+		return 0;
+	}
+	for(int i=0;i<16;i++){
+		if(inode.direct_ptr[i]>=0 && shared_blkno(vol,inode.direct_ptr[i])){
+			return 0;
+		}
+	}
+	int g=group_of(vol->sb->max_inum,vol->sb->groups,ino);
+	int blk=find_run(vol,group_start(vol->sb->max_dnum,vol->sb->groups,g),n,&got);
+	if(blk<0 || got<n){
+		return 0;
+	}
+
+	// Step 1: Copy the data, one read per old run and one write for the new one
+	char* data=scratch_alloc(n*BLOCK_SIZE);
+	for(int i=0, k=0;i<16;i++){
+		if(inode.direct_ptr[i]>=0){
+			old[k]=inode.direct_ptr[i];
+			bufs[k]=data+k*BLOCK_SIZE;
+			k++;
+		}
+	}
+	for(int j=0;j<n; ){
+		int k=j+1;
+		while(k<n && old[k]==old[k-1]+1){
+			k++;
+		}
+		bio_readv(vol->sb->d_start_blk+old[j],&bufs[j],k-j);
+		j=k;
+	}
+	if(bio_writev(vol->sb->d_start_blk+blk,bufs,n)!=n*BLOCK_SIZE){
+		return 0;
+	}
+
+	// Step 2: Point the file at its new blocks
+	for(int k=0;k<n;k++){
+		alloc_blkno(vol,blk+k);
+	}
+	for(int i=0, k=0;i<16;i++){
+		if(inode.direct_ptr[i]>=0){
+			inode.direct_ptr[i]=blk+k++;
+		}
+	}
+	writei(vol,ino,&inode);
+
+	// Step 3: Free the old blocks; content they had indexed moves to the new ones
+	for(int k=0;k<n;k++){
+		uint64_t h = vol->dd ? vol->dd->ents[old[k]].hash : 0;
+		free_blkno(vol,old[k]);
+		if(h!=0 && dedup_lookup(vol->dd,h)<0){
+			dedup_insert(vol->dd,blk+k,h);
+		}
+	}
+	return 1;
+}
+
+int tfs_vol_frag(struct tfs_vol *vol, struct tfs_frag *frags) {
+	ro_begin(vol);
+	int n=frag_scan(vol,frags);
+	ro_end(vol);
+	return n;
+}
+
+int tfs_vol_defrag(struct tfs_vol *vol, int max) {
+	if(vol->sealed){
+		return -EROFS;
+	}
+	struct tfs_frag *frags=malloc(MAX_INUM*sizeof(struct tfs_frag));
+	int moved=0;
+	pthread_mutex_lock(&vol->lock);
+	start(vol);
+	int n=frag_scan(vol,frags);
+	end(vol);
+	pthread_mutex_unlock(&vol->lock);
+
+	for(int k=0;k<n && frags[k].runs>1 && (max<=0 || moved<max);k++){
+		pthread_mutex_lock(&vol->lock);
+		start(vol);
+		moved+=defrag_file(vol,frags[k].ino);
+		end(vol);
+		pthread_mutex_unlock(&vol->lock);
+		sched_yield();
+	}
+	free(frags);
+	return moved;
+}
+
+/* Defragmenter thread: a pass every defrag_secs seconds while defrag_secs is set */
+static void *defragger(void *arg){
+	struct tfs_vol *vol=arg;
+	pthread_mutex_lock(&vol->lock);
+	while(vol->defrag_secs>0){
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME,&ts);
+		ts.tv_sec+=vol->defrag_secs;
+		if(pthread_cond_timedwait(&vol->defrag_cv,&vol->lock,&ts)==ETIMEDOUT && vol->defrag_secs>0){
+			pthread_mutex_unlock(&vol->lock);
+			tfs_vol_defrag(vol,0);
+			pthread_mutex_lock(&vol->lock);
+		}
+	}
+	pthread_mutex_unlock(&vol->lock);
+	return NULL;
+}
+
+int tfs_vol_autodefrag(struct tfs_vol *vol, int secs) {
+	if(vol->sealed){
+		return -EROFS;
+	}
+	int ret=0;
+	if(secs<=0){
+		return -EINVAL;
+	}
+	pthread_mutex_lock(&vol->lock);
+	int running=vol->defrag_secs>0;
+	vol->defrag_secs=secs;
+	if(!running && (ret=-pthread_create(&vol->defragger,NULL,defragger,vol))<0){
+		vol->defrag_secs=0;
+	}
+	pthread_mutex_unlock(&vol->lock);
+	return ret;
+}
+
+/*
+ * Open file ino and return a handle in *fp. The first open of an inode
+ * puts it in the open-file table; later opens share that entry.
+ * Returns 0 or a negative errno.
+ */
+int tfs_file_open(struct tfs_vol *vol, uint16_t ino, struct tfs_file **fp) {
+	struct inode inode;
+	if(ino>=MAX_INUM){
+		return -ENOENT;
+	}
+	// Sealed files have no open-file table entry: their inodes are in memory already
+	if(vol->sealed!=NULL){
+		readi(vol,ino,&inode);
+		if(!inode.valid){
+			return -ENOENT;
+		}
+		*fp=calloc(1, sizeof(struct tfs_file));
+		(*fp)->ino=ino;
+		return 0;
+	}
+	pthread_mutex_lock(&vol->lock);
+	start(vol);
+	readi(vol,ino,&inode);
+	if(!inode.valid){
+		end(vol);
+		pthread_mutex_unlock(&vol->lock);
+		return -ENOENT;
+	}
+	if(vol->onodes[ino]==NULL){
+		vol->onodes[ino]=calloc(1, sizeof(struct tfs_onode));
+		vol->onodes[ino]->inode=inode;
+	}
+	vol->onodes[ino]->refs++;
+	end(vol);
+	pthread_mutex_unlock(&vol->lock);
+
+	struct tfs_file *f=calloc(1, sizeof(struct tfs_file));
+	f->ino=ino;
+	*fp=f;
+	return 0;
+}
+
+/*
+ * Close a handle, dropping the inode from the table on its last close,
+ * after writing back its dirty pages
+ */
+void tfs_file_close(struct tfs_vol *vol, struct tfs_file *f) {
+	if(vol->sealed!=NULL){
+		free(f);
+		return;
+	}
+	pthread_mutex_lock(&vol->lock);
+	struct tfs_onode *on=vol->onodes[f->ino];
+	if(on!=NULL && --on->refs==0){
+		if(on->unlinked){
+			// Nothing can reach the file any more: drop its pages and let the reclaimer free it
+			drop_pages(vol,on,0,16);
+			reclaim_wake(vol);
+		}else if(on->ndirty>0){
+			start(vol);
+			writeback(vol,on,16);
+			end(vol);
+		}
+		free(on);
+		vol->onodes[f->ino]=NULL;
+	}
+	pthread_mutex_unlock(&vol->lock);
+	free(f);
+}
+
+/* Record an access at [offset, offset+size) in the handle's sequential state */
+void tfs_file_note(struct tfs_file *f, off_t offset, size_t size) {
+	f->seq = offset==f->next ? f->seq+1 : 0;
+	f->next = offset+size;
+}
+
+int tfs_file_read(struct tfs_vol *vol, struct tfs_file *f, char *buffer, size_t size, off_t offset) {
+	int ret=tfs_vol_read(vol,f->ino,buffer,size,offset);
+	if(ret>0){
+		tfs_file_note(f,offset,ret);
+	}
+	return ret;
+}
+
+int tfs_file_write(struct tfs_vol *vol, struct tfs_file *f, const char *buffer, size_t size, off_t offset) {
+	int ret=tfs_vol_write(vol,f->ino,buffer,size,offset);
+	if(ret>0){
+		tfs_file_note(f,offset,ret);
+	}
+	return ret;
+}
+
+/* Write back the dirty pages of an open file, what fsync asks for */
+int tfs_file_sync(struct tfs_vol *vol, struct tfs_file *f) {
+	int ret=0;
+	if(vol->sealed!=NULL){
+		return 0;
+	}
+	pthread_mutex_lock(&vol->lock);
+	struct tfs_onode *on=vol->onodes[f->ino];
+	if(on!=NULL && on->ndirty>0){
+		start(vol);
+		ret=writeback(vol,on,16);
+		end(vol);
+	}
+	pthread_mutex_unlock(&vol->lock);
+	return ret;
+}
@@ -0,0 +1,261 @@
+/*
+ *	Tiny File System
+ *	File:	libtfs.h
+ *
+ *	Embeddable TFS core. Everything the FUSE daemon does is reachable
+ *	through this API on a volume handle, so tools and benchmarks can link
+ *	TFS in-process without a mount.
+ *
+ *	The tfs_vol_* calls take the volume lock themselves and return 0 (or
+ *	a byte count) on success and a negative errno on failure. The lower
+ *	level helpers (readi, dir_find, ...) expect the caller to hold the
+ *	lock and keep the return conventions documented next to them.
+ */
+
+#ifndef _LIBTFS_H
+#define _LIBTFS_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+
+#include "block.h"
+#include "tfs.h"
+
+/* Delayed allocation: write back once this many pages are dirty, or pages this old (s) */
+#define TFS_DIRTY_MAX	2048
+#define TFS_DIRTY_AGE	5
+
+/* Orphans the reclaimer frees per pass under the volume lock */
+#define TFS_RECLAIM_BATCH	32
+
+/* Open-file table entry: one per open inode, shared by its handles */
+struct tfs_onode {
+	unsigned			refs;		/* open handles on this inode */
+	struct inode		inode;		/* cached inode (and block map), kept current by writei */
+	char				*page[16];	/* dirty blocks not yet written back, NULL if clean */
+	int					ndirty;		/* pages in page[] */
+	int					reserved;	/* data blocks reserved for them */
+	time_t				dirtied;	/* when the oldest dirty page was written */
+	int					unlinked;	/* on the orphan list, freed after the last close */
+	unsigned			fresh;		/* blocks tfs_vol_balloc allocated, not yet written, bit i for direct_ptr[i] */
+};
+
+struct tfs_dedup;
+struct tfs_sealed;
+
+struct tfs_vol {
+	struct superblock	*sb;		/* in-memory superblock (one block) */
+	bitmap_t			inode_bm;	/* in-memory inode bitmap (one block) */
+	bitmap_t			data_bm;	/* in-memory data bitmap (one block) */
+	struct tfs_onode	**onodes;	/* open-file table, indexed by ino */
+	int					compress;	/* compress file data as it is written */
+	struct tfs_dedup	*dd;		/* dedup table, NULL if the volume has none */
+	struct tfs_sealed	*sealed;	/* read-only indexes, NULL unless mounted sealed */
+	int					dedup;		/* share blocks with identical content on write */
+	int					delalloc;	/* hold writes to open files until writeback */
+	int					dirty;		/* dirty pages held across all open files */
+	int					reserved;	/* data blocks promised to dirty pages */
+	int					flushing;	/* the flusher thread is running */
+	pthread_t			flusher;	/* writes back aged dirty pages */
+	pthread_cond_t		flush_cv;	/* wakes the flusher to stop */
+	int					snap_secs;	/* seconds between snapshots, 0 for none */
+	pthread_t			snapper;	/* takes them on a RAM disk */
+	pthread_cond_t		snap_cv;	/* wakes the snapper to stop */
+	pthread_mutex_t		snap_lock;	/* one snapshot at a time */
+	int					reclaiming;	/* the reclaimer thread is running */
+	pthread_t			reclaimer;	/* frees the blocks of orphans */
+	pthread_cond_t		reclaim_cv;	/* wakes it for new orphans, or to stop */
+	int					defrag_secs;	/* seconds between defrag passes, 0 for none */
+	pthread_t			defragger;	/* runs them */
+	pthread_cond_t		defrag_cv;	/* wakes the defragger to stop */
+	pthread_mutex_t		lock;		/* serializes all operations */
+};
+
+/* An open file handle, what the FUSE adapters keep in fi->fh */
+struct tfs_file {
+	uint16_t			ino;
+	off_t				next;		/* offset just past the last read or write */
+	unsigned			seq;		/* consecutive requests that started at next */
+};
+
+/* How fragmented one file is, see tfs_vol_frag */
+struct tfs_frag {
+	uint16_t			ino;
+	int					blocks;		/* data blocks the file holds */
+	int					runs;		/* physically consecutive stretches they form */
+};
+
+/* rename flags, the Linux renameat2() values */
+#ifndef RENAME_NOREPLACE
+#define RENAME_NOREPLACE	(1 << 0)	/* fail if the target exists */
+#endif
+
+/* fallocate modes, the Linux values */
+#ifndef FALLOC_FL_KEEP_SIZE
+#define FALLOC_FL_KEEP_SIZE		0x01	/* do not extend the file */
+#endif
+#ifndef FALLOC_FL_PUNCH_HOLE
+#define FALLOC_FL_PUNCH_HOLE	0x02	/* free the range (with KEEP_SIZE) */
+#endif
+
+/* Called once per directory entry; return non-zero to stop early */
+typedef int (*tfs_filldir_t)(void *ctx, const char *name, uint16_t ino);
+
+/*
+ * Volume management
+ */
+int tfs_mkfs(const char *diskfile_path);
+struct tfs_vol *tfs_mount(const char *diskfile_path);
+void tfs_unmount(struct tfs_vol *vol);
+
+/*
+ * Sealed volumes: the image is opened read-only and mapped, and the
+ * inode table and an index of every directory are built at mount. The
+ * lookups, readdir, open and read then take no lock and write nothing
+ * back, so any number of threads run them at once; everything that
+ * would change the volume fails with -EROFS.
+ */
+struct tfs_vol *tfs_mount_sealed(const char *diskfile_path);
+
+/*
+ * Allocation, inode and directory helpers (caller holds vol->lock)
+ */
+int get_avail_ino(struct tfs_vol *vol);
+int get_avail_ino_for(struct tfs_vol *vol, uint16_t parent, int dir);
+int get_avail_blkno(struct tfs_vol *vol);
+int get_avail_blkno_near(struct tfs_vol *vol, int goal);
+void tfs_group_counts(const struct superblock *sb, bitmap_t inode_bm, bitmap_t data_bm, struct group_desc *gd);
+void alloc_ino(struct tfs_vol *vol, int ino);
+void free_ino(struct tfs_vol *vol, int ino);
+void alloc_blkno(struct tfs_vol *vol, int blkno);
+void free_blkno(struct tfs_vol *vol, int blkno);
+void put_blkno(struct tfs_vol *vol, int blkno);
+int readi(struct tfs_vol *vol, uint16_t ino, struct inode *inode);
+int writei(struct tfs_vol *vol, uint16_t ino, struct inode *inode);
+int dir_find(struct tfs_vol *vol, uint16_t ino, const char *fname, size_t name_len, struct dirent *dirent);
+int dir_add(struct tfs_vol *vol, struct inode dir_inode, uint16_t f_ino, const char *fname, size_t name_len);
+int dir_remove(struct tfs_vol *vol, struct inode dir_inode, const char *fname, size_t name_len);
+int get_node_by_path(struct tfs_vol *vol, const char *path, uint16_t ino, struct inode *inode);
+
+/*
+ * File system operations, by path or by (directory inode, name)
+ */
+void tfs_inode_stat(const struct inode *inode, struct stat *stbuf);
+void tfs_vol_statfs(struct tfs_vol *vol, struct statvfs *stbuf);
+int tfs_vol_lookup(struct tfs_vol *vol, const char *path, struct inode *inode);
+int tfs_vol_readdir(struct tfs_vol *vol, uint16_t ino, tfs_filldir_t filler, void *ctx);
+int tfs_vol_mkdir(struct tfs_vol *vol, const char *path, mode_t mode);
+int tfs_vol_rmdir(struct tfs_vol *vol, const char *path);
+int tfs_vol_create(struct tfs_vol *vol, const char *path, mode_t mode, uint16_t *ino);
+int tfs_vol_unlink(struct tfs_vol *vol, const char *path);
+int tfs_vol_getinode(struct tfs_vol *vol, uint16_t ino, struct inode *inode);
+int tfs_vol_lookupat(struct tfs_vol *vol, uint16_t dir_ino, const char *name, struct inode *inode);
+int tfs_vol_mkdirat(struct tfs_vol *vol, uint16_t dir_ino, const char *name, mode_t mode, uint16_t *ino);
+int tfs_vol_createat(struct tfs_vol *vol, uint16_t dir_ino, const char *name, mode_t mode, uint16_t *ino);
+int tfs_vol_rmdirat(struct tfs_vol *vol, uint16_t dir_ino, const char *name);
+int tfs_vol_unlinkat(struct tfs_vol *vol, uint16_t dir_ino, const char *name);
+int tfs_vol_rename(struct tfs_vol *vol, const char *from, const char *to, unsigned int flags);
+int tfs_vol_renameat(struct tfs_vol *vol, uint16_t olddir_ino, const char *oldname, uint16_t newdir_ino, const char *newname, unsigned int flags);
+int tfs_vol_read(struct tfs_vol *vol, uint16_t ino, char *buffer, size_t size, off_t offset);
+int tfs_vol_write(struct tfs_vol *vol, uint16_t ino, const char *buffer, size_t size, off_t offset);
+int tfs_vol_truncate(struct tfs_vol *vol, uint16_t ino, off_t size);
+int tfs_vol_fallocate(struct tfs_vol *vol, uint16_t ino, int mode, off_t offset, off_t len);
+
+/*
+ * Deduplicate file data written from now on, creating the volume's dedup
+ * table the first time. Once a volume has the table, block references
+ * are counted on every mount, with or without dedup.
+ */
+int tfs_vol_dedup(struct tfs_vol *vol);
+
+/*
+ * Delayed allocation: from now on, writes to open files are held in
+ * memory and reserve their blocks, which are allocated and written when
+ * the file is written back. That happens on its last close, on
+ * tfs_file_sync, when the volume holds TFS_DIRTY_MAX dirty pages, and
+ * from a flusher thread once they are TFS_DIRTY_AGE seconds old.
+ * tfs_vol_sync writes back every open file; unmount does so too.
+ */
+int tfs_vol_delalloc(struct tfs_vol *vol);
+int tfs_vol_sync(struct tfs_vol *vol);
+
+/*
+ * RAM-resident volumes: with dev_ram(1) before tfs_mount, the image is
+ * loaded into memory and only written back by snapshots. A snapshot
+ * holds every operation that completed before it (dirty pages of
+ * delayed allocation excepted) and does not stop later ones while it
+ * is written. tfs_vol_snapshot takes one now, tfs_vol_autosnap every
+ * secs seconds, and unmount takes a last one. Both are no-ops on a
+ * disk that is not in RAM.
+ */
+int tfs_vol_snapshot(struct tfs_vol *vol);
+int tfs_vol_autosnap(struct tfs_vol *vol, int secs);
+
+/*
+ * Deferred deletion: unlink, rmdir and a rename that replaces its target
+ * only remove the entry and put the inode on the orphan list (see
+ * tfs.h); a reclaimer thread frees orphans TFS_RECLAIM_BATCH at a time,
+ * writing the bitmaps and each inode block once per batch. Open files
+ * stay readable until their last close. Orphans left at unmount are
+ * reclaimed after the next mount, and an allocation that finds the disk
+ * full reclaims them on the spot. tfs_vol_reclaim frees every orphan
+ * that is not open now and returns how many it freed.
+ */
+int tfs_vol_reclaim(struct tfs_vol *vol);
+
+/*
+ * Copy-on-write clones: the clone shares the source's data blocks, and
+ * a shared block is copied on its first write from either file.
+ * tfs_vol_clone replaces the contents of an existing file (what a
+ * reflink copy does); tfs_vol_cloneat creates a new file.
+ */
+int tfs_vol_clone(struct tfs_vol *vol, uint16_t src_ino, uint16_t dst_ino);
+int tfs_vol_cloneat(struct tfs_vol *vol, uint16_t src_ino, uint16_t dir_ino, const char *name, uint16_t *ino);
+
+/*
+ * Defragmentation: a file's runs are the stretches of physically
+ * consecutive blocks its block map is made of, holes skipped.
+ * tfs_vol_frag fills frags (room for MAX_INUM) with every file's runs,
+ * most fragmented first, and returns how many files there are.
+ * tfs_vol_defrag moves the most fragmented files, up to max of them (0
+ * for no limit), each into a single free run, and returns how many it
+ * moved. It runs on a mounted volume a file at a time, passing over open
+ * files; tfs_vol_autodefrag makes a pass every secs seconds.
+ */
+int tfs_vol_frag(struct tfs_vol *vol, struct tfs_frag *frags);
+int tfs_vol_defrag(struct tfs_vol *vol, int max);
+int tfs_vol_autodefrag(struct tfs_vol *vol, int secs);
+
+/*
+ * Open files: readi is served from the cached inode while a file is
+ * open, so the data path costs no path walk and no inode read
+ */
+int tfs_file_open(struct tfs_vol *vol, uint16_t ino, struct tfs_file **fp);
+void tfs_file_close(struct tfs_vol *vol, struct tfs_file *f);
+void tfs_file_note(struct tfs_file *f, off_t offset, size_t size);
+int tfs_file_read(struct tfs_vol *vol, struct tfs_file *f, char *buffer, size_t size, off_t offset);
+int tfs_file_write(struct tfs_vol *vol, struct tfs_file *f, const char *buffer, size_t size, off_t offset);
+int tfs_file_sync(struct tfs_vol *vol, struct tfs_file *f);
+
+/*
+ * Block mapping for callers that move data to the device themselves
+ * (see bio_fd); block numbers are device blocks, -1 for holes and
+ * TFS_ZSLOT for blocks of compressed clusters and dirty cached pages,
+ * which only tfs_vol_read can return. tfs_vol_balloc fails with
+ * -EOPNOTSUPP where data has to go through tfs_vol_write to be
+ * compressed, deduplicated or cached, and on files that are not open.
+ * The blocks either returns stay where they are while the file is open
+ * (the defragmenter leaves open files alone). After writing the blocks
+ * from tfs_vol_balloc the caller calls tfs_vol_bdone with how much it
+ * wrote: the file grows only then, and new blocks past what was written
+ * are freed again.
+ */
+int tfs_vol_bmap(struct tfs_vol *vol, uint16_t ino, int first, int count, int *blocks);
+int tfs_vol_balloc(struct tfs_vol *vol, uint16_t ino, off_t offset, size_t size, int *blocks);
+void tfs_vol_bdone(struct tfs_vol *vol, uint16_t ino, off_t offset, size_t size, size_t written);
+
+#endif
@@ -1,12 +1,37 @@
 #!/bin/sh
-rm simplelog
-rm testlog
-a=0
+#
+# Run the workload suite against a fresh TFS mount RUNS times and append
+# the results to OUT (JSON lines). Compare two result files with
+#   benchmark/compare.py baseline.jsonl candidate.jsonl
+#
+# usage: ./run.sh MOUNTDIR [RUNS] [OUT]
 
-while [ "$a" -lt 15 ]
+MNT=${1:?usage: $0 MOUNTDIR [RUNS] [OUT]}
+RUNS=${2:-5}
+OUT=${3:-results.jsonl}
+WL=benchmark/workload
+
+make > /dev/null || exit 1
+make -C benchmark TESTDIR="$MNT" > /dev/null || exit 1
+mkdir -p "$MNT"
+
+suite() {
+	$WL -d "$MNT" -o "$OUT" -l seq-write-4k   -n 8 -s 64k -b 4k  -p seq    -w 100 -N 2000
+	$WL -d "$MNT" -o "$OUT" -l seq-read-4k    -n 8 -s 64k -b 4k  -p seq    -w 0   -N 2000
+	$WL -d "$MNT" -o "$OUT" -l rand-rw-4k     -n 8 -s 64k -b 4k  -p random -w 50  -N 2000
+	$WL -d "$MNT" -o "$OUT" -l seq-rw-64k     -n 4 -s 64k -b 64k -p seq    -w 50  -N 500
+	$WL -d "$MNT" -o "$OUT" -l meta           -n 16 -s 4k -b 4k  -m 100           -N 2000
+	$WL -d "$MNT" -o "$OUT" -l mixed-4t       -n 8 -s 64k -b 4k  -p random -m 30 -t 4 -N 1000
+}
+
+i=0
+while [ "$i" -lt "$RUNS" ]
 do
-    ./auto_run.sh
-    a=`expr $a + 1`
+	rm -f DISKFILE
+	./tfs -s "$MNT" || exit 1
+	suite
+	fusermount -u "$MNT"
+	i=`expr $i + 1`
 done
 
-python average.py
\ No newline at end of file
+echo "Results appended to $OUT"
@@ -5,776 +5,189 @@
  *	Kunal Thakker - kdt57
  *	Bryan Law - bpl52
  *	Tested on: kill.cs.rutgers.edu
+ *
+ *	FUSE adapter over the TFS core in libtfs.c.
  */
 
+#define _GNU_SOURCE
 #define FUSE_USE_VERSION 26
 #include <fuse.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <stddef.h>
 #include <unistd.h>
 #include <fcntl.h>
-#include <sys/stat.h>
 #include <errno.h>
-#include <sys/time.h>
-#include <libgen.h>
 #include <limits.h>
-#include <math.h>
-
-#include "block.h"
-#include "tfs.h"
+#include <stdint.h>
 #include <pthread.h>
 
-char diskfile_path[PATH_MAX];
-
-// Declare your in-memory data structures here
-#define FILE 0
-#define DIRECTORY 1
-#define SUPERBLOCK 2 
-
-
-bitmap_t inode_bm;
-bitmap_t data_bm;
-struct superblock* sb;
-int inodes_per_block=(int)(BLOCK_SIZE/sizeof(struct inode));
-int inode_start_block=3;
-int isInit=0;
-pthread_mutex_t lock;
+#include "libtfs.h"
+#include "tfs_bufvec.h"
+#include "tfs_trace.h"
 
-/* 
- * Get available inode number from bitmap
- * Returns -1 if no empty spot found
-
- */
-int get_avail_ino() {
-	for(int i=0;i<(sb->max_inum);i++){
-		if(get_bitmap(inode_bm,i)==0){
-			//Idk if we should update the bitmap here
-			return i;
-		}
-	}
-	// Step 1: Read inode bitmap from disk
-	
-	// Step 2: Traverse inode bitmap to find an available slot
-
-	// Step 3: Update inode bitmap and write to disk 
-
-	return 0;
-}
-
-/* 
- * Get available data block number from bitmap
- * Returns -1 if no empty spot found
- */
-int get_avail_blkno() {
-	for(int i=0;i<(sb->max_dnum);i++){
-		if(get_bitmap(data_bm,i)==0){
-			//Idk if we should update the bitmap here
-			return i;
-		}
-	}
-	// Step 1: Read data block bitmap from disk
-	
-	// Step 2: Traverse data block bitmap to find an available slot
-
-	// Step 3: Update data block bitmap and write to disk 
-
-	return -1;
-}
-
-/* 
- * inode operations
- */
-int readi(uint16_t ino, struct inode *inode) {
-
-  	// Step 1: Get the inode's on-disk block number
-	int onDiskBM=(ino/inodes_per_block)+inode_start_block;
-  	// Step 2: Get offset of the inode in the inode on-disk block
-	int offset=ino%inodes_per_block;
-
-  	// Step 3: Read the block from disk and then copy into inode structure
-
-	struct inode* data=malloc(BLOCK_SIZE);
-	bio_read(onDiskBM,data);
-	// inode = malloc(sizeof(struct inode));
-	struct inode* temp = malloc(sizeof(struct inode));
-	memcpy(temp,data+offset,sizeof(struct inode));
-
-	*inode = *temp;
-	free(data);
-	return 0;
-}
-
-int writei(uint16_t ino, struct inode	 *inode) {
-
-	// Step 1: Get the block number where this inode resides on disk
-	// printf("Before 110\n");
-	int onDiskBM=(ino/inodes_per_block)+inode_start_block;
-	// printf("After 110\n");
-	// Step 2: Get the offset in the block where this inode resides on disk
-	int offset=ino%inodes_per_block;
-	// Step 3: Write inode to disk 
-	
-	struct inode* data=malloc(BLOCK_SIZE);
-
-	int readRet=bio_read(onDiskBM,data);
-	if(readRet<0){
-		printf("Error reading from disk\n");
-		free(data);
-		free(inode);
-		return readRet;
-	}
-	memcpy(data+offset,inode,sizeof(struct inode));
+char diskfile_path[PATH_MAX];
 
-	bio_write(onDiskBM,data);
-	free(data);
-	// free(inode);
-	return 0;
-}
+struct tfs_vol *vol;
+
+/* The open-file handle set up by tfs_open/tfs_create */
+#define FH(fi) ((struct tfs_file *)(uintptr_t)(fi)->fh)
+
+/* Largest request libfuse 2 can hand us (32 pages) */
+#define TFS_MAX_IO (128 * 1024)
+
+/* TFS mount options, parsed out of -o before fuse_main sees the rest */
+struct tfs_opts {
+	int			keep_cache;		/* keep page cache across opens */
+	int			direct_io;		/* bypass the page cache for every open */
+	unsigned	max_write;		/* largest write request to negotiate */
+	unsigned	max_readahead;	/* largest readahead to negotiate */
+	int			compress;		/* compress file data as it is written */
+	int			dedup;			/* share blocks with identical content */
+	int			delalloc;		/* buffer writes and allocate at writeback */
+	char		*disk;			/* backing file(s), ':' separated to stripe */
+	int			stripe_unit;	/* stripe unit in blocks */
+	int			ram;			/* serve the disk from memory */
+	int			snapshot;		/* seconds between RAM snapshots, 0 for none */
+	int			sealed;			/* read-only image, served without locking */
+	char		*trace;			/* file to record every call in, see tfs_trace.h */
+	int			defrag;			/* seconds between defrag passes, 0 for none */
+};
 
+static struct tfs_opts opts = { 0, 0, TFS_MAX_IO, TFS_MAX_IO, 0, 0, 0, NULL, DEV_STRIPE_UNIT, 0, 0, 0, NULL, 0 };
+
+enum { KEY_HELP };
+
+#define TFS_OPT(t, p, v) { t, offsetof(struct tfs_opts, p), v }
+static const struct fuse_opt tfs_opt_spec[] = {
+	TFS_OPT("keep_cache", keep_cache, 1),
+	TFS_OPT("direct_io", direct_io, 1),
+	TFS_OPT("max_write=%u", max_write, 0),
+	TFS_OPT("max_readahead=%u", max_readahead, 0),
+	TFS_OPT("compress", compress, 1),
+	TFS_OPT("dedup", dedup, 1),
+	TFS_OPT("delalloc", delalloc, 1),
+	TFS_OPT("disk=%s", disk, 0),
+	TFS_OPT("stripe_unit=%d", stripe_unit, 0),
+	TFS_OPT("ram", ram, 1),
+	TFS_OPT("snapshot=%d", snapshot, 0),
+	TFS_OPT("sealed", sealed, 1),
+	TFS_OPT("trace=%s", trace, 0),
+	TFS_OPT("defrag=%d", defrag, 0),
+	FUSE_OPT_KEY("-h", KEY_HELP),
+	FUSE_OPT_KEY("--help", KEY_HELP),
+	FUSE_OPT_END
+};
 
 /* 
- * directory operations
+ * FUSE file operations
  */
-int dir_find(uint16_t ino, const char *fname, size_t name_len, struct dirent *dirent) {
-
-  	// Step 1: Call readi() to get the inode using ino (inode number of current directory)
-
-  	// Step 2: Get data block of current directory from inode
-
-  	// Step 3: Read directory's data block and check each directory entry.
-	printf("Inside dir_find\n");
-	struct inode* root=malloc(sizeof(struct inode));
-	struct dirent* temp_dirent;
-	int readRet=readi(ino,root);
-	//If there was an error finding the inode, return an error
-	if(readRet<0){
-		printf("Error reading inode");
-		free(root);
-		return -2;
-	}
-	//If the parameter ino is a file, return an error.
-	if(root->type==FILE){
-		printf("Ino is for a file\n");
-		free(root);
-		return -2;
-	}
-
-	struct dirent* currentBlock=malloc(BLOCK_SIZE);
-	int dirents_per_block=(int) ((double)BLOCK_SIZE)/((double)sizeof(struct dirent));
-	//Goes through all the datablocks of the current inode.
-	for(int i=0;i<16;i++){
-		if(root->direct_ptr[i]==-1){
-			//This index does not have an attached datablock
-			continue;
-		}
-		else{
-			//A datablock was found, putting its data in currentblock
-			bio_read(sb->d_start_blk+root->direct_ptr[i],currentBlock);
-			//Going through all possible dirents in the current datablock
-			for(int j=0;j<dirents_per_block;j++){
-				temp_dirent=currentBlock+j;
-				if(temp_dirent==NULL||temp_dirent->valid==0){
-					continue;
-				}
-				else{
-					if(strcmp(temp_dirent->name,fname)==0){
-  						//If the name matches, then copy directory entry to dirent structure
-						// int val=root->direct_ptr[i];
-						*dirent=*temp_dirent;
-						free(root);
-						free(currentBlock);
-						return 0;
-					}
-				}
-			}
-		}
-	}
-	//A directory/file with the given name was not found
-	free(root);
-	// free(currentBlock);
-	printf("Directory not found\n");
-	return -1;
-}
-
-//Method to allocate memory to sb, and bitmaps and read from disk
-void start(){
-	if(isInit==0){
-		sb= (struct superblock*) malloc(BLOCK_SIZE);
-		inode_bm=malloc(BLOCK_SIZE);
-		data_bm=malloc(BLOCK_SIZE);
-		int sb_success=bio_read(0,sb);
-		int inode_success=bio_read(1,inode_bm);
-		int data_success=bio_read(2,data_bm);
-		if(sb_success<0||inode_success<0||data_success<0){
-			printf("Error in start\n");
-		}
-		isInit=1;
-	}
-}
-
-//Method to write sb and bitmaps to disk and free allocated memory
-void end(){
-	if(isInit==1){
-		isInit = 0;
-		bio_write(0,sb);
-		bio_write(1,inode_bm);
-		bio_write(2,data_bm);
-		free(sb);
-		free(inode_bm);
-		free(data_bm);
-	}
-}
-
-int dir_add(struct inode dir_inode, uint16_t f_ino, const char *fname, size_t name_len) {
-	int added=0;
-	printf("Inside dir_add\n");
-	struct dirent* currentBlock=malloc(BLOCK_SIZE);
-	if(dir_inode.type==FILE){
-		printf("dir_inode file type is not a directory \n");
-		return -2;
-	}
-	if(dir_inode.valid==0){
-		printf("dir_inode is not valid\n");
-		return -2;
-	}
-	if(get_bitmap(inode_bm,f_ino)==1){
-		printf("The new directories inode is already used somewhere\n");
-		return -2;
-	}
-	struct dirent* tempDirent=malloc(sizeof(struct dirent));
-	if(dir_find(dir_inode.ino,fname,name_len,tempDirent)!=-1){
-		printf("File or folder with this name already exists in the directory");
-		return -2;
-	}
-	printf("After checks in dir_add\n");
-	free(tempDirent);
-	int dirents_per_block=(int) ((double)BLOCK_SIZE)/((double)sizeof(struct dirent));
-	int set=0;
-	struct dirent* newDirent=malloc(sizeof(struct dirent));
-	newDirent->valid=1;
-	newDirent->len=name_len;
-	newDirent->ino=f_ino;
-	strcpy(newDirent->name,fname);
-	for(int i=0;i<16;i++){
-		if(set==1){
-			break;
-		}
-		if(dir_inode.direct_ptr[i]==-1){
-			continue;
-		}
-		else{
-			bio_read(sb->d_start_blk+dir_inode.direct_ptr[i],currentBlock);
-			for(int j=0;j<dirents_per_block;j++){
-				struct dirent* curr=currentBlock+j;
-				if(curr==NULL||curr->valid==0){
-					set=1;
-					currentBlock[j]=*newDirent;
-					bio_write(sb->d_start_blk+dir_inode.direct_ptr[i],currentBlock);
-					free(newDirent);
-					added=1;
-					break;
-					// free(currentBlock);
-				}
-			}
-		}
-	}
-	//Goes here if there is no datablocks for this directory that are empty.
-	//In this case, have to update this inode, so gotta biowrite for inode;
-	if(set==0){
-		printf("Have to add datablock in dir_add\n");
-
-		for(int i=0;i<16;i++){
-			if(dir_inode.direct_ptr[i]==-1){
-				int blockNum=get_avail_blkno();
-				dir_inode.direct_ptr[i]=blockNum;
-				free(currentBlock);
-				// bio_read(sb->d_start_blk+dir_inode.direct_ptr[i],currentBlock);
-				currentBlock = calloc(1,BLOCK_SIZE);
-				currentBlock[0]=*newDirent;
-				bio_write(sb->d_start_blk+dir_inode.direct_ptr[i],currentBlock);
-				writei(dir_inode.ino,&dir_inode);
-				set_bitmap(data_bm,blockNum);
-				// free(newDirent);
-				added=1;
-				free(currentBlock);
-				break;
-				// dir_inode.
-			}
-		}
+static void *tfs_init(struct fuse_conn_info *conn) {
+	// Negotiate large requests and asynchronous reads so sequential I/O
+	// reaches us in as few calls as possible
+	conn->async_read = 1;
+	conn->want |= FUSE_CAP_ASYNC_READ;
+	if(conn->capable & FUSE_CAP_BIG_WRITES){
+		conn->want |= FUSE_CAP_BIG_WRITES;
 	}
-
-	//Goes here if all of the datablocks for this inode is full. IDK what to do here
-	if(added==0){
-		printf("All datablocks for this inode are full\n");
-		return -1;
+	conn->max_write = opts.max_write < TFS_MAX_IO ? opts.max_write : TFS_MAX_IO;
+	if(opts.max_readahead < conn->max_readahead){
+		conn->max_readahead = opts.max_readahead;
 	}
-	struct inode* parent_inode=malloc(sizeof(struct inode));
-	readi(dir_inode.ino,parent_inode);
-	parent_inode->size+=sizeof(struct dirent);
-	time(& (parent_inode->vstat.st_mtime));
-	writei(parent_inode->ino,parent_inode);
-	free(parent_inode);
-	return 0;
-	// Step 1: Read dir_inode's data block and check each directory entry of dir_inode
-
-	// Step 2: Check if fname (directory name) is already used in other entries
-
-	// Step 3: Add directory entry in dir_inode's data block and write to disk
-
-	// Allocate a new data block for this directory if it does not exist
-
-	// Update directory inode
-
-	// Write directory entry
-}
-
-//Deleting leads to empty block, remove from parents inode and make it empty in the bitmap
-int remove_block(struct inode dir_inode, struct dirent* currentBlock, int i){
-	int dirents_per_block=(int) ((double)BLOCK_SIZE)/((double)sizeof(struct dirent));
+	// Let libfuse splice file data to and from /dev/fuse (read_buf/write_buf)
+	conn->want |= conn->capable & (FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE);
 
-	for(int j=0; j<dirents_per_block; j++){
-		struct dirent* temp = currentBlock+j;
-		
-		//Return if the block is not empty
-		if(temp!=NULL && temp->valid!=0){
-			return -1;
-		}
-	}
-
-	//Remove from parents inode and unset from bitmap
-	dir_inode.direct_ptr[i] = -1;
-	writei(dir_inode.ino, &dir_inode);
-
-	unset_bitmap(data_bm, i);
-
-	return 0;
-}
-
-int dir_remove(struct inode dir_inode, const char *fname, size_t name_len) {
-
-	//Find the dirent corresponding to fname
-	//Delete it (set valid to 0 in dirent) and delete corresponding inode(set valid to 0 and ) 
-	//If deleting it results in an empty block, remove it from parents inode and make it empty in the bitmap
-
-	if(dir_inode.type==FILE){
-		printf("Given inode is for a file, not a directory\n");
-		return -2;
-	}
-	struct dirent* currentBlock=malloc(BLOCK_SIZE);
-	int dirents_per_block=(int) ((double)BLOCK_SIZE)/((double)sizeof(struct dirent));
-	
-	for(int i=0;i<16;i++){
-		if(dir_inode.direct_ptr[i]!=-1){
-			bio_read(sb->d_start_blk+dir_inode.direct_ptr[i], currentBlock);
-			for(int j=0;j<dirents_per_block;j++){
-				struct dirent* temp=currentBlock+j;
-				if(temp==NULL||temp->valid==0){
-					continue;
-				}
-				else if(strcmp(temp->name,fname)==0){
-					temp->valid=0;
-					//set dirent to invalid, now have to go to the inode for this dirent and set it as invalid
-					struct inode* toDelete=malloc(sizeof(struct inode));
-					
-					//Set it to invalid
-					readi(temp->ino,toDelete);
-					toDelete->valid=0;
-					writei(temp->ino,toDelete);
-					bio_write(sb->d_start_blk+dir_inode.direct_ptr[i],currentBlock);
-					//Set the bitmap for this inode to be 0 (empty)
-					unset_bitmap(inode_bm, temp->ino);
-
-					//If datablocks are all empty, unmap from bitmap and inode
-					remove_block(dir_inode, currentBlock, i);
-					return 0;
-				}
-			}
-		}
+	// Step 1a: If disk file is not found, call mkfs
+	// Step 1b: If disk file is found, just initialize in-memory data structures
+	// and read superblock from disk
+	dev_stripe_unit(opts.stripe_unit);
+	dev_ram(opts.ram);
+	vol = opts.sealed ? tfs_mount_sealed(diskfile_path) : tfs_mount(diskfile_path);
+	if(vol == NULL){
+		fprintf(stderr, "tfs: cannot mount %s\n", diskfile_path);
+		exit(EXIT_FAILURE);
 	}
-	printf("Directory not found\n");
-	return -1;
-
-	// Step 1: Read dir_inode's data block and checks each directory entry of dir_inode
-	
-	// Step 2: Check if fname exist
-
-	// Step 3: If exist, then remove it from dir_inode's data block and write to disk
-
-}
-
-
-/* 
- * namei operation
- */
-int get_node_by_path(const char *path, uint16_t ino, struct inode *inode) {
-	// if(path[0]!= '/'){
-	// 	printf("Invalid path\n");
-	// 	return -1;
-	// }
-	printf("Inside get_node_by_path\n");
-	printf("Path:%s\n",path);
-	if(strcmp(path,"/")==0){
-		printf("Inside if\n");
-		readi(0,inode);
-		return 0;
+	// The write-side options mean nothing on a sealed image
+	if(opts.sealed){
+		return NULL;
 	}
-	char* temp=malloc(strlen(path)+1);
-	strncpy(temp,path,strlen(path)+1);
-	char* name=malloc(256);
-	name=strtok(temp,"/");
-	//Splits the path up into names
-	struct dirent* crtDirent=malloc(sizeof(struct dirent));
-	//Initialize crtInode to the root of the directory
-	struct inode* crtInode= malloc(sizeof(struct inode));
-	readi(ino,crtInode);
-	while(name!=NULL){
-		int findRet=dir_find(crtInode->ino,name,strlen(name),crtDirent);
-		if(findRet==-1){
-			printf("No directory with this path\n");
-			// free(crtInode);
-			// free(crtDirent);
-			// free(name);
-			// free(temp);
-			return -1;
-		}
-		free(crtInode);
-		readi(crtDirent->ino,crtInode);
-		name=strtok(NULL,"/");
+	vol->compress = opts.compress;
+	if(opts.dedup && tfs_vol_dedup(vol) < 0){
+		fprintf(stderr, "tfs: no room for the dedup table, dedup is off\n");
 	}
-	*inode=*crtInode;
-	free(crtInode);
-	// Step 1: Resolve the path name, walk through path, and finally, find its inode.
-	// Note: You could either implement it in a iterative way or recursive way
-	return 0;
-}
-
-/* 
- * Make file system
- */
-int tfs_mkfs() {
-	// Call dev_init() to initialize (Create) Diskfile
-	dev_init(diskfile_path);
-	dev_open(diskfile_path);
-	// write superblock information
-	sb = malloc(sizeof(struct superblock));
-	sb->magic_num = MAGIC_NUM;
-	sb->max_inum = MAX_INUM;
-	sb->max_dnum = MAX_DNUM;
-	sb->i_bitmap_blk=1;
-	sb->d_bitmap_blk=2;
-	sb->i_start_blk=3;
-	int x=(int)ceil(((double)(MAX_INUM*sizeof(struct inode)))/(double)BLOCK_SIZE);//calculations for start of datablocks i think
-	sb->d_start_blk=sb->i_start_blk+x;
-
-	// initialize inode bitmap
-	inode_bm = malloc(sizeof(char)*MAX_INUM/8.0);
-
-	// initialize data block bitmap
-	data_bm = malloc(sizeof(char)*MAX_DNUM/8.0);
-
-	// update bitmap information for root directory
-	memset(inode_bm, 0, MAX_INUM/8.0);
-	memset(data_bm, 0, MAX_DNUM/8.0);
-
-	// update inode for root directory
-	
-	struct stat* vstat=malloc(sizeof(struct stat));
-	vstat->st_mode= S_IFDIR |0755;
-	time(& vstat->st_mtime);
-
-	struct inode* root_inode=malloc(sizeof(struct inode));
-	root_inode->ino=0;
-	root_inode->valid=1;
-	root_inode->type=DIRECTORY;
-	root_inode->link=2;
-	root_inode->vstat=*vstat;
-	root_inode->size=0;
-	for(int i=0;i<16;i++){
-		root_inode->direct_ptr[i]=-1;
+	if(opts.delalloc && tfs_vol_delalloc(vol) < 0){
+		fprintf(stderr, "tfs: cannot start the flusher, delalloc is off\n");
 	}
-	set_bitmap(inode_bm,0);
-	bio_write(0,(void*)(sb));
-	bio_write(1,(void*)(inode_bm));
-	bio_write(2,(void*)(data_bm));
-	// free(sb);
-	// sb=malloc(sizeof(struct superblock));
-	// bio_write(4,(void*)(root_inode));
-	writei(0,root_inode);
-	printf("End\n");
-	pthread_mutex_init(&lock, NULL);
-	return 0;
-}
-
-
-/* 
- * FUSE file operations
- */
-static void *tfs_init(struct fuse_conn_info *conn) {
-	printf("Init\n");
-	// Step 1a: If disk file is not found, call mkfs
-	int open=dev_open(diskfile_path);
-	printf("OPEN:%d\n",open);
-	inodes_per_block=BLOCK_SIZE/sizeof(struct inode);
-	if(open==-1){
-		tfs_mkfs();
+	if(opts.ram && opts.snapshot > 0 && tfs_vol_autosnap(vol, opts.snapshot) < 0){
+		fprintf(stderr, "tfs: cannot start the snapshot thread\n");
 	}
-	else{
-		sb= (struct superblock*) malloc(BLOCK_SIZE);
-		inode_bm=malloc(sizeof(sizeof(char)*MAX_INUM/8.0));
-		data_bm=malloc(sizeof(sizeof(char)*MAX_DNUM/8.0));
-		int sb_success=bio_read(0,sb);
-		int inode_success=bio_read(1,inode_bm);
-		int data_success=bio_read(2,data_bm);
-		
-		// int inode_success=bio_read(1,inode_bm_node);
-		// int data_success=bio_read(2,data_bm_node);
-		if(sb_success<0||inode_success<0||data_success<0){
-			printf("Couldn't find superblock or bitmap nodes\n");
-			return NULL;
-		}
-		else{
-			printf("Everything found!\n");
-		}
-		// dev_close();
+	if(opts.defrag > 0 && tfs_vol_autodefrag(vol, opts.defrag) < 0){
+		fprintf(stderr, "tfs: cannot start the defragmenter\n");
 	}
-
-
-
-	// Step 1b: If disk file is found, just initialize in-memory data structures
-	// and read superblock from disk
-
 	return NULL;
 }
 
 static void tfs_destroy(void *userdata) {
-	// printf("In destroy?\n")
 	// Step 1: De-allocate in-memory data structures
-	pthread_mutex_lock(&lock);
-	dev_close();
-	pthread_mutex_unlock(&lock);
 	// Step 2: Close diskfile
-
+	tfs_unmount(vol);
+	vol = NULL;
 }
 
 static int tfs_getattr(const char *path, struct stat *stbuf) {
-	// return -1;
 	// Step 1: call get_node_by_path() to get inode from path
-	
-	start();
-	struct inode* inode=malloc(sizeof(struct inode));
-	int ret=get_node_by_path(path,0,inode);
-	if(ret==-1){
-		printf("Get node by path\n");
-		return -ENOENT;
+	struct inode inode;
+	int ret = tfs_vol_lookup(vol, path, &inode);
+	if(ret < 0){
+		return ret;
 	}
-	stbuf->st_mode=inode->vstat.st_mode;
-	stbuf->st_nlink=inode->link;
-	stbuf->st_size=inode->size;
-	stbuf->st_ino=inode->ino;
-	stbuf->st_uid=getuid();
-	stbuf->st_gid=getgid();
-	stbuf->st_mtime=inode->vstat.st_mtime;
-	printf("End of tfs_getAttr\n");
 	// Step 2: fill attribute of file into stbuf from inode
-	// stbuf->st_mode   = S_IFDIR | 0755;
-	// stbuf->st_nlink  = 2;
-	// time(&stbuf->st_mtime);
-	end();
+	tfs_inode_stat(&inode, stbuf);
+	return 0;
+}
+
+static int tfs_statfs(const char *path, struct statvfs *stbuf) {
+	tfs_vol_statfs(vol, stbuf);
 	return 0;
 }
 
 static int tfs_opendir(const char *path, struct fuse_file_info *fi) {
-	printf("Inside opendir\n");
-	pthread_mutex_unlock(&lock);
 	// Step 1: Call get_node_by_path() to get inode from path
-	start();
-	struct inode* node=malloc(sizeof(struct inode));
-	if(get_node_by_path(path,0,node)<0){
-		printf("Path not found\n");
-		free(node);
-		return -1;
-	}
 	// Step 2: If not find, return -1
-	free(node);
-	end();
-	pthread_mutex_unlock(&lock);
-	return 0;
+	struct inode inode;
+	return tfs_vol_lookup(vol, path, &inode);
 }
 
-static int tfs_readdir(const char *path, void *buffer, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi) {
-	
-	printf("INSIDE READDIR\n");
-	// return 0;
-	start();
+struct fill_ctx {
+	void *buffer;
+	fuse_fill_dir_t filler;
+};
+
+static int tfs_fill(void *ctx, const char *name, uint16_t ino) {
+	struct fill_ctx *fc = ctx;
+	return fc->filler(fc->buffer, name, NULL, 0);
+}
 
+static int tfs_readdir(const char *path, void *buffer, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi) {
 	// Step 1: Call get_node_by_path() to get inode from path
-	struct inode* node = malloc(sizeof(struct inode));
-	int ret = get_node_by_path(path, 0, node);
+	struct inode inode;
+	int ret = tfs_vol_lookup(vol, path, &inode);
 	if(ret < 0){
-		printf("No directory with path\n");
-		end();
-		return -1;
-	}
-	if(node->type!=DIRECTORY){
-		printf("Path is not a directory\n");
-		end();
-		return -1;
+		return ret;
 	}
-
 	// Step 2: Read directory entries from its data blocks, and copy them to filler
-	struct dirent* currentBlock=malloc(BLOCK_SIZE);
-	int dirents_per_block=(int) ((double)BLOCK_SIZE)/((double)sizeof(struct dirent));
-
-	filler(buffer, ".", NULL, 0);
-	filler(buffer, "..", NULL, 0);
-	for(int i=0; i<16; i++){
-		if(node->direct_ptr[i] != -1){
-			bio_read(sb->d_start_blk+node->direct_ptr[i], currentBlock);
-			for(int j=0;j<dirents_per_block;j++){
-				struct dirent* temp=currentBlock+j;
-				if(temp==NULL||temp->valid==0){
-					continue;
-				}else{ 
-					filler(buffer, temp->name, NULL, 0);
-				}
-			}
-		}
-	}
-	end();
-	free(currentBlock);
-	printf("Finished readdir\n");
-	
-	return 0;
+	struct fill_ctx fc = { buffer, filler };
+	return tfs_vol_readdir(vol, inode.ino, tfs_fill, &fc);
 }
 
 
 static int tfs_mkdir(const char *path, mode_t mode) {
-	pthread_mutex_lock(&lock);
-	start();
-	printf("INSIDE MKDIR\n");
-	printf("Path in mkdir:%s\n",path);
-	// Step 1: Use dirname() and basename() to separate parent directory path and target directory name
-	// char* dirc;
-	// char* basec;
-	// dirc = strdup(path);
-	// basec = strdup(path);
-	char* dirc = malloc(strlen(path)+1);
-	strncpy(dirc,path, strlen(path)+1);
-	char* basec = malloc(strlen(path)+1);
-	strncpy(basec,path, strlen(path)+1);
-
-	char* dir_name = dirname(dirc);
-	char* base_name = basename(basec);
-	printf("dir_name%s\n",dir_name);
-	printf("base_name%s\n",base_name);
-	// Step 2: Call get_node_by_path() to get inode of parent directory
-	struct inode* parent_inode = malloc(sizeof(struct inode));
-	int parent_ino = get_node_by_path(dir_name, 0, parent_inode);
-	if(parent_ino == -1){
-		printf("Directory does not exist\n");
-		end();
-		pthread_mutex_unlock(&lock);
-		return -1;
-	}
-
-	// Step 3: Call get_avail_ino() to get an available inode number
-	int avail_ino = get_avail_ino();
-	struct inode* new_inode = malloc(sizeof(struct inode));
-	struct stat* vstat=malloc(sizeof(struct stat));
-	vstat->st_mode= S_IFDIR | 0755;
-	time(& vstat->st_mtime);
-
-	new_inode->vstat = *vstat;
-	new_inode->ino = avail_ino;
-	new_inode->size=0;
-	new_inode->link = 2;
-	new_inode->valid = 1;
-	new_inode->type = DIRECTORY;
-	for(int i=0; i<16; i++){
-		new_inode->direct_ptr[i] = -1;
-	}
-
-	// Step 4: Call dir_add() to add directory entry of target directory to parent directory
-	int dir_ret = dir_add(*parent_inode, avail_ino, base_name, strlen(base_name));
-	if(dir_ret < 0){
-		printf("Error adding new directory");
-		end();
-		pthread_mutex_unlock(&lock);
-		return -1;
-	}
-
-	// Step 5: Update inode for target directory
-	
-	set_bitmap(inode_bm,new_inode->ino);
-	// Step 6: Call writei() to write inode to disk
-	writei(avail_ino, new_inode);
-	
-	
-	end();
-	pthread_mutex_unlock(&lock);
-	return 0;
+	return tfs_vol_mkdir(vol, path, mode);
 }
 
 static int tfs_rmdir(const char *path) {
-	
-	printf("Inside tfs_rmdir\n");
-	pthread_mutex_lock(&lock);
-	start();
-	char* dirc = malloc(strlen(path)+1);
-	strncpy(dirc,path, strlen(path)+1);
-	char* basec = malloc(strlen(path)+1);
-	strncpy(basec,path, strlen(path)+1);
-	char* parent= dirname(dirc);
-	char* target = basename(basec);
-	struct inode* parentInode=malloc(sizeof(struct inode));
-	int ret=get_node_by_path(parent,0,parentInode);
-	if(ret==-1){
-		printf("No directory with this path\n");
-		free(parentInode);
-		end();
-		pthread_mutex_unlock(&lock);
-		return -1;
-	}
-	struct dirent* targetDirent=malloc(sizeof(struct dirent));
-	int x=dir_find(parentInode->ino,target,strlen(target),targetDirent);
-	if(x<0){
-		printf("Could not find directory?\n");
-		end();
-		pthread_mutex_unlock(&lock);
-		return -1;
-	}
-	struct inode* targetInode=malloc(sizeof(struct inode));
-	readi(targetDirent->ino,targetInode);
-	for(int i=0;i<16;i++){
-		if(targetInode->direct_ptr[i]!=-1){
-			printf("rmdir: failed to remove \'%s\': Directory not empty\n",target);
-			free(targetInode);
-			free(targetDirent);
-			free(parentInode);
-			end();
-			pthread_mutex_unlock(&lock);
-			return -1;
-		}
-	}
-	
-	dir_remove(*parentInode,target,strlen(target));
-	unset_bitmap(inode_bm,targetInode->ino);
-	end();
-	printf("Removed successfully\n");
-	pthread_mutex_unlock(&lock);
-	return 0;
-	// Step 1: Use dirname() and basename() to separate parent directory path and target directory name
-
-	// Step 2: Call get_node_by_path() to get inode of target directory
-
-	// Step 3: Clear data block bitmap of target directory
-
-	// Step 4: Clear inode bitmap and its data block
-
-	// Step 5: Call get_node_by_path() to get inode of parent directory
-
-	// Step 6: Call dir_remove() to remove directory entry of target directory in its parent directory
+	return tfs_vol_rmdir(vol, path);
 }
 
 static int tfs_releasedir(const char *path, struct fuse_file_info *fi) {
@@ -783,296 +196,128 @@ static int tfs_releasedir(const char *path, struct fuse_file_info *fi) {
     return 0;
 }
 
-static int tfs_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
-	pthread_mutex_lock(&lock);
-	printf("Inside tfs_create\n");
-	start();
-
-	// Step 1: Use dirname() and basename() to separate parent directory path and target file name
-	char* dirc = malloc(strlen(path)+1);
-	strncpy(dirc,path, strlen(path)+1);
-	char* basec = malloc(strlen(path)+1);
-	strncpy(basec,path, strlen(path)+1);
-
-	char* dir_name = dirname(dirc);
-	char* base_name = basename(basec);
-	printf("dir_name%s\n",dir_name);
-	printf("base_name%s\n",base_name);
-
-	// Step 2: Call get_node_by_path() to get inode of parent directory
-	struct inode* parent_inode = malloc(sizeof(struct inode));
-	int parent_ino = get_node_by_path(dir_name, 0, parent_inode);
-	if(parent_ino == -1){
-		printf("Directory does not exist\n");
-		end();
-		pthread_mutex_unlock(&lock);
-		return -1;
-	}
+/*
+ * Per-open caching policy: keep_cache leaves the kernel page cache valid
+ * across opens, and direct_io (for the whole mount, or for files opened
+ * with O_DIRECT) sends every read and write straight to us.
+ */
+static void set_cache_flags(struct fuse_file_info *fi) {
+	fi->keep_cache = opts.keep_cache || opts.sealed;
+	fi->direct_io = opts.direct_io || (fi->flags & O_DIRECT);
+}
 
-	// Step 3: Call get_avail_ino() to get an available inode number
-	int avail_ino = get_avail_ino();
-	struct inode* new_inode = malloc(sizeof(struct inode));
-	struct stat* vstat=malloc(sizeof(struct stat));
-	vstat->st_mode= S_IFREG|0666; //FILE TYPE MODE
-	time(& vstat->st_mtime);
-
-	new_inode->vstat = *vstat;
-	new_inode->ino = avail_ino;
-	new_inode->size=0;
-	new_inode->link = 1;
-	new_inode->valid = 1;
-	new_inode->type = FILE;
-	for(int i=0; i<16; i++){
-		new_inode->direct_ptr[i] = -1;
-	}
+/*
+ * Open files get a handle in fi->fh, so read and write go straight to the
+ * inode without walking the path again
+ */
+static int open_handle(uint16_t ino, struct fuse_file_info *fi) {
+	struct tfs_file *f;
+	int ret = tfs_file_open(vol, ino, &f);
+	if(ret == 0){
+		fi->fh = (uintptr_t)f;
+		set_cache_flags(fi);
+	}
+	return ret;
+}
 
-	// Step 4: Call dir_add() to add directory entry of target file to parent directory
-	struct dirent* temp = malloc(sizeof(struct dirent));
-	if(dir_find(parent_inode->ino, base_name, strlen(base_name), temp)==0){
-		printf("File already exists\n");
-		free(temp);
-		end();
-		pthread_mutex_unlock(&lock);
-		return -1;
-	}
-	free(temp);
-	int dir_ret = dir_add(*parent_inode, avail_ino, base_name, strlen(base_name));
-	if(dir_ret < 0){
-		printf("Error adding new directory");
-		end();
-		pthread_mutex_unlock(&lock);
-		return -1;
+static int tfs_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
+	uint16_t ino;
+	int ret = tfs_vol_create(vol, path, mode, &ino);
+	if(ret < 0){
+		return ret;
 	}
-
-	// Step 5: Update inode for target file
-
-	set_bitmap(inode_bm,new_inode->ino);
-	// Step 6: Call writei() to write inode to disk
-	writei(avail_ino, new_inode);
-	end();
-	pthread_mutex_unlock(&lock);
-	return 0;
+	return open_handle(ino, fi);
 }
 
 static int tfs_open(const char *path, struct fuse_file_info *fi) {
-	
-	printf("Inside tfs_open\n");
-	start();
 	// Step 1: Call get_node_by_path() to get inode from path
-	struct inode* inode=malloc(sizeof(struct inode));
-	int ret=get_node_by_path(path,0,inode);
-	free(inode);
-	if(ret==-1){
-		return -1;
-	}
 	// Step 2: If not find, return -1
-	end();
-	
-	return 0;
+	struct inode inode;
+	int ret = tfs_vol_lookup(vol, path, &inode);
+	if(ret < 0){
+		return ret;
+	}
+	return open_handle(inode.ino, fi);
 }
 
 static int tfs_read(const char *path, char *buffer, size_t size, off_t offset, struct fuse_file_info *fi) {
-	
-    printf("Inside tfs_read\n");
-    pthread_mutex_lock(&lock);
-    // Step 1: You could call get_node_by_path() to get inode from path
-    start();
-    struct inode* inode = malloc(sizeof(struct inode));
-    int inode_ino = get_node_by_path(path, 0, inode);
-    if(inode_ino == -1){
-        printf("Directory does not exist\n");
-        end();
-	   pthread_mutex_unlock(&lock);
-        return -1;
-    }
-
-    // Step 2: Based on size and offset, read its data blocks from disk
-    int block_num = (int)offset/BLOCK_SIZE;
-    int block_offset = offset%BLOCK_SIZE;
-    int total_blocks = 1;
-    int bytes_read = BLOCK_SIZE-block_offset;
-
-    while(bytes_read < size){
-        total_blocks++;
-        bytes_read+=BLOCK_SIZE;
-    }
-
-    for(int i=block_num; i<block_num+total_blocks; i++){
-        if(inode->direct_ptr[i]==-1){
-            printf("Error reading from memory\n");
-		  pthread_mutex_unlock(&lock);
-            return -1;
-        }
-	}
-
-    // Step 3: copy the correct amount of data from offset to buffer
-    int bytes_left = size;
-    int bytes_to_read = BLOCK_SIZE-block_offset; 
-    int bytesRead = 0;
-
-    void* currentBlock=malloc(BLOCK_SIZE);
-    for(int i=block_num; i<block_num+total_blocks; i++){
-        bio_read(sb->d_start_blk+ inode->direct_ptr[i], currentBlock);
-        memcpy(buffer+bytesRead, currentBlock+block_offset , bytes_to_read);
-        bytes_left -= bytes_to_read;
-        bytesRead += bytes_to_read;
-        bytes_to_read = bytes_left<BLOCK_SIZE? bytes_left: BLOCK_SIZE;
-        block_offset = 0;
-    }
-    free(currentBlock);
-
-    // Note: this function should return the amount of bytes you copied to buffer
-    end();
-    pthread_mutex_unlock(&lock);
-    return size;
+	// Step 1: The inode comes from the handle set up in tfs_open
+	// Step 2: Based on size and offset, read its data blocks from disk
+	// Step 3: copy the correct amount of data from offset to buffer
+	return tfs_file_read(vol, FH(fi), buffer, size, offset);
 }
 
 static int tfs_write(const char *path, const char *buffer, size_t size, off_t offset, struct fuse_file_info *fi) {
-	pthread_mutex_lock(&lock);
-	printf("Inside tfs_write\n");
-	start();
-	if(size==0){
-		
-		return 0;
-	}
-	if(size+offset>16*BLOCK_SIZE){
-		printf("Offset/size is too large\n");
-		pthread_mutex_unlock(&lock);
-		return -1;
-	}
-	struct inode* inode=malloc(sizeof(struct inode));
-	int found=get_node_by_path(path,0,inode);
-	if(found==-1){
-		printf("No file found with this path\n");
-		free(inode);
-		pthread_mutex_unlock(&lock);
-		return -1;
-	}
-	if(inode->type==DIRECTORY){
-		printf("Given path is for a directory\n");
-		free(inode);
-		pthread_mutex_unlock(&lock);
-		return -1;
-	}
-	int bytesRead=0;
-	int startingBlock=(int) offset/BLOCK_SIZE;
-	// startingBlock--;
-
-	int blockOffset=offset%BLOCK_SIZE;
-	int totalBlocks=1;
-	bytesRead=BLOCK_SIZE-blockOffset;
+	// Step 1: The inode comes from the handle set up in tfs_open
+	// Step 2: Write the correct amount of data from offset to disk
+	// Step 3: Update the inode info and write it to disk
+	return tfs_file_write(vol, FH(fi), buffer, size, offset);
+}
 
-	while(bytesRead<size){
-		totalBlocks++;
-		bytesRead+=BLOCK_SIZE;
-	}
-	void* currentBlock=malloc(BLOCK_SIZE);
-	for(int i=startingBlock;i<startingBlock+totalBlocks;i++){
-		if(inode->direct_ptr[i]==-1){
-			int newBlockNum=get_avail_blkno();
-			if(newBlockNum==-1){
-				printf("Error: Not enough memory left on disk\n");
-				free(currentBlock);
-				free(inode);
-				pthread_mutex_unlock(&lock);
-				return -1;
-			}
-			else{
-				inode->direct_ptr[i]=newBlockNum;
-				set_bitmap(data_bm,newBlockNum);
-			}
-		}
+/*
+ * Zero-copy variants of read and write: whole blocks are handed to
+ * libfuse as ranges of the disk image so they can be spliced, see
+ * tfs_bufvec.h
+ */
+static int tfs_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset, struct fuse_file_info *fi) {
+	struct tfs_file *f = FH(fi);
+	struct inode inode;
+	int ret = tfs_vol_getinode(vol, f->ino, &inode);
+	if(ret < 0){
+		return ret;
 	}
-	inode->size+=size;
-	writei(inode->ino,inode);
-	int bytesLeft=size;
-	int read=0;
-	for(int i=startingBlock;i<startingBlock+totalBlocks;i++){
-		bio_read(sb->d_start_blk+inode->direct_ptr[i],currentBlock);
-		int toRead=bytesLeft<(BLOCK_SIZE-blockOffset)?bytesLeft:(BLOCK_SIZE-blockOffset);
-		bytesLeft-=toRead;
-		memcpy(currentBlock+blockOffset,buffer+read,toRead);
-		read+=toRead;
-		bio_write(sb->d_start_blk+inode->direct_ptr[i],currentBlock);
-		blockOffset=0;
+	*bufp = tfs_bufvec_read(vol, &inode, size, offset, &ret);
+	if(*bufp != NULL){
+		tfs_file_note(f, offset, fuse_buf_size(*bufp));
 	}
-	// Step 1: You could call get_node_by_path() to get inode from path
-
-	// Step 2: Based on size and offset, read its data blocks from disk
-
-	// Step 3: Write the correct amount of data from offset to disk
-
-	// Step 4: Update the inode info and write it to disk
-
-	// Note: this function should return the amount of bytes you write to disk
-	end();
-	pthread_mutex_unlock(&lock);
-	return size;
+	return ret;
 }
 
-static int tfs_unlink(const char *path) {
-	pthread_mutex_lock(&lock);
-	printf("Inside tfs_unlink\n");
-
-	start();
-	char* dirc = malloc(strlen(path)+1);
-	strncpy(dirc,path, strlen(path)+1);
-	char* basec = malloc(strlen(path)+1);
-	strncpy(basec,path, strlen(path)+1);
-	char* parent= dirname(dirc);
-	char* target = basename(basec);
-	struct inode* parentInode=malloc(sizeof(struct inode));
-	int ret=get_node_by_path(parent,0,parentInode);
-	if(ret==-1){
-		printf("No file with this path");
-		free(parentInode);
-		pthread_mutex_unlock(&lock);
-		return -1;
-	}
-	struct dirent* targetDirent=malloc(sizeof(struct dirent));
-	dir_find(parentInode->ino,target,strlen(target),targetDirent);
-	struct inode* targetInode=malloc(sizeof(struct inode));
-	readi(targetDirent->ino,targetInode);
-	for(int i=0;i<16;i++){
-		if(targetInode->direct_ptr[i]!=-1){
-			unset_bitmap(data_bm,targetInode->direct_ptr[i]);
-			targetInode->direct_ptr[i]=-1;
-		}
+static int tfs_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset, struct fuse_file_info *fi) {
+	struct tfs_file *f = FH(fi);
+	int ret = tfs_bufvec_write(vol, f->ino, buf, offset);
+	if(ret > 0){
+		tfs_file_note(f, offset, ret);
 	}
-	dir_remove(*parentInode,target,strlen(target));
-	unset_bitmap(inode_bm,targetInode->ino);
-	end();
-	printf("Removed successfully");
-	pthread_mutex_unlock(&lock);
-	return 0;
-
-	// Step 1: Use dirname() and basename() to separate parent directory path and target file name
-
-	// Step 2: Call get_node_by_path() to get inode of target file
-
-	// Step 3: Clear data block bitmap of target file
-
-	// Step 4: Clear inode bitmap and its data block
-
-	// Step 5: Call get_node_by_path() to get inode of parent directory
+	return ret;
+}
 
-	// Step 6: Call dir_remove() to remove directory entry of target file in its parent directory
+static int tfs_unlink(const char *path) {
+	return tfs_vol_unlink(vol, path);
+}
 
-	return 0;
+static int tfs_rename(const char *from, const char *to) {
+	return tfs_vol_rename(vol, from, to, 0);
 }
 
 static int tfs_truncate(const char *path, off_t size) {
-	// For this project, you don't need to fill this function
-	// But DO NOT DELETE IT!
-    return 0;
+	struct inode inode;
+	int ret = tfs_vol_lookup(vol, path, &inode);
+	if(ret < 0){
+		return ret;
+	}
+	return tfs_vol_truncate(vol, inode.ino, size);
+}
+
+static int tfs_fallocate(const char *path, int mode, off_t offset, off_t len, struct fuse_file_info *fi) {
+	return tfs_vol_fallocate(vol, FH(fi)->ino, mode, offset, len);
 }
 
 static int tfs_release(const char *path, struct fuse_file_info *fi) {
-	// For this project, you don't need to fill this function
-	// But DO NOT DELETE IT!
+	tfs_file_close(vol, FH(fi));
+	fi->fh = 0;
 	return 0;
 }
 
+static int tfs_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+	int ret = tfs_file_sync(vol, FH(fi));
+	// A RAM disk only reaches its image file through a snapshot
+	if(ret == 0 && opts.ram){
+		ret = tfs_vol_snapshot(vol);
+	}
+	return ret;
+}
+
 static int tfs_flush(const char * path, struct fuse_file_info * fi) {
 	// For this project, you don't need to fill this function
 	// But DO NOT DELETE IT!
@@ -1091,6 +336,7 @@ static struct fuse_operations tfs_ope = {
 	.destroy	= tfs_destroy,
 
 	.getattr	= tfs_getattr,
+	.statfs		= tfs_statfs,
 	.readdir	= tfs_readdir,
 	.opendir	= tfs_opendir,
 	.releasedir	= tfs_releasedir,
@@ -1101,23 +347,357 @@ static struct fuse_operations tfs_ope = {
 	.open		= tfs_open,
 	.read 		= tfs_read,
 	.write		= tfs_write,
+	.read_buf	= tfs_read_buf,
+	.write_buf	= tfs_write_buf,
 	.unlink		= tfs_unlink,
+	.rename		= tfs_rename,
 
 	.truncate   = tfs_truncate,
+	.fallocate	= tfs_fallocate,
 	.flush      = tfs_flush,
+	.fsync		= tfs_fsync,
 	.utimens    = tfs_utimens,
 	.release	= tfs_release
 };
 
 
+/*
+ * Operation tracing (-o trace=FILE): trace_ope wraps each callback above,
+ * timing it and appending a record to the trace, see tfs_trace.h.
+ * Records are gathered in a buffer under trace.lock and reach the file
+ * in TRACE_BUF sized writes, so a traced call pays two clock reads and a
+ * copy; what is left is written at unmount.
+ */
+#define TRACE_BUF (256 * 1024)
+
+static struct {
+	int				fd;
+	uint64_t		epoch;		/* monotonic ns the trace began at */
+	pthread_mutex_t	lock;
+	char			*buf;
+	size_t			len;
+} trace = { -1, 0, PTHREAD_MUTEX_INITIALIZER, NULL, 0 };
+
+/* Handle and inode of an open file, for records of calls on it */
+#define TRACE_FH(fi) .fh = (fi)->fh, .ino = (fi)->fh ? FH(fi)->ino : 0
+
+static uint64_t trace_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void trace_flush(void) {
+	size_t done = 0;
+	ssize_t n;
+	while(done < trace.len && (n = write(trace.fd, trace.buf + done, trace.len - done)) > 0){
+		done += n;
+	}
+	trace.len = 0;
+}
+
+static int trace_open(const char *path) {
+	struct tfs_trace_hdr hdr;
+	if((trace.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0){
+		return -errno;
+	}
+	trace.buf = malloc(TRACE_BUF);
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, TFS_TRACE_MAGIC, sizeof(hdr.magic));
+	hdr.version = TFS_TRACE_VERSION;
+	hdr.rec_size = sizeof(struct tfs_trace_rec);
+	hdr.epoch = time(NULL);
+	memcpy(trace.buf, &hdr, sizeof(hdr));
+	trace.len = sizeof(hdr);
+	trace.epoch = trace_now();
+	return 0;
+}
+
+static void trace_close(void) {
+	pthread_mutex_lock(&trace.lock);
+	trace_flush();
+	close(trace.fd);
+	trace.fd = -1;
+	free(trace.buf);
+	trace.buf = NULL;
+	pthread_mutex_unlock(&trace.lock);
+}
+
+/* Finish r for a call that began at t0 and append it with its path(s) */
+static void trace_add(struct tfs_trace_rec *r, uint64_t t0, const char *path, const char *to) {
+	size_t plen = path ? strlen(path) : 0, tlen = to ? strlen(to) : 0;
+	char *p;
+
+	r->start = t0 - trace.epoch;
+	r->dur = trace_now() - t0;
+	r->pathlen = plen + (to ? 1 + tlen : 0);
+	pthread_mutex_lock(&trace.lock);
+	if(trace.buf != NULL){
+		if(trace.len + sizeof(*r) + r->pathlen > TRACE_BUF){
+			trace_flush();
+		}
+		p = trace.buf + trace.len;
+		memcpy(p, r, sizeof(*r));
+		memcpy(p + sizeof(*r), path, plen);
+		if(to){
+			p[sizeof(*r) + plen] = '\0';
+			memcpy(p + sizeof(*r) + plen + 1, to, tlen);
+		}
+		trace.len += sizeof(*r) + r->pathlen;
+	}
+	pthread_mutex_unlock(&trace.lock);
+}
+
+static void trace_destroy(void *userdata) {
+	tfs_destroy(userdata);
+	trace_close();
+}
+
+static int trace_getattr(const char *path, struct stat *stbuf) {
+	uint64_t t0 = trace_now();
+	int ret = tfs_getattr(path, stbuf);
+	trace_add(&(struct tfs_trace_rec){ .op = TRACE_GETATTR, .ret = ret }, t0, path, NULL);
+	return ret;
+}
+
+static int trace_statfs(const char *path, struct statvfs *stbuf) {
+	uint64_t t0 = trace_now();
+	int ret = tfs_statfs(path, stbuf);
+	trace_add(&(struct tfs_trace_rec){ .op = TRACE_STATFS, .ret = ret }, t0, path, NULL);
+	return ret;
+}
+
+static int trace_opendir(const char *path, struct fuse_file_info *fi) {
+	uint64_t t0 = trace_now();
+	int ret = tfs_opendir(path, fi);
+	trace_add(&(struct tfs_trace_rec){ .op = TRACE_OPENDIR, .ret = ret }, t0, path, NULL);
+	return ret;
+}
+
+static int trace_readdir(const char *path, void *buffer, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi) {
+	uint64_t t0 = trace_now();
+	int ret = tfs_readdir(path, buffer, filler, offset, fi);
+	trace_add(&(struct tfs_trace_rec){ .op = TRACE_READDIR, .ret = ret, .offset = offset }, t0, path, NULL);
+	return ret;
+}
+
+static int trace_releasedir(const char *path, struct fuse_file_info *fi) {
+	uint64_t t0 = trace_now();
+	int ret = tfs_releasedir(path, fi);
+	trace_add(&(struct tfs_trace_rec){ .op = TRACE_RELEASEDIR, .ret = ret }, t0, path, NULL);
+	return ret;
+}
+
+static int trace_mkdir(const char *path, mode_t mode) {
+	uint64_t t0 = trace_now();
+	int ret = tfs_mkdir(path, mode);
+	trace_add(&(struct tfs_trace_rec){ .op = TRACE_MKDIR, .ret = ret, .arg = mode }, t0, path, NULL);
+	return ret;
+}
+
+static int trace_rmdir(const char *path) {
+	uint64_t t0 = trace_now();
+	int ret = tfs_rmdir(path);
+	trace_add(&(struct tfs_trace_rec){ .op = TRACE_RMDIR, .ret = ret }, t0, path, NULL);
+	return ret;
+}
+
+static int trace_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
+	uint64_t t0 = trace_now();
+	int ret = tfs_create(path, mode, fi);
+	trace_add(&(struct tfs_trace_rec){ .op = TRACE_CREATE, .ret = ret, .arg = mode, TRACE_FH(fi) }, t0, path, NULL);
+	return ret;
+}
+
+static int trace_open_file(const char *path, struct fuse_file_info *fi) {
+	uint64_t t0 = trace_now();
+	int ret = tfs_open(path, fi);
+	trace_add(&(struct tfs_trace_rec){ .op = TRACE_OPEN, .ret = ret, .arg = fi->flags, TRACE_FH(fi) }, t0, path, NULL);
+	return ret;
+}
+
+static int trace_read(const char *path, char *buffer, size_t size, off_t offset, struct fuse_file_info *fi) {
+	uint64_t t0 = trace_now();
+	int ret = tfs_read(path, buffer, size, offset, fi);
+	trace_add(&(struct tfs_trace_rec){ .op = TRACE_READ, .ret = ret, .offset = offset, .size = size, TRACE_FH(fi) }, t0, NULL, NULL);
+	return ret;
+}
+
+static int trace_write(const char *path, const char *buffer, size_t size, off_t offset, struct fuse_file_info *fi) {
+	uint64_t t0 = trace_now();
+	int ret = tfs_write(path, buffer, size, offset, fi);
+	trace_add(&(struct tfs_trace_rec){ .op = TRACE_WRITE, .ret = ret, .offset = offset, .size = size, TRACE_FH(fi) }, t0, NULL, NULL);
+	return ret;
+}
+
+/* read_buf returns 0 on success: the record gets the bytes in the bufvec */
+static int trace_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset, struct fuse_file_info *fi) {
+	uint64_t t0 = trace_now();
+	int ret = tfs_read_buf(path, bufp, size, offset, fi);
+	trace_add(&(struct tfs_trace_rec){ .op = TRACE_READ, .ret = ret == 0 ? (int)fuse_buf_size(*bufp) : ret,
+		.offset = offset, .size = size, TRACE_FH(fi) }, t0, NULL, NULL);
+	return ret;
+}
+
+static int trace_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset, struct fuse_file_info *fi) {
+	size_t size = fuse_buf_size(buf);
+	uint64_t t0 = trace_now();
+	int ret = tfs_write_buf(path, buf, offset, fi);
+	trace_add(&(struct tfs_trace_rec){ .op = TRACE_WRITE, .ret = ret, .offset = offset, .size = size, TRACE_FH(fi) }, t0, NULL, NULL);
+	return ret;
+}
+
+static int trace_unlink(const char *path) {
+	uint64_t t0 = trace_now();
+	int ret = tfs_unlink(path);
+	trace_add(&(struct tfs_trace_rec){ .op = TRACE_UNLINK, .ret = ret }, t0, path, NULL);
+	return ret;
+}
+
+static int trace_rename(const char *from, const char *to) {
+	uint64_t t0 = trace_now();
+	int ret = tfs_rename(from, to);
+	trace_add(&(struct tfs_trace_rec){ .op = TRACE_RENAME, .ret = ret }, t0, from, to);
+	return ret;
+}
+
+static int trace_truncate(const char *path, off_t size) {
+	uint64_t t0 = trace_now();
+	int ret = tfs_truncate(path, size);
+	trace_add(&(struct tfs_trace_rec){ .op = TRACE_TRUNCATE, .ret = ret, .offset = size }, t0, path, NULL);
+	return ret;
+}
+
+static int trace_fallocate(const char *path, int mode, off_t offset, off_t len, struct fuse_file_info *fi) {
+	uint64_t t0 = trace_now();
+	int ret = tfs_fallocate(path, mode, offset, len, fi);
+	trace_add(&(struct tfs_trace_rec){ .op = TRACE_FALLOCATE, .ret = ret, .arg = mode, .offset = offset, .size = len, TRACE_FH(fi) }, t0, NULL, NULL);
+	return ret;
+}
+
+/* The handle is gone once tfs_release returns, so take it first */
+static int trace_release(const char *path, struct fuse_file_info *fi) {
+	struct tfs_trace_rec r = { .op = TRACE_RELEASE, TRACE_FH(fi) };
+	uint64_t t0 = trace_now();
+	r.ret = tfs_release(path, fi);
+	trace_add(&r, t0, NULL, NULL);
+	return r.ret;
+}
+
+static int trace_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+	uint64_t t0 = trace_now();
+	int ret = tfs_fsync(path, datasync, fi);
+	trace_add(&(struct tfs_trace_rec){ .op = TRACE_FSYNC, .ret = ret, .arg = datasync, TRACE_FH(fi) }, t0, NULL, NULL);
+	return ret;
+}
+
+static int trace_flush_file(const char *path, struct fuse_file_info *fi) {
+	uint64_t t0 = trace_now();
+	int ret = tfs_flush(path, fi);
+	trace_add(&(struct tfs_trace_rec){ .op = TRACE_FLUSH, .ret = ret, TRACE_FH(fi) }, t0, NULL, NULL);
+	return ret;
+}
+
+static int trace_utimens(const char *path, const struct timespec tv[2]) {
+	uint64_t t0 = trace_now();
+	int ret = tfs_utimens(path, tv);
+	trace_add(&(struct tfs_trace_rec){ .op = TRACE_UTIMENS, .ret = ret }, t0, path, NULL);
+	return ret;
+}
+
+static struct fuse_operations trace_ope = {
+	.init		= tfs_init,
+	.destroy	= trace_destroy,
+
+	.getattr	= trace_getattr,
+	.statfs		= trace_statfs,
+	.readdir	= trace_readdir,
+	.opendir	= trace_opendir,
+	.releasedir	= trace_releasedir,
+	.mkdir		= trace_mkdir,
+	.rmdir		= trace_rmdir,
+
+	.create		= trace_create,
+	.open		= trace_open_file,
+	.read 		= trace_read,
+	.write		= trace_write,
+	.read_buf	= trace_read_buf,
+	.write_buf	= trace_write_buf,
+	.unlink		= trace_unlink,
+	.rename		= trace_rename,
+
+	.truncate   = trace_truncate,
+	.fallocate	= trace_fallocate,
+	.flush      = trace_flush_file,
+	.fsync		= trace_fsync,
+	.utimens    = trace_utimens,
+	.release	= trace_release
+};
+
+
+static int tfs_opt_proc(void *data, const char *arg, int key, struct fuse_args *outargs) {
+	if(key == KEY_HELP){
+		fprintf(stderr,
+			"TFS options:\n"
+			"    -o keep_cache          keep cached file data across opens\n"
+			"    -o direct_io           bypass the page cache (always on for O_DIRECT opens)\n"
+			"    -o max_write=N         largest write request (default %d)\n"
+			"    -o max_readahead=N     largest readahead (default %d)\n"
+			"    -o compress            compress file data as it is written\n"
+			"    -o dedup               share blocks with identical content\n"
+			"    -o delalloc            buffer writes, allocate blocks at writeback\n"
+			"    -o disk=FILE[:FILE...] backing file, or files to stripe over (./DISKFILE)\n"
+			"    -o stripe_unit=N       blocks per stripe on each file (default %d)\n"
+			"    -o ram                 keep the disk in memory, written back by snapshots\n"
+			"                           (on fsync, at unmount and every -o snapshot=SECS)\n"
+			"    -o sealed              mount the image read-only and serve it without locking\n"
+			"    -o trace=FILE          record every call in FILE, for tfs_replay\n"
+			"    -o defrag=SECS         defragment the most fragmented files every SECS seconds\n"
+			"    -o attr_timeout=T      cache attributes for T seconds (default 1.0)\n"
+			"    -o entry_timeout=T     cache name lookups for T seconds (default 1.0)\n"
+			"\n", TFS_MAX_IO, TFS_MAX_IO, DEV_STRIPE_UNIT);
+	}
+	return 1;
+}
+
+/* Set diskfile_path to spec with every member made absolute: fuse_main chdirs to / */
+static void set_disk(const char *spec) {
+	char cwd[PATH_MAX], *list = strdup(spec), *save, *member;
+	size_t len = 0;
+
+	getcwd(cwd, PATH_MAX);
+	diskfile_path[0] = '\0';
+	for(member = strtok_r(list, ":", &save); member != NULL; member = strtok_r(NULL, ":", &save)){
+		len += snprintf(diskfile_path + len, PATH_MAX - len, "%s%s%s%s", len ? ":" : "",
+			member[0] == '/' ? "" : cwd, member[0] == '/' ? "" : "/", member);
+		if(len >= PATH_MAX){
+			fprintf(stderr, "tfs: disk path too long\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	free(list);
+}
+
 int main(int argc, char *argv[]) {
 	int fuse_stat;
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
 
-	getcwd(diskfile_path, PATH_MAX);
-	strcat(diskfile_path, "/DISKFILE");
+	if(fuse_opt_parse(&args, &opts, tfs_opt_spec, tfs_opt_proc) == -1){
+		return 1;
+	}
+	set_disk(opts.disk ? opts.disk : "DISKFILE");
+	// A sealed image is read-only to the kernel as well
+	if(opts.sealed){
+		fuse_opt_add_arg(&args, "-oro");
+	}
+	// Opened here, before fuse_main daemonizes and changes directory
+	if(opts.trace != NULL && trace_open(opts.trace) < 0){
+		fprintf(stderr, "tfs: cannot create trace %s: %s\n", opts.trace, strerror(errno));
+		return 1;
+	}
+	fuse_stat = fuse_main(args.argc, args.argv, opts.trace ? &trace_ope : &tfs_ope, NULL);
+	fuse_opt_free_args(&args);
 
-	fuse_stat = fuse_main(argc, argv, &tfs_ope, NULL);
-	
 	return fuse_stat;
 }
 
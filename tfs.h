@@ -9,6 +9,7 @@
 
 
 #include <linux/limits.h>
+#include <stdint.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
@@ -19,6 +20,66 @@
 #define MAX_INUM 1024
 #define MAX_DNUM 16384
 
+/* inode types */
+#define TFS_FILE 0
+#define TFS_DIRECTORY 1
+
+/*
+ * Compressed clusters: TFS_CLUSTER_BLOCKS logical blocks of a file stored
+ * in fewer data blocks. The direct_ptr slots past the blocks actually
+ * used hold TFS_ZSLOT, which is also how a compressed cluster is told
+ * apart from a raw one.
+ */
+#define TFS_CLUSTER_BLOCKS 4
+#define TFS_ZSLOT -2
+
+/*
+ * Block groups: inodes and data blocks are split into TFS_GROUPS equal
+ * slices, inode slice g pairing with data slice g. Allocation keeps a
+ * file's data in its inode's group and a file's inode in its parent's,
+ * and spreads directories across groups. The superblock keeps each
+ * group's free counts so full groups are skipped without a bitmap scan.
+ */
+#define TFS_GROUPS 16
+
+struct group_desc {
+	uint16_t	free_inum;			/* unallocated inodes in the group */
+	uint16_t	free_dnum;			/* unallocated data blocks in the group */
+};
+
+/* Group g of n items starts at g*(n/groups); the last one takes any remainder */
+static inline int group_of(int n, int groups, int i) {
+	int g = i / (n / groups);
+	return g < groups ? g : groups - 1;
+}
+
+static inline int group_start(int n, int groups, int g) {
+	return g * (n / groups);
+}
+
+static inline int group_end(int n, int groups, int g) {
+	return g == groups - 1 ? n : (g + 1) * (n / groups);
+}
+
+/*
+ * Dedup table: a volume that has been mounted with dedup keeps one entry
+ * per data block, in data blocks of its own starting at dedup_blk.
+ * refs counts the block pointers naming the block, so a block shared
+ * between files is only freed with its last reference. hash is set on
+ * blocks whose content can be shared by later writes.
+ */
+struct dedup_ent {
+	uint64_t	hash;				/* content hash, 0 if not indexed */
+	uint32_t	refs;				/* block pointers naming the block */
+	uint32_t	pad;
+};
+
+/*
+ * Orphans: an inode whose last entry is removed keeps its blocks and
+ * goes on the superblock's orphan list until they are freed in the
+ * background, so the list survives a remount. Older images have zeros
+ * past gd[], an empty list.
+ */
 struct superblock {
 	uint32_t	magic_num;			/* magic number */
 	uint16_t	max_inum;			/* maximum inode number */
@@ -27,6 +88,13 @@ struct superblock {
 	uint32_t	d_bitmap_blk;		/* start block of data block bitmap */
 	uint32_t	i_start_blk;		/* start block of inode region */
 	uint32_t	d_start_blk;		/* start block of data block region */
+	uint32_t	free_inum;			/* unallocated inodes */
+	uint32_t	free_dnum;			/* unallocated data blocks */
+	uint32_t	dedup_blk;			/* start block of the dedup table, 0 if none */
+	uint32_t	groups;				/* block groups, 0 on images made before them */
+	struct group_desc gd[TFS_GROUPS];	/* per-group free counts */
+	uint16_t	norphans;			/* inodes on the orphan list */
+	uint16_t	orphans[MAX_INUM];	/* unlinked inodes whose blocks are not yet freed */
 };
 
 struct inode {
@@ -47,21 +115,25 @@ struct dirent {
 	uint16_t len;					/* length of name */
 };
 
+#define INODES_PER_BLOCK ((int)(BLOCK_SIZE/sizeof(struct inode)))
+#define DIRENTS_PER_BLOCK ((int)(BLOCK_SIZE/sizeof(struct dirent)))
+#define DEDUP_PER_BLOCK ((int)(BLOCK_SIZE/sizeof(struct dedup_ent)))
+
 
 /*
  * bitmap operations
  */
 typedef unsigned char* bitmap_t;
 
-void set_bitmap(bitmap_t b, int i) {
+static inline void set_bitmap(bitmap_t b, int i) {
     b[i / 8] |= 1 << (i & 7);
 }
 
-void unset_bitmap(bitmap_t b, int i) {
+static inline void unset_bitmap(bitmap_t b, int i) {
     b[i / 8] &= ~(1 << (i & 7));
 }
 
-uint8_t get_bitmap(bitmap_t b, int i) {
+static inline uint8_t get_bitmap(bitmap_t b, int i) {
     return b[i / 8] & (1 << (i & 7)) ? 1 : 0;
 }
 
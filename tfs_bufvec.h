@@ -0,0 +1,239 @@
+/*
+ *	Tiny File System
+ *	File:	tfs_bufvec.h
+ *
+ *	Zero-copy data path shared by the FUSE adapters. Include after the
+ *	libfuse header (fuse.h or fuse_lowlevel.h), which provides struct
+ *	fuse_bufvec and fuse_buf_copy().
+ *
+ *	Whole blocks are described to libfuse as ranges of the disk image fd
+ *	(FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK), so it can splice them between
+ *	/dev/fuse and the image without the data passing through our
+ *	buffers. Holes, and the unaligned head and tail of a request, go
+ *	through ordinary memory buffers and tfs_vol_read/tfs_vol_write, as
+ *	does everything in a compressed cluster or still in a file's page
+ *	cache (delayed allocation, or an append tail not yet written).
+ *
+ *	The block map is sampled under the volume lock but the data moves
+ *	after it is dropped, so a read racing a write to the same block may
+ *	see either version, as it could with any interleaving of the two.
+ */
+
+#ifndef _TFS_BUFVEC_H
+#define _TFS_BUFVEC_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "libtfs.h"
+
+/* Free a bufvec from tfs_bufvec_read (libfuse 2 does this itself) */
+static inline void tfs_bufvec_free(struct fuse_bufvec *bv) {
+	size_t i;
+
+	if (bv == NULL)
+		return;
+	for (i = 0; i < bv->count; i++)
+		if (!(bv->buf[i].flags & FUSE_BUF_IS_FD))
+			free(bv->buf[i].mem);
+	free(bv);
+}
+
+/* Append size bytes of device data at pos, merging with the previous fd range */
+static inline void bufvec_add_fd(struct fuse_bufvec *bv, int fd, off_t pos, size_t size) {
+	struct fuse_buf *prev = bv->count ? &bv->buf[bv->count - 1] : NULL;
+
+	if (prev && (prev->flags & FUSE_BUF_IS_FD) && prev->fd == fd &&
+			prev->pos + (off_t)prev->size == pos) {
+		prev->size += size;
+		return;
+	}
+	memset(&bv->buf[bv->count], 0, sizeof(struct fuse_buf));
+	bv->buf[bv->count].size = size;
+	bv->buf[bv->count].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+	bv->buf[bv->count].fd = fd;
+	bv->buf[bv->count].pos = pos;
+	bv->count++;
+}
+
+static inline void bufvec_add_mem(struct fuse_bufvec *bv, void *mem, size_t size) {
+	memset(&bv->buf[bv->count], 0, sizeof(struct fuse_buf));
+	bv->buf[bv->count].size = size;
+	bv->buf[bv->count].mem = mem;
+	bv->buf[bv->count].fd = -1;
+	bv->count++;
+}
+
+/*
+ * Build a bufvec for reading up to size bytes at offset of the file
+ * described by inode, clamped to the file size.
+ * Returns NULL and sets *err on failure.
+ */
+static inline struct fuse_bufvec *tfs_bufvec_read(struct tfs_vol *vol, const struct inode *inode, size_t size, off_t offset, int *err) {
+	struct fuse_bufvec *bv;
+	int first, count, i, *blocks;
+
+	if (offset >= inode->size)
+		size = 0;
+	else if (offset + size > inode->size)
+		size = inode->size - offset;
+	if (size == 0) {
+		bv = calloc(1, sizeof(struct fuse_bufvec));
+		bv->count = 1;
+		bv->buf[0].fd = -1;
+		return bv;
+	}
+
+	first = offset / BLOCK_SIZE;
+	count = (offset + size - 1) / BLOCK_SIZE - first + 1;
+	blocks = malloc(count * sizeof(int));
+	if ((*err = tfs_vol_bmap(vol, inode->ino, first, count, blocks)) < 0) {
+		free(blocks);
+		return NULL;
+	}
+	bv = calloc(1, sizeof(struct fuse_bufvec) + count * sizeof(struct fuse_buf));
+	for (i = 0; i < count; i++) {
+		size_t boff = i == 0 ? offset % BLOCK_SIZE : 0;
+		size_t len = BLOCK_SIZE - boff < size ? BLOCK_SIZE - boff : size;
+		off_t pos;
+		int fd = -1;
+
+		if (blocks[i] >= 0 && len == BLOCK_SIZE)
+			fd = bio_fd(blocks[i], &pos);
+		if (fd >= 0) {
+			bufvec_add_fd(bv, fd, pos, len);
+		} else if (blocks[i] == -1) {
+			bufvec_add_mem(bv, calloc(1, len), len);
+		} else {
+			/* partial block, or a compressed cluster */
+			char *mem = malloc(len);
+			int ret = tfs_vol_read(vol, inode->ino, mem, len, offset);
+			if (ret < 0) {
+				free(mem);
+				free(blocks);
+				tfs_bufvec_free(bv);
+				*err = ret;
+				return NULL;
+			}
+			bufvec_add_mem(bv, mem, ret);
+		}
+		offset += len;
+		size -= len;
+	}
+	free(blocks);
+	*err = 0;
+	return bv;
+}
+
+/* Copy len bytes out of src into memory and write them through the core */
+static inline int bufvec_write_copy(struct tfs_vol *vol, uint16_t ino, struct fuse_bufvec *src, off_t offset, size_t len) {
+	struct fuse_bufvec dst = FUSE_BUFVEC_INIT(len);
+	char *mem = malloc(len);
+	ssize_t got;
+	int ret;
+
+	dst.buf[0].mem = mem;
+	got = fuse_buf_copy(&dst, src, 0);
+	if (got < 0) {
+		free(mem);
+		return got;
+	}
+	ret = tfs_vol_write(vol, ino, mem, got, offset);
+	free(mem);
+	return ret;
+}
+
+/*
+ * Write the contents of src at offset of open file ino. Whole blocks
+ * are allocated up front and spliced straight into the disk image, and
+ * the file grows over them once they are written; the unaligned head
+ * and tail are copied.
+ * Returns bytes written or a negative errno.
+ */
+static inline int tfs_bufvec_write(struct tfs_vol *vol, uint16_t ino, struct fuse_bufvec *src, off_t offset) {
+	size_t size = fuse_buf_size(src);
+	size_t head = (BLOCK_SIZE - offset % BLOCK_SIZE) % BLOCK_SIZE;
+	size_t done = 0, mid;
+	int ret, i, n, *blocks;
+
+	if (head > size)
+		head = size;
+	mid = (size - head) / BLOCK_SIZE * BLOCK_SIZE;
+
+	if (head) {
+		if ((ret = bufvec_write_copy(vol, ino, src, offset, head)) < 0)
+			return ret;
+		done += ret;
+		if ((size_t)ret < head)
+			return done;
+	}
+
+	if (mid) {
+		size_t moved = 0;
+
+		blocks = malloc(mid / BLOCK_SIZE * sizeof(int));
+		n = tfs_vol_balloc(vol, ino, offset + done, mid, blocks);
+		if (n == -EOPNOTSUPP) {
+			/* compressing, deduplicating or caching: the core has to see the data */
+			free(blocks);
+			goto copy;
+		}
+		if (n < 0) {
+			free(blocks);
+			return done ? (int)done : n;
+		}
+		for (ret = 0, i = 0; i < n; ) {
+			struct fuse_bufvec dst = FUSE_BUFVEC_INIT(BLOCK_SIZE);
+			off_t pos, next;
+			ssize_t got;
+			int fd = bio_fd(blocks[i], &pos), j = i + 1;
+
+			if (fd < 0) {
+				/* block not backed by a plain fd: write it through the core */
+				if ((ret = bufvec_write_copy(vol, ino, src, offset + done + moved, BLOCK_SIZE)) < 0)
+					break;
+				moved += ret;
+				if (ret < BLOCK_SIZE)
+					break;
+				i++;
+				continue;
+			}
+			/* extend over physically contiguous blocks */
+			while (j < n && bio_fd(blocks[j], &next) == fd &&
+					next == pos + (off_t)(j - i) * BLOCK_SIZE)
+				j++;
+			dst.buf[0].size = (size_t)(j - i) * BLOCK_SIZE;
+			dst.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+			dst.buf[0].fd = fd;
+			dst.buf[0].pos = pos;
+			got = fuse_buf_copy(&dst, src, 0);
+			if (got < 0) {
+				ret = got;
+				break;
+			}
+			moved += got;
+			if ((size_t)got < dst.buf[0].size)
+				break;
+			i = j;
+		}
+		free(blocks);
+		/* the file grows over what made it, new blocks past that are given back */
+		tfs_vol_bdone(vol, ino, offset + done, (size_t)n * BLOCK_SIZE, moved);
+		done += moved;
+		if (done == 0 && ret < 0)
+			return ret;
+		if (done < head + mid)
+			return done;
+	}
+
+copy:
+	if (done < size) {
+		if ((ret = bufvec_write_copy(vol, ino, src, offset + done, size - done)) < 0)
+			return done ? (int)done : ret;
+		done += ret;
+	}
+	return done;
+}
+
+#endif
@@ -0,0 +1,92 @@
+/*
+ *	Tiny File System
+ *	File:	tfs_defrag.c
+ *
+ *	Offline defragmenter. Reports how fragmented the files of an image
+ *	are, then moves the most fragmented ones into contiguous free runs
+ *	with tfs_vol_defrag, the same pass tfs -o defrag=SECS makes on a
+ *	mounted volume. A file's fragmentation is the number of runs its
+ *	blocks form: stretches of physically consecutive blocks, in file
+ *	order, holes skipped.
+ *
+ *	-n only reports, -m moves at most MAX files, and -v lists every
+ *	fragmented file, worst first. Files sharing blocks through dedup or
+ *	clones are not moved.
+ *
+ *	IMAGE may be a ':' separated list of striped member files, with -u
+ *	giving the stripe unit in blocks they were created with.
+ *
+ *	usage: tfs_defrag [-n] [-v] [-m MAX] [-u UNIT] IMAGE
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "libtfs.h"
+
+static struct tfs_frag frags[MAX_INUM];
+static int verbose;
+
+static void report(struct tfs_vol *vol, const char *when) {
+	long runs = 0, fragmented = 0;
+	int n = tfs_vol_frag(vol, frags), i;
+
+	for (i = 0; i < n; i++) {
+		runs += frags[i].runs;
+		fragmented += frags[i].runs > 1;
+	}
+	printf("%s: %d files, %ld fragmented (%.1f%%), %.2f runs per file\n", when, n,
+		fragmented, n ? 100.0 * fragmented / n : 0.0, n ? (double)runs / n : 0.0);
+	if (!verbose)
+		return;
+	for (i = 0; i < n && frags[i].runs > 1; i++)
+		printf("%6d: %2d blocks in %2d runs\n", frags[i].ino, frags[i].blocks, frags[i].runs);
+}
+
+static void usage(const char *prog) {
+	fprintf(stderr, "usage: %s [-n] [-v] [-m MAX] [-u UNIT] IMAGE\n", prog);
+	exit(2);
+}
+
+int main(int argc, char **argv) {
+	int opt, dry = 0, max = 0, moved;
+	struct timespec t0, t1;
+	struct tfs_vol *vol;
+
+	while ((opt = getopt(argc, argv, "nvm:u:h")) != -1) {
+		switch (opt) {
+		case 'n': dry = 1; break;
+		case 'v': verbose = 1; break;
+		case 'm': max = atoi(optarg); break;
+		case 'u': dev_stripe_unit(atoi(optarg)); break;
+		default: usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1)
+		usage(argv[0]);
+
+	/* tfs_mount would make a new file system where there is none */
+	if (dev_open(argv[optind]) < 0) {
+		fprintf(stderr, "tfs_defrag: cannot open %s\n", argv[optind]);
+		return 1;
+	}
+	dev_close();
+	if ((vol = tfs_mount(argv[optind])) == NULL) {
+		fprintf(stderr, "tfs_defrag: %s: not a TFS image\n", argv[optind]);
+		return 1;
+	}
+
+	report(vol, "before");
+	if (!dry) {
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		moved = tfs_vol_defrag(vol, max);
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		printf("moved %d files in %.3f s\n", moved,
+			(t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9);
+		report(vol, "after");
+	}
+	tfs_unmount(vol);
+	return 0;
+}
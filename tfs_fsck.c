@@ -0,0 +1,526 @@
+/*
+ *	Tiny File System
+ *	File:	tfs_fsck.c
+ *
+ *	Offline consistency checker. Loads the inode table and walks the
+ *	directory tree from the root with a pool of threads, then rebuilds
+ *	the inode and data bitmaps from what is actually reachable:
+ *
+ *	  - dirents naming a free, out of range or already linked inode are
+ *	    dangling and get cleared
+ *	  - valid inodes nothing links to are orphans and get freed, unless
+ *	    they are on the superblock's orphan list: those are unlinked
+ *	    files the next mount will reclaim, and are kept. List entries
+ *	    naming a free or still linked inode are dropped
+ *	  - a data block claimed by two inodes stays with the lower ino,
+ *	    unless the volume has a dedup table and both are files; the
+ *	    table's reference counts are then checked against the claims
+ *	  - bitmap bits that disagree with the above are corrected, along
+ *	    with the superblock's free inode and block counts, overall and
+ *	    per block group
+ *
+ *	Nothing is written unless -y is given. Fragmentation statistics for
+ *	files and free space are printed at the end.
+ *
+ *	IMAGE may be a ':' separated list of striped member files, with -u
+ *	giving the stripe unit in blocks they were created with.
+ *
+ *	usage: tfs_fsck [-y] [-v] [-j THREADS] [-u UNIT] IMAGE
+ *	exit:  0 clean, 1 errors corrected, 4 errors left, 8 operational error
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "libtfs.h"
+
+static struct superblock sb;
+static struct inode *itab;			/* the whole inode table */
+static unsigned char *idirty;		/* inode table blocks to write back */
+static unsigned char *reached;		/* inodes linked from the tree */
+static int *owner;					/* ino claiming each data block, -1 if none */
+static struct dedup_ent *dtab;		/* dedup table, NULL if the volume has none */
+static uint32_t *claims;			/* block pointers naming each data block */
+static int nthreads, repair, verbose;
+static unsigned long problems;
+
+static void problem(const char *fmt, ...) {
+	va_list ap;
+
+	__atomic_add_fetch(&problems, 1, __ATOMIC_RELAXED);
+	if (!verbose && problems > 50)
+		return;
+	va_start(ap, fmt);
+	flockfile(stdout);
+	vprintf(fmt, ap);
+	printf(repair ? " (fixed)\n" : "\n");
+	funlockfile(stdout);
+	va_end(ap);
+}
+
+static int inode_blocks(void) {
+	return (sb.max_inum + INODES_PER_BLOCK - 1) / INODES_PER_BLOCK;
+}
+
+static void run_threads(void *(*fn)(void *)) {
+	pthread_t tid[nthreads];
+	long i;
+
+	for (i = 0; i < nthreads; i++)
+		pthread_create(&tid[i], NULL, fn, (void *)i);
+	for (i = 0; i < nthreads; i++)
+		pthread_join(tid[i], NULL);
+}
+
+/*
+ * Pass 1: read the inode table, each thread taking an even share of its
+ * blocks, and sanity check every valid inode on the way.
+ */
+static void check_inode(struct inode *inode, int ino) {
+	int i;
+
+	if (inode->ino != ino) {
+		problem("inode %d: records ino %u", ino, inode->ino);
+		inode->ino = ino;
+		idirty[ino / INODES_PER_BLOCK] = 1;
+	}
+	if (inode->type != TFS_FILE && inode->type != TFS_DIRECTORY) {
+		problem("inode %d: bad type %u, freeing", ino, inode->type);
+		inode->valid = 0;
+		idirty[ino / INODES_PER_BLOCK] = 1;
+		return;
+	}
+	for (i = 0; i < 16; i++) {
+		if (inode->direct_ptr[i] == TFS_ZSLOT && inode->type == TFS_FILE)
+			continue;
+		if (inode->direct_ptr[i] != -1 &&
+				(inode->direct_ptr[i] < 0 || inode->direct_ptr[i] >= sb.max_dnum)) {
+			problem("inode %d: block pointer %d out of range (%d)", ino, i, inode->direct_ptr[i]);
+			inode->direct_ptr[i] = -1;
+			idirty[ino / INODES_PER_BLOCK] = 1;
+		}
+	}
+	/* a directory's size counts every entry ever added to it, not its blocks */
+	if (inode->type == TFS_FILE && inode->size > 16 * BLOCK_SIZE) {
+		problem("inode %d: size %u past the largest file", ino, inode->size);
+		inode->size = 16 * BLOCK_SIZE;
+		idirty[ino / INODES_PER_BLOCK] = 1;
+	}
+}
+
+static void *load_inodes(void *arg) {
+	long t = (long)arg;
+	int nblk = inode_blocks();
+	int lo = nblk * t / nthreads, hi = nblk * (t + 1) / nthreads;
+	char *buf = malloc(BLOCK_SIZE);
+	int b, i;
+
+	for (b = lo; b < hi; b++) {
+		bio_read(sb.i_start_blk + b, buf);
+		memcpy(&itab[b * INODES_PER_BLOCK], buf, INODES_PER_BLOCK * sizeof(struct inode));
+		for (i = b * INODES_PER_BLOCK; i < (b + 1) * INODES_PER_BLOCK && i < sb.max_inum; i++)
+			if (itab[i].valid)
+				check_inode(&itab[i], i);
+	}
+	free(buf);
+	return NULL;
+}
+
+/*
+ * Pass 2: walk the tree breadth first. Directories wait on a shared
+ * queue; a thread exits once the queue is empty and no other thread is
+ * still scanning a directory that could add to it.
+ */
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t	more;
+	uint16_t		*ino;
+	int				head, tail, busy;
+} queue = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+static void enqueue(uint16_t ino) {
+	pthread_mutex_lock(&queue.lock);
+	queue.ino[queue.tail++] = ino;
+	pthread_cond_signal(&queue.more);
+	pthread_mutex_unlock(&queue.lock);
+}
+
+/* Check one dirent, returning non-zero if it has to go */
+static int dangling(uint16_t dir, struct dirent *d) {
+	if (memchr(d->name, '\0', sizeof(d->name)) == NULL) {
+		problem("dir %u: entry with unterminated name", dir);
+		return 1;
+	}
+	if (d->ino == 0) {
+		problem("dir %u: entry '%s' links back to the root", dir, d->name);
+		return 1;
+	}
+	if (d->ino >= sb.max_inum || !itab[d->ino].valid) {
+		problem("dir %u: entry '%s' names free inode %u", dir, d->name, d->ino);
+		return 1;
+	}
+	if (__atomic_exchange_n(&reached[d->ino], 1, __ATOMIC_RELAXED)) {
+		problem("dir %u: entry '%s' is an extra link to inode %u", dir, d->name, d->ino);
+		return 1;
+	}
+	if (itab[d->ino].type == TFS_DIRECTORY)
+		enqueue(d->ino);
+	return 0;
+}
+
+static void scan_dir(uint16_t ino, struct dirent *block) {
+	struct inode *dir = &itab[ino];
+	int i, j, dirty;
+
+	for (i = 0; i < 16; i++) {
+		if (dir->direct_ptr[i] == -1)
+			continue;
+		bio_read(sb.d_start_blk + dir->direct_ptr[i], block);
+		dirty = 0;
+		for (j = 0; j < DIRENTS_PER_BLOCK; j++) {
+			if (block[j].valid && dangling(ino, &block[j])) {
+				block[j].valid = 0;
+				dirty = 1;
+			}
+		}
+		if (dirty && repair)
+			bio_write(sb.d_start_blk + dir->direct_ptr[i], block);
+	}
+}
+
+static void *walk_tree(void *arg) {
+	struct dirent *block = malloc(BLOCK_SIZE);
+	uint16_t ino;
+
+	pthread_mutex_lock(&queue.lock);
+	for (;;) {
+		while (queue.head == queue.tail && queue.busy > 0)
+			pthread_cond_wait(&queue.more, &queue.lock);
+		if (queue.head == queue.tail)
+			break;
+		ino = queue.ino[queue.head++];
+		queue.busy++;
+		pthread_mutex_unlock(&queue.lock);
+
+		scan_dir(ino, block);
+
+		pthread_mutex_lock(&queue.lock);
+		if (--queue.busy == 0 && queue.head == queue.tail)
+			pthread_cond_broadcast(&queue.more);
+	}
+	pthread_mutex_unlock(&queue.lock);
+	free(block);
+	return NULL;
+}
+
+/*
+ * The orphan list may only name valid inodes that nothing links to, each
+ * once. They count as reached so their blocks stay in use; reached is 2
+ * for them, to tell a repeat from a linked inode.
+ */
+static int check_orphans(void) {
+	int k, kept = 0;
+
+	if (sb.norphans > MAX_INUM) {
+		problem("superblock: orphan list of %u entries", sb.norphans);
+		sb.norphans = 0;
+	}
+	for (k = 0; k < sb.norphans; k++) {
+		uint16_t ino = sb.orphans[k];
+
+		if (ino >= sb.max_inum || !itab[ino].valid)
+			problem("orphan list: inode %u is free, dropping", ino);
+		else if (reached[ino] == 2)
+			problem("orphan list: inode %u listed twice, dropping", ino);
+		else if (reached[ino])
+			problem("orphan list: inode %u is still linked, dropping", ino);
+		else {
+			reached[ino] = 2;
+			sb.orphans[kept++] = ino;
+		}
+	}
+	sb.norphans = kept;
+	return kept;
+}
+
+/*
+ * Pass 3: free orphans, settle shared blocks in ino order and rebuild
+ * both bitmaps from the inodes that survived.
+ */
+static int may_share(int ino, int blk) {
+	return dtab && owner[blk] >= 0 && itab[ino].type == TFS_FILE &&
+		itab[owner[blk]].type == TFS_FILE;
+}
+
+static void settle_inodes(bitmap_t ibm, bitmap_t dbm) {
+	int ino, i, blk;
+
+	for (ino = 0; ino < sb.max_inum; ino++) {
+		struct inode *inode = &itab[ino];
+
+		if (!inode->valid)
+			continue;
+		if (!reached[ino]) {
+			problem("inode %d: orphan %s of %u bytes, freeing", ino,
+				inode->type == TFS_DIRECTORY ? "directory" : "file", inode->size);
+			inode->valid = 0;
+			idirty[ino / INODES_PER_BLOCK] = 1;
+			continue;
+		}
+		set_bitmap(ibm, ino);
+		for (i = 0; i < 16; i++) {
+			if ((blk = inode->direct_ptr[i]) < 0)
+				continue;
+			if (owner[blk] != -1 && !may_share(ino, blk)) {
+				if (owner[blk] == -2)
+					problem("inode %d: block %d belongs to the dedup table", ino, blk);
+				else
+					problem("inode %d: block %d already belongs to inode %d", ino, blk, owner[blk]);
+				inode->direct_ptr[i] = -1;
+				idirty[ino / INODES_PER_BLOCK] = 1;
+				continue;
+			}
+			if (owner[blk] == -1)
+				owner[blk] = ino;
+			claims[blk]++;
+			set_bitmap(dbm, blk);
+		}
+	}
+}
+
+/* Reference counts have to match the claims; free blocks are not indexed */
+static int check_refs(void) {
+	int blk, bad = 0;
+
+	for (blk = 0; blk < sb.max_dnum; blk++) {
+		if (dtab[blk].refs != claims[blk]) {
+			problem("block %d: %u references recorded, %u actual", blk, dtab[blk].refs, claims[blk]);
+			dtab[blk].refs = claims[blk];
+			bad = 1;
+		}
+		if (claims[blk] == 0 && dtab[blk].hash != 0) {
+			problem("block %d: free but indexed", blk);
+			dtab[blk].hash = 0;
+			bad = 1;
+		}
+	}
+	return bad;
+}
+
+static void compare_bitmap(const char *what, bitmap_t disk, bitmap_t built, int n) {
+	int i, leaked = 0, lost = 0;
+
+	for (i = 0; i < n; i++) {
+		if (get_bitmap(disk, i) && !get_bitmap(built, i))
+			leaked++;
+		else if (!get_bitmap(disk, i) && get_bitmap(built, i))
+			lost++;
+	}
+	if (leaked)
+		problem("%s bitmap: %d marked used but unreferenced", what, leaked);
+	if (lost)
+		problem("%s bitmap: %d in use but marked free", what, lost);
+}
+
+/* The superblock's free counts have to agree with the rebuilt bitmaps */
+static void check_counter(const char *what, uint32_t *recorded, bitmap_t built, int n) {
+	uint32_t actual = 0;
+	int i;
+
+	for (i = 0; i < n; i++)
+		actual += !get_bitmap(built, i);
+	if (*recorded != actual) {
+		problem("superblock: %u free %s recorded, %u actual", *recorded, what, actual);
+		*recorded = actual;
+	}
+}
+
+/* Per-group counts as well, for images that have groups */
+static void check_groups(bitmap_t ibm, bitmap_t dbm) {
+	struct group_desc gd[TFS_GROUPS];
+	int g;
+
+	if (sb.groups == 0)
+		return;
+	if (sb.groups > TFS_GROUPS) {
+		problem("superblock: %u block groups", sb.groups);
+		sb.groups = TFS_GROUPS;
+	}
+	tfs_group_counts(&sb, ibm, dbm, gd);
+	for (g = 0; g < (int)sb.groups; g++) {
+		if (sb.gd[g].free_inum != gd[g].free_inum || sb.gd[g].free_dnum != gd[g].free_dnum) {
+			problem("group %d: %u free inodes and %u free blocks recorded, %u and %u actual", g,
+				sb.gd[g].free_inum, sb.gd[g].free_dnum, gd[g].free_inum, gd[g].free_dnum);
+			sb.gd[g] = gd[g];
+		}
+	}
+}
+
+/* Pass 4: extents per file and the shape of free space */
+static void report_fragmentation(bitmap_t dbm) {
+	long files = 0, fragmented = 0, extents = 0, used = 0, blocks = 0, remote = 0;
+	long free_blocks = 0, free_extents = 0, largest = 0, run = 0;
+	int ino, i, prev;
+
+	for (ino = 0; ino < sb.max_inum; ino++) {
+		struct inode *inode = &itab[ino];
+		int n = 0;
+
+		if (!inode->valid)
+			continue;
+		used++;
+		if (inode->type != TFS_FILE)
+			continue;
+		prev = -2;
+		for (i = 0; i < 16; i++) {
+			/* holes and unused cluster slots do not break a run */
+			if (inode->direct_ptr[i] < 0)
+				continue;
+			if (inode->direct_ptr[i] != prev + 1)
+				n++;
+			prev = inode->direct_ptr[i];
+			blocks++;
+			if (sb.groups && group_of(sb.max_dnum, sb.groups, prev) != group_of(sb.max_inum, sb.groups, ino))
+				remote++;
+		}
+		files++;
+		extents += n;
+		if (n > 1)
+			fragmented++;
+	}
+	for (i = 0; i <= sb.max_dnum; i++) {
+		if (i < sb.max_dnum && !get_bitmap(dbm, i)) {
+			free_blocks++;
+			run++;
+			continue;
+		}
+		if (run) {
+			free_extents++;
+			if (run > largest)
+				largest = run;
+		}
+		run = 0;
+	}
+	printf("%ld/%u inodes, %ld/%u data blocks in use\n", used, sb.max_inum,
+		(long)sb.max_dnum - free_blocks, sb.max_dnum);
+	printf("files: %ld, fragmented: %ld (%.1f%%), extents per file: %.2f\n", files,
+		fragmented, files ? 100.0 * fragmented / files : 0.0,
+		files ? (double)extents / files : 0.0);
+	printf("free space: %ld blocks in %ld extents, largest %ld blocks\n",
+		free_blocks, free_extents, largest);
+	if (sb.groups)
+		printf("locality: %ld of %ld file blocks outside their inode's group\n", remote, blocks);
+}
+
+static void usage(const char *prog) {
+	fprintf(stderr, "usage: %s [-y] [-v] [-j THREADS] [-u UNIT] IMAGE\n", prog);
+	exit(8);
+}
+
+int main(int argc, char **argv) {
+	bitmap_t disk_ibm, disk_dbm, ibm, dbm;
+	char *buf;
+	int opt, b, dblocks = 0, ddirty = 0, orphans;
+
+	nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	while ((opt = getopt(argc, argv, "yvj:u:h")) != -1) {
+		switch (opt) {
+		case 'y': repair = 1; break;
+		case 'v': verbose = 1; break;
+		case 'j': nthreads = atoi(optarg); break;
+		case 'u': dev_stripe_unit(atoi(optarg)); break;
+		default: usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1 || nthreads < 1)
+		usage(argv[0]);
+	if (dev_open(argv[optind]) < 0)
+		return 8;
+
+	buf = malloc(BLOCK_SIZE);
+	bio_read(0, buf);
+	memcpy(&sb, buf, sizeof(sb));
+	if (sb.magic_num != MAGIC_NUM || sb.max_inum == 0 || sb.max_inum > BLOCK_SIZE * 8 ||
+			sb.max_dnum > BLOCK_SIZE * 8 || sb.d_start_blk < sb.i_start_blk + inode_blocks()) {
+		fprintf(stderr, "tfs_fsck: %s: bad superblock\n", argv[optind]);
+		return 8;
+	}
+	disk_ibm = malloc(BLOCK_SIZE);
+	disk_dbm = malloc(BLOCK_SIZE);
+	ibm = calloc(1, BLOCK_SIZE);
+	dbm = calloc(1, BLOCK_SIZE);
+	bio_read(sb.i_bitmap_blk, disk_ibm);
+	bio_read(sb.d_bitmap_blk, disk_dbm);
+
+	itab = calloc(inode_blocks() * INODES_PER_BLOCK, sizeof(struct inode));
+	idirty = calloc(inode_blocks(), 1);
+	reached = calloc(sb.max_inum, 1);
+	owner = malloc(sb.max_dnum * sizeof(int));
+	memset(owner, 0xff, sb.max_dnum * sizeof(int));
+	claims = calloc(sb.max_dnum, sizeof(uint32_t));
+	queue.ino = malloc(sb.max_inum * sizeof(uint16_t));
+
+	/* The dedup table's own blocks are claimed by the superblock */
+	if (sb.dedup_blk) {
+		dblocks = (sb.max_dnum + DEDUP_PER_BLOCK - 1) / DEDUP_PER_BLOCK;
+		if (sb.dedup_blk < sb.d_start_blk || sb.dedup_blk + dblocks > sb.d_start_blk + sb.max_dnum) {
+			fprintf(stderr, "tfs_fsck: %s: dedup table out of range\n", argv[optind]);
+			return 8;
+		}
+		dtab = malloc(dblocks * BLOCK_SIZE);
+		for (b = 0; b < dblocks; b++) {
+			bio_read(sb.dedup_blk + b, (char *)dtab + b * BLOCK_SIZE);
+			owner[sb.dedup_blk - sb.d_start_blk + b] = -2;
+			claims[sb.dedup_blk - sb.d_start_blk + b] = 1;
+			set_bitmap(dbm, sb.dedup_blk - sb.d_start_blk + b);
+		}
+	}
+
+	run_threads(load_inodes);
+	if (!itab[0].valid || itab[0].type != TFS_DIRECTORY) {
+		fprintf(stderr, "tfs_fsck: %s: root directory is missing\n", argv[optind]);
+		return 8;
+	}
+	reached[0] = 1;
+	enqueue(0);
+	run_threads(walk_tree);
+	orphans = check_orphans();
+	settle_inodes(ibm, dbm);
+	compare_bitmap("inode", disk_ibm, ibm, sb.max_inum);
+	compare_bitmap("data", disk_dbm, dbm, sb.max_dnum);
+	check_counter("inodes", &sb.free_inum, ibm, sb.max_inum);
+	check_counter("data blocks", &sb.free_dnum, dbm, sb.max_dnum);
+	check_groups(ibm, dbm);
+	if (dtab)
+		ddirty = check_refs();
+
+	if (repair && problems) {
+		for (b = 0; b < inode_blocks(); b++) {
+			if (!idirty[b])
+				continue;
+			memcpy(buf, &itab[b * INODES_PER_BLOCK], INODES_PER_BLOCK * sizeof(struct inode));
+			bio_write(sb.i_start_blk + b, buf);
+		}
+		bio_write(sb.i_bitmap_blk, ibm);
+		bio_write(sb.d_bitmap_blk, dbm);
+		for (b = 0; ddirty && b < dblocks; b++)
+			bio_write(sb.dedup_blk + b, (char *)dtab + b * BLOCK_SIZE);
+		bio_read(0, buf);
+		memcpy(buf, &sb, sizeof(sb));
+		bio_write(0, buf);
+	}
+	if (problems > 50 && !verbose)
+		printf("... %lu problems in all (-v lists them)\n", problems);
+	if (orphans)
+		printf("%d unlinked inodes awaiting reclaim\n", orphans);
+	report_fragmentation(dbm);
+	dev_close();
+
+	if (problems == 0)
+		return 0;
+	return repair ? 1 : 4;
+}
@@ -0,0 +1,775 @@
+/*
+ *	Tiny File System
+ *	File:	tfs_ll.c
+ *
+ *	FUSE 3 low-level backend over the TFS core in libtfs.c. The kernel
+ *	hands us inode numbers instead of paths, so no operation here walks
+ *	a path: lookup resolves one name in one directory and everything
+ *	else addresses the inode directly. Lookup counts are tracked per
+ *	inode so forget/forget_multi balance the references the kernel
+ *	holds; a file unlinked while the kernel still has it is kept open
+ *	until its last forget, so its inode is not reused under it.
+ *	Entries and attributes are returned with explicit timeouts so the
+ *	kernel can cache them. tfs_ll_init negotiates large requests, async
+ *	reads and write-back caching.
+ */
+
+#define _GNU_SOURCE
+#define FUSE_USE_VERSION 34
+#include <fuse_lowlevel.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "libtfs.h"
+#include "tfs_bufvec.h"
+
+/* TFS numbers the root directory 0, FUSE numbers it FUSE_ROOT_ID (1) */
+#define TO_FUSE(ino)	((fuse_ino_t)(ino) + 1)
+#define TO_TFS(ino)		((uint16_t)((ino) - 1))
+
+/* Kernel references to one inode */
+struct ll_node {
+	uint64_t	nlookup;		/* lookups not yet balanced by forget */
+	uint64_t	generation;		/* bumped each time the ino is freed */
+	struct tfs_file	*hold;		/* keeps an unlinked file until nlookup drops to 0 */
+};
+
+/* Largest request libfuse 3 can hand us (256 pages) */
+#define TFS_MAX_IO (1024 * 1024)
+
+struct tfs_ll_opts {
+	double		entry_timeout;
+	double		attr_timeout;
+	int			writeback;		/* let the kernel buffer writes */
+	int			keep_cache;		/* keep page cache across opens */
+	int			direct_io;		/* bypass the page cache for every open */
+	unsigned	max_write;
+	unsigned	max_readahead;
+	int			compress;		/* compress file data as it is written */
+	int			dedup;			/* share blocks with identical content */
+	int			delalloc;		/* buffer writes and allocate at writeback */
+	char		*disk;			/* backing file(s), ':' separated to stripe */
+	int			stripe_unit;	/* stripe unit in blocks */
+	int			ram;			/* serve the disk from memory */
+	int			snapshot;		/* seconds between RAM snapshots, 0 for none */
+	int			sealed;			/* read-only image, served without locking */
+	int			defrag;			/* seconds between defrag passes, 0 for none */
+};
+
+#define TFS_LL_OPT(t, p, v) { t, offsetof(struct tfs_ll_opts, p), v }
+static const struct fuse_opt tfs_ll_opt_spec[] = {
+	TFS_LL_OPT("entry_timeout=%lf", entry_timeout, 0),
+	TFS_LL_OPT("attr_timeout=%lf", attr_timeout, 0),
+	TFS_LL_OPT("writeback", writeback, 1),
+	TFS_LL_OPT("no_writeback", writeback, 0),
+	TFS_LL_OPT("keep_cache", keep_cache, 1),
+	TFS_LL_OPT("direct_io", direct_io, 1),
+	TFS_LL_OPT("max_write=%u", max_write, 0),
+	TFS_LL_OPT("max_readahead=%u", max_readahead, 0),
+	TFS_LL_OPT("compress", compress, 1),
+	TFS_LL_OPT("dedup", dedup, 1),
+	TFS_LL_OPT("delalloc", delalloc, 1),
+	TFS_LL_OPT("disk=%s", disk, 0),
+	TFS_LL_OPT("stripe_unit=%d", stripe_unit, 0),
+	TFS_LL_OPT("ram", ram, 1),
+	TFS_LL_OPT("snapshot=%d", snapshot, 0),
+	TFS_LL_OPT("sealed", sealed, 1),
+	TFS_LL_OPT("defrag=%d", defrag, 0),
+	FUSE_OPT_END
+};
+
+static char diskfile_path[PATH_MAX];
+static struct tfs_vol *vol;
+static struct tfs_ll_opts opts = { 1.0, 1.0, 1, 0, 0, TFS_MAX_IO, TFS_MAX_IO, 0, 0, 0, NULL, DEV_STRIPE_UNIT, 0, 0 };
+static struct ll_node nodes[MAX_INUM];
+static pthread_mutex_t nodes_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int valid_ino(fuse_ino_t ino) {
+	return ino >= FUSE_ROOT_ID && ino <= MAX_INUM;
+}
+
+static void ll_stat(const struct inode *inode, struct stat *st) {
+	tfs_inode_stat(inode, st);
+	st->st_ino = TO_FUSE(inode->ino);
+}
+
+/* Fill an entry for inode without taking a lookup reference */
+static void ll_entry(const struct inode *inode, struct fuse_entry_param *e) {
+	memset(e, 0, sizeof(*e));
+	e->ino = TO_FUSE(inode->ino);
+	pthread_mutex_lock(&nodes_lock);
+	e->generation = nodes[inode->ino].generation;
+	pthread_mutex_unlock(&nodes_lock);
+	ll_stat(inode, &e->attr);
+	e->attr_timeout = opts.attr_timeout;
+	e->entry_timeout = opts.entry_timeout;
+}
+
+static void ll_ref(uint16_t ino) {
+	pthread_mutex_lock(&nodes_lock);
+	nodes[ino].nlookup++;
+	pthread_mutex_unlock(&nodes_lock);
+}
+
+static void ll_unref(uint16_t ino, uint64_t n) {
+	struct tfs_file *hold = NULL;
+
+	pthread_mutex_lock(&nodes_lock);
+	nodes[ino].nlookup = n > nodes[ino].nlookup ? 0 : nodes[ino].nlookup - n;
+	if (nodes[ino].nlookup == 0) {
+		hold = nodes[ino].hold;
+		nodes[ino].hold = NULL;
+	}
+	pthread_mutex_unlock(&nodes_lock);
+	/* the core frees an unlinked file on its last close */
+	if (hold != NULL)
+		tfs_file_close(vol, hold);
+}
+
+/*
+ * Open file ino ahead of removing its last entry if the kernel still
+ * refers to it, so the core keeps it as an orphan. NULL if not needed.
+ */
+static struct tfs_file *ll_hold(uint16_t ino) {
+	struct tfs_file *f = NULL;
+	int want;
+
+	pthread_mutex_lock(&nodes_lock);
+	want = nodes[ino].nlookup > 0 && nodes[ino].hold == NULL;
+	pthread_mutex_unlock(&nodes_lock);
+	if (want && tfs_file_open(vol, ino, &f) < 0)
+		f = NULL;
+	return f;
+}
+
+/*
+ * The last entry of ino is gone; a later reuse of the ino must not match
+ * cached kernel entries. hold, from ll_hold, stays open until the last
+ * forget, or is closed now if that has already come.
+ */
+static void ll_retire(uint16_t ino, struct tfs_file *hold) {
+	pthread_mutex_lock(&nodes_lock);
+	nodes[ino].generation++;
+	if (hold != NULL && nodes[ino].nlookup > 0 && nodes[ino].hold == NULL) {
+		nodes[ino].hold = hold;
+		hold = NULL;
+	}
+	pthread_mutex_unlock(&nodes_lock);
+	if (hold != NULL)
+		tfs_file_close(vol, hold);
+}
+
+static void set_cache_flags(struct fuse_file_info *fi) {
+	fi->keep_cache = opts.keep_cache || opts.sealed;
+	fi->direct_io = opts.direct_io || (fi->flags & O_DIRECT);
+}
+
+/* Open files carry a core handle in fi->fh, closed in release */
+#define FH(fi) ((struct tfs_file *)(uintptr_t)(fi)->fh)
+
+static int open_handle(uint16_t ino, struct fuse_file_info *fi) {
+	struct tfs_file *f;
+	int ret = tfs_file_open(vol, ino, &f);
+
+	if (ret == 0) {
+		fi->fh = (uintptr_t)f;
+		set_cache_flags(fi);
+	}
+	return ret;
+}
+
+static void reply_entry(fuse_req_t req, const struct inode *inode) {
+	struct fuse_entry_param e;
+	ll_entry(inode, &e);
+	ll_ref(inode->ino);
+	if (fuse_reply_entry(req, &e) != 0)
+		ll_unref(inode->ino, 1);
+}
+
+static void tfs_ll_init(void *userdata, struct fuse_conn_info *conn) {
+	dev_stripe_unit(opts.stripe_unit);
+	dev_ram(opts.ram);
+	vol = opts.sealed ? tfs_mount_sealed(diskfile_path) : tfs_mount(diskfile_path);
+	if (vol == NULL) {
+		fprintf(stderr, "tfs_ll: cannot mount %s\n", diskfile_path);
+		exit(EXIT_FAILURE);
+	}
+	/* the write-side options mean nothing on a sealed image */
+	if (!opts.sealed) {
+		vol->compress = opts.compress;
+		if (opts.dedup && tfs_vol_dedup(vol) < 0)
+			fprintf(stderr, "tfs_ll: no room for the dedup table, dedup is off\n");
+		if (opts.delalloc && tfs_vol_delalloc(vol) < 0)
+			fprintf(stderr, "tfs_ll: cannot start the flusher, delalloc is off\n");
+		if (opts.ram && opts.snapshot > 0 && tfs_vol_autosnap(vol, opts.snapshot) < 0)
+			fprintf(stderr, "tfs_ll: cannot start the snapshot thread\n");
+		if (opts.defrag > 0 && tfs_vol_autodefrag(vol, opts.defrag) < 0)
+			fprintf(stderr, "tfs_ll: cannot start the defragmenter\n");
+	}
+	if (conn->capable & FUSE_CAP_READDIRPLUS)
+		conn->want |= FUSE_CAP_READDIRPLUS;
+	/* large requests, async reads and kernel write-back buffering */
+	if (conn->capable & FUSE_CAP_ASYNC_READ)
+		conn->want |= FUSE_CAP_ASYNC_READ;
+	if (opts.writeback && (conn->capable & FUSE_CAP_WRITEBACK_CACHE))
+		conn->want |= FUSE_CAP_WRITEBACK_CACHE;
+	conn->max_write = opts.max_write < TFS_MAX_IO ? opts.max_write : TFS_MAX_IO;
+	if (opts.max_readahead < conn->max_readahead)
+		conn->max_readahead = opts.max_readahead;
+	/* splice file data to and from /dev/fuse where the kernel allows it */
+	conn->want |= conn->capable & (FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE);
+	nodes[0].nlookup = 1;	/* the root is implicitly referenced */
+}
+
+static void tfs_ll_destroy(void *userdata) {
+	int i;
+
+	for (i = 0; i < MAX_INUM; i++) {
+		if (nodes[i].hold != NULL) {
+			tfs_file_close(vol, nodes[i].hold);
+			nodes[i].hold = NULL;
+		}
+	}
+	tfs_unmount(vol);
+	vol = NULL;
+}
+
+static void tfs_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
+	struct inode inode;
+	int ret;
+
+	if (!valid_ino(parent)) {
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
+	ret = tfs_vol_lookupat(vol, TO_TFS(parent), name, &inode);
+	if (ret == -ENOENT) {
+		/* negative entry, cached by the kernel for entry_timeout */
+		struct fuse_entry_param e;
+		memset(&e, 0, sizeof(e));
+		e.entry_timeout = opts.entry_timeout;
+		fuse_reply_entry(req, &e);
+		return;
+	}
+	if (ret < 0) {
+		fuse_reply_err(req, -ret);
+		return;
+	}
+	reply_entry(req, &inode);
+}
+
+static void tfs_ll_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup) {
+	if (valid_ino(ino))
+		ll_unref(TO_TFS(ino), nlookup);
+	fuse_reply_none(req);
+}
+
+static void tfs_ll_forget_multi(fuse_req_t req, size_t count, struct fuse_forget_data *forgets) {
+	size_t i;
+
+	for (i = 0; i < count; i++) {
+		if (valid_ino(forgets[i].ino))
+			ll_unref(TO_TFS(forgets[i].ino), forgets[i].nlookup);
+	}
+	fuse_reply_none(req);
+}
+
+static void tfs_ll_statfs(fuse_req_t req, fuse_ino_t ino) {
+	struct statvfs st;
+
+	tfs_vol_statfs(vol, &st);
+	fuse_reply_statfs(req, &st);
+}
+
+static void tfs_ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+	struct inode inode;
+	struct stat st;
+	int ret;
+
+	if (!valid_ino(ino)) {
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
+	if ((ret = tfs_vol_getinode(vol, TO_TFS(ino), &inode)) < 0) {
+		fuse_reply_err(req, -ret);
+		return;
+	}
+	ll_stat(&inode, &st);
+	fuse_reply_attr(req, &st, opts.attr_timeout);
+}
+
+/* Only the size can be set; other attributes are reported as they are */
+static void tfs_ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, struct fuse_file_info *fi) {
+	int ret;
+
+	if (!valid_ino(ino)) {
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
+	if ((to_set & FUSE_SET_ATTR_SIZE) &&
+			(ret = tfs_vol_truncate(vol, TO_TFS(ino), attr->st_size)) < 0) {
+		fuse_reply_err(req, -ret);
+		return;
+	}
+	tfs_ll_getattr(req, ino, fi);
+}
+
+static void tfs_ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode) {
+	struct inode inode;
+	uint16_t ino;
+	int ret;
+
+	if (!valid_ino(parent)) {
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
+	if ((ret = tfs_vol_mkdirat(vol, TO_TFS(parent), name, mode, &ino)) < 0 ||
+			(ret = tfs_vol_getinode(vol, ino, &inode)) < 0) {
+		fuse_reply_err(req, -ret);
+		return;
+	}
+	reply_entry(req, &inode);
+}
+
+static void tfs_ll_create(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, struct fuse_file_info *fi) {
+	struct fuse_entry_param e;
+	struct inode inode;
+	uint16_t ino;
+	int ret;
+
+	if (!valid_ino(parent)) {
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
+	if ((ret = tfs_vol_createat(vol, TO_TFS(parent), name, mode, &ino)) < 0 ||
+			(ret = tfs_vol_getinode(vol, ino, &inode)) < 0) {
+		fuse_reply_err(req, -ret);
+		return;
+	}
+	if ((ret = open_handle(ino, fi)) < 0) {
+		fuse_reply_err(req, -ret);
+		return;
+	}
+	ll_entry(&inode, &e);
+	ll_ref(inode.ino);
+	if (fuse_reply_create(req, &e, fi) != 0) {
+		ll_unref(inode.ino, 1);
+		tfs_file_close(vol, FH(fi));
+	}
+}
+
+static void remove_entry(fuse_req_t req, fuse_ino_t parent, const char *name, int is_dir) {
+	struct tfs_file *hold;
+	struct inode inode;
+	int ret;
+
+	if (!valid_ino(parent)) {
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
+	if ((ret = tfs_vol_lookupat(vol, TO_TFS(parent), name, &inode)) < 0) {
+		fuse_reply_err(req, -ret);
+		return;
+	}
+	hold = is_dir ? NULL : ll_hold(inode.ino);
+	if (is_dir)
+		ret = tfs_vol_rmdirat(vol, TO_TFS(parent), name);
+	else
+		ret = tfs_vol_unlinkat(vol, TO_TFS(parent), name);
+	if (ret == 0)
+		ll_retire(inode.ino, hold);
+	else if (hold != NULL)
+		tfs_file_close(vol, hold);
+	fuse_reply_err(req, -ret);
+}
+
+static void tfs_ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name) {
+	remove_entry(req, parent, name, 0);
+}
+
+static void tfs_ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name) {
+	remove_entry(req, parent, name, 1);
+}
+
+/* Move an entry; an inode it replaces is freed and retired like unlink's */
+static void tfs_ll_rename(fuse_req_t req, fuse_ino_t parent, const char *name, fuse_ino_t newparent,
+		const char *newname, unsigned int flags) {
+	struct tfs_file *hold = NULL;
+	struct inode src, dst;
+	int ret, replaced;
+
+	if (!valid_ino(parent) || !valid_ino(newparent)) {
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
+	if ((ret = tfs_vol_lookupat(vol, TO_TFS(parent), name, &src)) < 0) {
+		fuse_reply_err(req, -ret);
+		return;
+	}
+	replaced = tfs_vol_lookupat(vol, TO_TFS(newparent), newname, &dst) == 0 && dst.ino != src.ino;
+	if (replaced && dst.type != TFS_DIRECTORY)
+		hold = ll_hold(dst.ino);
+	ret = tfs_vol_renameat(vol, TO_TFS(parent), name, TO_TFS(newparent), newname, flags);
+	if (ret == 0 && replaced)
+		ll_retire(dst.ino, hold);
+	else if (hold != NULL)
+		tfs_file_close(vol, hold);
+	fuse_reply_err(req, -ret);
+}
+
+static void tfs_ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+	struct inode inode;
+	int ret;
+
+	if (!valid_ino(ino)) {
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
+	if ((ret = tfs_vol_getinode(vol, TO_TFS(ino), &inode)) < 0) {
+		fuse_reply_err(req, -ret);
+		return;
+	}
+	if (inode.type == TFS_DIRECTORY) {
+		fuse_reply_err(req, EISDIR);
+		return;
+	}
+	if ((ret = open_handle(inode.ino, fi)) < 0) {
+		fuse_reply_err(req, -ret);
+		return;
+	}
+	if (fuse_reply_open(req, fi) != 0)
+		tfs_file_close(vol, FH(fi));
+}
+
+static void tfs_ll_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+	struct inode inode;
+	int ret;
+
+	if (!valid_ino(ino)) {
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
+	if ((ret = tfs_vol_getinode(vol, TO_TFS(ino), &inode)) < 0) {
+		fuse_reply_err(req, -ret);
+		return;
+	}
+	if (inode.type != TFS_DIRECTORY) {
+		fuse_reply_err(req, ENOTDIR);
+		return;
+	}
+	fuse_reply_open(req, fi);
+}
+
+static void tfs_ll_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+	fuse_reply_err(req, 0);
+}
+
+static void tfs_ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi) {
+	int ret = tfs_file_sync(vol, FH(fi));
+
+	/* a RAM disk only reaches its image file through a snapshot */
+	if (ret == 0 && opts.ram)
+		ret = tfs_vol_snapshot(vol);
+	fuse_reply_err(req, -ret);
+}
+
+static void tfs_ll_fallocate(fuse_req_t req, fuse_ino_t ino, int mode, off_t offset, off_t length, struct fuse_file_info *fi) {
+	fuse_reply_err(req, -tfs_vol_fallocate(vol, FH(fi)->ino, mode, offset, length));
+}
+
+static void tfs_ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+	tfs_file_close(vol, FH(fi));
+	fuse_reply_err(req, 0);
+}
+
+/* Data moves as a bufvec so whole blocks can be spliced, see tfs_bufvec.h */
+static void tfs_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi) {
+	struct tfs_file *f = FH(fi);
+	struct fuse_bufvec *bv;
+	struct inode inode;
+	int ret;
+
+	if ((ret = tfs_vol_getinode(vol, f->ino, &inode)) < 0) {
+		fuse_reply_err(req, -ret);
+		return;
+	}
+	bv = tfs_bufvec_read(vol, &inode, size, off, &ret);
+	if (bv == NULL) {
+		fuse_reply_err(req, -ret);
+		return;
+	}
+	tfs_file_note(f, off, fuse_buf_size(bv));
+	fuse_reply_data(req, bv, FUSE_BUF_SPLICE_MOVE);
+	tfs_bufvec_free(bv);
+}
+
+static void tfs_ll_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *bufv, off_t off, struct fuse_file_info *fi) {
+	struct tfs_file *f = FH(fi);
+	int ret;
+
+	ret = tfs_bufvec_write(vol, f->ino, bufv, off);
+	if (ret < 0) {
+		fuse_reply_err(req, -ret);
+		return;
+	}
+	tfs_file_note(f, off, ret);
+	fuse_reply_write(req, ret);
+}
+
+/*
+ * Reflink copies. FICLONE never reaches a FUSE daemon (the kernel
+ * handles it and FUSE has no remap_file_range), but copy_file_range
+ * does, and that is what cp uses. Copying a whole file over the start
+ * of one no longer than it is the same as cloning it, so that case
+ * shares the blocks; anything else goes back to the kernel, which
+ * falls back to copying the data itself.
+ */
+static void tfs_ll_copy_file_range(fuse_req_t req, fuse_ino_t ino_in, off_t off_in, struct fuse_file_info *fi_in,
+		fuse_ino_t ino_out, off_t off_out, struct fuse_file_info *fi_out, size_t len, int flags) {
+	struct inode src, dst;
+	int ret;
+
+	if (!valid_ino(ino_in) || !valid_ino(ino_out)) {
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
+	if ((ret = tfs_vol_getinode(vol, TO_TFS(ino_in), &src)) < 0 ||
+			(ret = tfs_vol_getinode(vol, TO_TFS(ino_out), &dst)) < 0) {
+		fuse_reply_err(req, -ret);
+		return;
+	}
+	if (flags != 0 || off_in != 0 || off_out != 0 || len < src.size || dst.size > src.size) {
+		fuse_reply_err(req, EOPNOTSUPP);
+		return;
+	}
+	if ((ret = tfs_vol_clone(vol, src.ino, dst.ino)) < 0) {
+		fuse_reply_err(req, -ret);
+		return;
+	}
+	fuse_reply_write(req, src.size);
+}
+
+/*
+ * readdir and readdirplus: the core's readdir holds the volume lock
+ * while it calls back, so collect the entries first and build the
+ * reply (which for readdirplus needs each entry's inode) afterwards.
+ */
+struct ll_dirent {
+	char		name[sizeof(((struct dirent *)0)->name)];
+	uint16_t	ino;
+};
+
+struct ll_dirlist {
+	struct ll_dirent	*ents;
+	size_t				n, cap;
+};
+
+static int collect(void *ctx, const char *name, uint16_t ino) {
+	struct ll_dirlist *dl = ctx;
+	if (dl->n == dl->cap) {
+		dl->cap = dl->cap ? dl->cap * 2 : 32;
+		dl->ents = realloc(dl->ents, dl->cap * sizeof(struct ll_dirent));
+	}
+	strncpy(dl->ents[dl->n].name, name, sizeof(dl->ents[dl->n].name) - 1);
+	dl->ents[dl->n].name[sizeof(dl->ents[dl->n].name) - 1] = '\0';
+	dl->ents[dl->n].ino = ino;
+	dl->n++;
+	return 0;
+}
+
+static int is_dot(const char *name) {
+	return strcmp(name, ".") == 0 || strcmp(name, "..") == 0;
+}
+
+static void do_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, int plus) {
+	struct ll_dirlist dl = { NULL, 0, 0 };
+	size_t used = 0, i;
+	char *buf;
+	int ret;
+
+	if (!valid_ino(ino)) {
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
+	if ((ret = tfs_vol_readdir(vol, TO_TFS(ino), collect, &dl)) < 0) {
+		fuse_reply_err(req, -ret);
+		return;
+	}
+	buf = malloc(size);
+	for (i = off; i < dl.n; i++) {
+		struct ll_dirent *d = &dl.ents[i];
+		size_t len;
+
+		if (plus) {
+			struct fuse_entry_param e;
+			struct inode inode;
+
+			if (is_dot(d->name)) {
+				memset(&e, 0, sizeof(e));
+				e.attr.st_ino = TO_FUSE(d->ino);
+				e.attr.st_mode = S_IFDIR;
+			} else if (tfs_vol_getinode(vol, d->ino, &inode) < 0) {
+				continue;
+			} else {
+				ll_entry(&inode, &e);
+			}
+			len = fuse_add_direntry_plus(req, buf + used, size - used, d->name, &e, i + 1);
+			if (len > size - used)
+				break;
+			if (!is_dot(d->name))
+				ll_ref(d->ino);
+		} else {
+			struct stat st;
+
+			memset(&st, 0, sizeof(st));
+			st.st_ino = TO_FUSE(d->ino);
+			len = fuse_add_direntry(req, buf + used, size - used, d->name, &st, i + 1);
+			if (len > size - used)
+				break;
+		}
+		used += len;
+	}
+	fuse_reply_buf(req, buf, used);
+	free(buf);
+	free(dl.ents);
+}
+
+static void tfs_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi) {
+	do_readdir(req, ino, size, off, 0);
+}
+
+static void tfs_ll_readdirplus(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi) {
+	do_readdir(req, ino, size, off, 1);
+}
+
+static const struct fuse_lowlevel_ops tfs_ll_ope = {
+	.init			= tfs_ll_init,
+	.destroy		= tfs_ll_destroy,
+	.lookup			= tfs_ll_lookup,
+	.forget			= tfs_ll_forget,
+	.forget_multi	= tfs_ll_forget_multi,
+	.getattr		= tfs_ll_getattr,
+	.statfs			= tfs_ll_statfs,
+	.setattr		= tfs_ll_setattr,
+
+	.opendir		= tfs_ll_opendir,
+	.readdir		= tfs_ll_readdir,
+	.readdirplus	= tfs_ll_readdirplus,
+	.releasedir		= tfs_ll_flush,
+	.mkdir			= tfs_ll_mkdir,
+	.rmdir			= tfs_ll_rmdir,
+	.rename			= tfs_ll_rename,
+
+	.create			= tfs_ll_create,
+	.open			= tfs_ll_open,
+	.read			= tfs_ll_read,
+	.write_buf		= tfs_ll_write_buf,
+	.copy_file_range	= tfs_ll_copy_file_range,
+	.fallocate		= tfs_ll_fallocate,
+	.unlink			= tfs_ll_unlink,
+	.flush			= tfs_ll_flush,
+	.fsync			= tfs_ll_fsync,
+	.release		= tfs_ll_release,
+};
+
+/* Set diskfile_path to spec with every member made absolute: daemonizing chdirs to / */
+static void set_disk(const char *spec) {
+	char cwd[PATH_MAX], *list = strdup(spec), *save, *member;
+	size_t len = 0;
+
+	getcwd(cwd, PATH_MAX);
+	diskfile_path[0] = '\0';
+	for (member = strtok_r(list, ":", &save); member != NULL; member = strtok_r(NULL, ":", &save)) {
+		len += snprintf(diskfile_path + len, PATH_MAX - len, "%s%s%s%s", len ? ":" : "",
+			member[0] == '/' ? "" : cwd, member[0] == '/' ? "" : "/", member);
+		if (len >= PATH_MAX) {
+			fprintf(stderr, "tfs_ll: disk path too long\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	free(list);
+}
+
+int main(int argc, char *argv[]) {
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	struct fuse_cmdline_opts cmd;
+	struct fuse_loop_config config;
+	struct fuse_session *se;
+	int ret = 1;
+
+	if (fuse_parse_cmdline(&args, &cmd) != 0)
+		return 1;
+	if (cmd.show_help) {
+		printf("usage: %s [options] <mountpoint>\n\n", argv[0]);
+		printf("    -o entry_timeout=T     cache name lookups for T seconds (1.0)\n"
+			"    -o attr_timeout=T      cache attributes for T seconds (1.0)\n"
+			"    -o [no_]writeback      kernel write-back caching (on)\n"
+			"    -o keep_cache          keep cached file data across opens\n"
+			"    -o direct_io           bypass the page cache (always on for O_DIRECT opens)\n"
+			"    -o max_write=N         largest write request (%d)\n"
+			"    -o max_readahead=N     largest readahead (%d)\n"
+			"    -o compress            compress file data as it is written\n"
+			"    -o dedup               share blocks with identical content\n"
+			"    -o delalloc            buffer writes, allocate blocks at writeback\n"
+			"    -o disk=FILE[:FILE...] backing file, or files to stripe over (./DISKFILE)\n"
+			"    -o stripe_unit=N       blocks per stripe on each file (%d)\n"
+			"    -o ram                 keep the disk in memory, written back by snapshots\n"
+			"                           (on fsync, at unmount and every -o snapshot=SECS)\n"
+			"    -o sealed              mount the image read-only and serve it without locking\n"
+			"    -o defrag=SECS         defragment the most fragmented files every SECS seconds\n",
+			TFS_MAX_IO, TFS_MAX_IO, DEV_STRIPE_UNIT);
+		fuse_cmdline_help();
+		fuse_lowlevel_help();
+		ret = 0;
+		goto out1;
+	} else if (cmd.show_version) {
+		fuse_lowlevel_version();
+		ret = 0;
+		goto out1;
+	}
+	if (cmd.mountpoint == NULL) {
+		fprintf(stderr, "usage: %s [options] <mountpoint>\n", argv[0]);
+		goto out1;
+	}
+	if (fuse_opt_parse(&args, &opts, tfs_ll_opt_spec, NULL) == -1)
+		goto out1;
+	set_disk(opts.disk ? opts.disk : "DISKFILE");
+	/* a sealed image is read-only to the kernel as well */
+	if (opts.sealed)
+		fuse_opt_add_arg(&args, "-oro");
+
+	se = fuse_session_new(&args, &tfs_ll_ope, sizeof(tfs_ll_ope), NULL);
+	if (se == NULL)
+		goto out1;
+	if (fuse_set_signal_handlers(se) != 0)
+		goto out2;
+	if (fuse_session_mount(se, cmd.mountpoint) != 0)
+		goto out3;
+
+	fuse_daemonize(cmd.foreground);
+	if (cmd.singlethread) {
+		ret = fuse_session_loop(se);
+	} else {
+		config.clone_fd = cmd.clone_fd;
+		config.max_idle_threads = cmd.max_idle_threads;
+		ret = fuse_session_loop_mt(se, &config);
+	}
+
+	fuse_session_unmount(se);
+out3:
+	fuse_remove_signal_handlers(se);
+out2:
+	fuse_session_destroy(se);
+out1:
+	free(cmd.mountpoint);
+	fuse_opt_free_args(&args);
+	return ret ? 1 : 0;
+}
@@ -0,0 +1,156 @@
+/*
+ *	Tiny File System
+ *	File:	tfs_lz.c
+ *
+ *	LZ77 codec for compressed clusters, see tfs_lz.h.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "tfs_lz.h"
+
+#define LZ_MINMATCH		4
+#define LZ_HASH_BITS	12
+#define LZ_MAX_OFFSET	65535
+
+static uint32_t read32(const uint8_t *p) {
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static unsigned hash4(uint32_t v) {
+	return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+/* Write a length continuation: runs of 255 and a final byte below 255 */
+static int put_len(uint8_t **op, uint8_t *oend, int n) {
+	for (; n >= 255; n -= 255) {
+		if (*op >= oend)
+			return -1;
+		*(*op)++ = 255;
+	}
+	if (*op >= oend)
+		return -1;
+	*(*op)++ = n;
+	return 0;
+}
+
+/* Emit one sequence; mlen 0 marks the final literals-only sequence */
+static int put_seq(uint8_t **op, uint8_t *oend, const uint8_t *lit, int nlit, int off, int mlen) {
+	int ml = mlen ? mlen - LZ_MINMATCH : 0;
+
+	if (*op >= oend)
+		return -1;
+	*(*op)++ = (nlit < 15 ? nlit : 15) << 4 | (ml < 15 ? ml : 15);
+	if (nlit >= 15 && put_len(op, oend, nlit - 15) < 0)
+		return -1;
+	if (nlit > oend - *op)
+		return -1;
+	memcpy(*op, lit, nlit);
+	*op += nlit;
+	if (mlen == 0)
+		return 0;
+	if (oend - *op < 2)
+		return -1;
+	*(*op)++ = off & 0xff;
+	*(*op)++ = off >> 8;
+	if (ml >= 15 && put_len(op, oend, ml - 15) < 0)
+		return -1;
+	return 0;
+}
+
+int tfs_lz_compress(const void *src, int len, void *dst, int cap) {
+	const uint8_t *in = src, *ip = in, *anchor = in, *end = in + len;
+	uint8_t *op = dst, *oend = op + cap;
+	int table[1 << LZ_HASH_BITS];
+
+	memset(table, 0xff, sizeof(table));
+	while (end - ip >= LZ_MINMATCH) {
+		uint32_t v = read32(ip);
+		unsigned h = hash4(v);
+		int ref = table[h];
+		const uint8_t *m, *p;
+
+		table[h] = ip - in;
+		if (ref < 0 || (ip - in) - ref > LZ_MAX_OFFSET || read32(in + ref) != v) {
+			ip++;
+			continue;
+		}
+		m = in + ref + LZ_MINMATCH;
+		p = ip + LZ_MINMATCH;
+		while (p < end && *p == *m) {
+			p++;
+			m++;
+		}
+		if (put_seq(&op, oend, anchor, ip - anchor, (ip - in) - ref, p - ip) < 0)
+			return 0;
+		ip = anchor = p;
+	}
+	if (put_seq(&op, oend, anchor, end - anchor, 0, 0) < 0)
+		return 0;
+	return op - (uint8_t *)dst;
+}
+
+/* Read a length continuation, -1 if it runs off the input */
+static int get_len(const uint8_t **ip, const uint8_t *iend) {
+	int n = 0, b;
+
+	do {
+		if (*ip >= iend)
+			return -1;
+		b = *(*ip)++;
+		n += b;
+	} while (b == 255);
+	return n;
+}
+
+int tfs_lz_decompress(const void *src, int len, void *dst, int cap) {
+	const uint8_t *ip = src, *iend = ip + len;
+	uint8_t *out = dst, *op = out, *oend = out + cap;
+
+	while (ip < iend) {
+		int token = *ip++, nlit = token >> 4, ml = token & 15, off, n;
+		const uint8_t *m;
+
+		if (nlit == 15) {
+			if ((n = get_len(&ip, iend)) < 0)
+				return -1;
+			nlit += n;
+		}
+		if (nlit > iend - ip || nlit > oend - op)
+			return -1;
+		memcpy(op, ip, nlit);
+		op += nlit;
+		ip += nlit;
+		if (ip == iend)
+			break;
+
+		if (iend - ip < 2)
+			return -1;
+		off = ip[0] | ip[1] << 8;
+		ip += 2;
+		if (off == 0 || off > op - out)
+			return -1;
+		if (ml == 15) {
+			if ((n = get_len(&ip, iend)) < 0)
+				return -1;
+			ml += n;
+		}
+		ml += LZ_MINMATCH;
+		if (ml > oend - op)
+			return -1;
+		/*
+		 * The match may overlap what it produces. Copying op - m bytes
+		 * at a time never overlaps and keeps the period intact, and the
+		 * chunk doubles every round, so short offsets stay cheap.
+		 */
+		for (m = op - off; ml > 0; ml -= n) {
+			n = op - m < ml ? op - m : ml;
+			memcpy(op, m, n);
+			op += n;
+		}
+	}
+	return op - out;
+}
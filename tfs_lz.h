@@ -0,0 +1,25 @@
+/*
+ *	Tiny File System
+ *	File:	tfs_lz.h
+ *
+ *	Small LZ77 codec used for compressed clusters, in the LZ4 block
+ *	style: each sequence is a token (literal and match length nibbles),
+ *	the literals, and a 16-bit match offset. Tuned for speed over ratio.
+ */
+
+#ifndef _TFS_LZ_H
+#define _TFS_LZ_H
+
+/*
+ * Compress len bytes of src into dst. Returns the compressed length, or
+ * 0 if it would not fit in cap bytes (the data is incompressible).
+ */
+int tfs_lz_compress(const void *src, int len, void *dst, int cap);
+
+/*
+ * Decompress len bytes of src into at most cap bytes of dst. Returns
+ * the decompressed length, or -1 if the input is malformed.
+ */
+int tfs_lz_decompress(const void *src, int len, void *dst, int cap);
+
+#endif
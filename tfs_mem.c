@@ -0,0 +1,171 @@
+/*
+ *	Tiny File System
+ *	File:	tfs_mem.c
+ *
+ *	Per-thread slab caches and scratch arena, see tfs_mem.h.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "block.h"
+#include "tfs.h"
+#include "tfs_mem.h"
+
+#define SCRATCH_ALIGN	16
+
+/* A free slab object is linked through its first word */
+struct slab_obj {
+	struct slab_obj		*next;
+};
+
+struct slab_list {
+	struct slab_obj		*head;
+	int					count;
+};
+
+/* One arena chunk; the arena is a list of them, filled front to back */
+struct chunk {
+	struct chunk		*next;
+	size_t				size;
+	size_t				used;
+	char				*data;
+};
+
+static const size_t slab_size[SLAB_KINDS] = {
+	[SLAB_BLOCK]	= BLOCK_SIZE,
+	[SLAB_INODE]	= sizeof(struct inode),
+	[SLAB_DIRENT]	= sizeof(struct dirent),
+};
+
+static __thread struct slab_list slabs[SLAB_KINDS];
+static __thread struct chunk *arena, *arena_cur;
+static __thread int registered;
+
+static pthread_key_t exit_key;
+static pthread_once_t exit_once = PTHREAD_ONCE_INIT;
+
+/* Thread exit: give the thread's cached objects and arena back to malloc */
+static void thread_release(void *unused) {
+	struct slab_obj *o;
+	struct chunk *c;
+	int k;
+
+	(void)unused;
+	for (k = 0; k < SLAB_KINDS; k++) {
+		while ((o = slabs[k].head) != NULL) {
+			slabs[k].head = o->next;
+			free(o);
+		}
+		slabs[k].count = 0;
+	}
+	while ((c = arena) != NULL) {
+		arena = c->next;
+		free(c);
+	}
+	arena_cur = NULL;
+}
+
+static void make_key(void) {
+	pthread_key_create(&exit_key, thread_release);
+}
+
+/* The key's destructor only runs for threads that set a value */
+static void thread_register(void) {
+	if (registered)
+		return;
+	pthread_once(&exit_once, make_key);
+	pthread_setspecific(exit_key, &registered);
+	registered = 1;
+}
+
+void *slab_alloc(enum tfs_slab kind) {
+	struct slab_list *l = &slabs[kind];
+	struct slab_obj *o = l->head;
+
+	if (o == NULL)
+		return malloc(slab_size[kind]);
+	l->head = o->next;
+	l->count--;
+	return o;
+}
+
+void *slab_zalloc(enum tfs_slab kind) {
+	void *p = slab_alloc(kind);
+
+	if (p != NULL)
+		memset(p, 0, slab_size[kind]);
+	return p;
+}
+
+void slab_free(enum tfs_slab kind, void *p) {
+	struct slab_list *l = &slabs[kind];
+	struct slab_obj *o = p;
+
+	if (p == NULL)
+		return;
+	if (l->count >= SLAB_KEEP) {
+		free(p);
+		return;
+	}
+	thread_register();
+	o->next = l->head;
+	l->head = o;
+	l->count++;
+}
+
+/*
+ * Chunks stay on the thread's list after a reset, so the arena grows to
+ * the largest single operation's needs and then stops allocating.
+ */
+void *scratch_alloc(size_t size) {
+	struct chunk *c = arena_cur;
+	size_t cap;
+
+	size = (size + SCRATCH_ALIGN - 1) & ~(size_t)(SCRATCH_ALIGN - 1);
+	if (c != NULL && c->size - c->used < size) {
+		/* chunks past the current one are empty; take the first that fits */
+		while ((c = c->next) != NULL && c->size < size)
+			;
+	}
+	if (c == NULL) {
+		cap = size > SCRATCH_CHUNK ? size : SCRATCH_CHUNK;
+		if ((c = malloc(sizeof(struct chunk) + SCRATCH_ALIGN + cap)) == NULL)
+			return NULL;
+		thread_register();
+		c->data = (char *)(((uintptr_t)(c + 1) + SCRATCH_ALIGN - 1) & ~(uintptr_t)(SCRATCH_ALIGN - 1));
+		c->size = cap;
+		c->used = 0;
+		if (arena_cur == NULL) {
+			c->next = arena;
+			arena = c;
+		} else {
+			c->next = arena_cur->next;
+			arena_cur->next = c;
+		}
+	}
+	arena_cur = c;
+	c->used += size;
+	return c->data + c->used - size;
+}
+
+char *scratch_strdup(const char *s) {
+	size_t len = strlen(s) + 1;
+	char *p = scratch_alloc(len);
+
+	if (p != NULL)
+		memcpy(p, s, len);
+	return p;
+}
+
+void scratch_reset(void) {
+	struct chunk *c;
+
+	for (c = arena; c != NULL && c != arena_cur; c = c->next)
+		c->used = 0;
+	if (c != NULL)
+		c->used = 0;
+	arena_cur = arena;
+}
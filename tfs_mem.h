@@ -0,0 +1,45 @@
+/*
+ *	Tiny File System
+ *	File:	tfs_mem.h
+ *
+ *	Allocators for the core's temporaries, so the per-operation paths
+ *	do no general-purpose malloc once a thread has warmed up.
+ *
+ *	Fixed-size objects (block buffers, inodes, directory entries) come
+ *	from per-thread slab caches: a freed object goes on its thread's
+ *	free list for that size and is handed out again by the next
+ *	slab_alloc. Each list keeps at most SLAB_KEEP objects; the rest go
+ *	back to malloc, and a thread's lists are released when it exits.
+ *
+ *	Variable-sized scratch (path copies, cluster buffers) comes from a
+ *	per-thread arena. It is never freed piecemeal: scratch_reset empties
+ *	the arena, which the core does when an operation ends, so scratch
+ *	memory must not be kept past the tfs_vol_* call that allocated it.
+ */
+
+#ifndef _TFS_MEM_H
+#define _TFS_MEM_H
+
+#include <stddef.h>
+
+enum tfs_slab {
+	SLAB_BLOCK,		/* BLOCK_SIZE buffers */
+	SLAB_INODE,		/* struct inode */
+	SLAB_DIRENT,	/* struct dirent */
+	SLAB_KINDS
+};
+
+/* Objects kept on each per-thread free list */
+#define SLAB_KEEP		64
+/* Arena chunk size; larger requests get a chunk of their own */
+#define SCRATCH_CHUNK	(64 * 1024)
+
+void *slab_alloc(enum tfs_slab kind);
+void *slab_zalloc(enum tfs_slab kind);
+void slab_free(enum tfs_slab kind, void *p);
+
+void *scratch_alloc(size_t size);
+char *scratch_strdup(const char *s);
+void scratch_reset(void);
+
+#endif
@@ -0,0 +1,309 @@
+/*
+ *	Tiny File System
+ *	File:	tfs_mkimage.c
+ *
+ *	Offline image builder: runs tfs_mkfs and fills the new image with a
+ *	copy of a host directory tree without going through FUSE or the
+ *	per-block core paths.
+ *
+ *	The tree is read breadth first with every directory's entries
+ *	sorted, and inode numbers are handed out in that order, so each
+ *	directory's children have consecutive inodes. Data blocks are laid
+ *	out in the same order: a directory's entry blocks are followed by the
+ *	data of the files after it, each file contiguous, and the first node
+ *	of each block group starts at the beginning of that group's data, so
+ *	every file's data sits in its inode's group. The inode table and the
+ *	data region are then written as large sequential writes (split
+ *	across the members of a striped disk), and the bitmaps and
+ *	superblock last.
+ *
+ *	Only regular files and directories are copied; anything else is
+ *	skipped with a warning. A tree that does not fit TFS limits (file
+ *	size, entries per directory, name length, inode or block count) is
+ *	an error, and the image is not populated.
+ *
+ *	IMAGE may be a ':' separated list of member files to stripe over,
+ *	with -u giving the stripe unit in blocks.
+ *
+ *	usage: tfs_mkimage [-v] [-u UNIT] SRCDIR IMAGE
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+
+/* The host's struct dirent clashes with the TFS one; rename it here */
+#define dirent host_dirent
+#include <dirent.h>
+#undef dirent
+
+#include "libtfs.h"
+
+/* Largest write handed to the image at once */
+#define STREAM_SIZE (1024 * 1024)
+
+#define MAX_FILE_BLOCKS 16
+#define MAX_DIR_ENTRIES (MAX_FILE_BLOCKS * DIRENTS_PER_BLOCK)
+
+struct node {
+	char		*path;		/* host path */
+	char		*name;		/* entry name in the parent */
+	int			first;		/* first child (directories), children are consecutive */
+	int			count;		/* number of children */
+	struct stat	st;
+};
+
+static struct node nodes[MAX_INUM];
+static int nnodes, verbose;
+
+/* Sequential writer over the image's blocks, flushing in STREAM_SIZE pieces */
+struct stream {
+	int		blk;	/* block the buffer starts at */
+	char	*buf;
+	size_t	len;
+};
+
+/* Write len bytes (whole blocks) at block blk */
+static void write_blocks(int blk, char *buf, size_t len) {
+	void *bufs[STREAM_SIZE / BLOCK_SIZE];
+	size_t i, n;
+
+	while (len > 0) {
+		n = len < STREAM_SIZE ? len / BLOCK_SIZE : STREAM_SIZE / BLOCK_SIZE;
+		for (i = 0; i < n; i++)
+			bufs[i] = buf + i * BLOCK_SIZE;
+		if (bio_writev(blk, bufs, n) != (int)(n * BLOCK_SIZE)) {
+			perror("tfs_mkimage: write");
+			exit(1);
+		}
+		blk += n;
+		buf += n * BLOCK_SIZE;
+		len -= n * BLOCK_SIZE;
+	}
+}
+
+static void stream_flush(struct stream *w) {
+	write_blocks(w->blk, w->buf, w->len);
+	w->blk += w->len / BLOCK_SIZE;
+	w->len = 0;
+}
+
+/* Make room for size bytes in the buffer and return where they go */
+static char *stream_reserve(struct stream *w, size_t size) {
+	char *p;
+
+	if (w->len + size > STREAM_SIZE)
+		stream_flush(w);
+	p = w->buf + w->len;
+	memset(p, 0, size);
+	w->len += size;
+	return p;
+}
+
+/* Continue the stream at block blk, leaving what lies between untouched */
+static void stream_seek(struct stream *w, int blk) {
+	if (w->blk + (int)(w->len / BLOCK_SIZE) == blk)
+		return;
+	stream_flush(w);
+	w->blk = blk;
+}
+
+static void die(const char *path, const char *why) {
+	fprintf(stderr, "tfs_mkimage: %s: %s\n", path, why);
+	exit(1);
+}
+
+static int skip_dot(const struct host_dirent *d) {
+	return strcmp(d->d_name, ".") != 0 && strcmp(d->d_name, "..") != 0;
+}
+
+static int add_node(const char *parent, const char *name) {
+	struct node *n;
+
+	if (nnodes == MAX_INUM)
+		die(parent, "more files than TFS has inodes");
+	n = &nodes[nnodes];
+	n->name = strdup(name);
+	if (parent == NULL) {
+		n->path = strdup(name);
+	} else {
+		n->path = malloc(strlen(parent) + strlen(name) + 2);
+		sprintf(n->path, "%s/%s", parent, name);
+	}
+	if (lstat(n->path, &n->st) < 0)
+		die(n->path, strerror(errno));
+	if (!S_ISDIR(n->st.st_mode) && !S_ISREG(n->st.st_mode)) {
+		fprintf(stderr, "tfs_mkimage: %s: not a file or directory, skipped\n", n->path);
+		free(n->name);
+		free(n->path);
+		return -1;
+	}
+	if (S_ISREG(n->st.st_mode) && n->st.st_size > MAX_FILE_BLOCKS * BLOCK_SIZE)
+		die(n->path, "larger than the largest TFS file");
+	if (strlen(name) >= sizeof(((struct dirent *)0)->name))
+		die(n->path, "name too long");
+	return nnodes++;
+}
+
+/* Breadth-first walk: nodes[] ends up in inode order */
+static void scan_tree(const char *root) {
+	struct host_dirent **list;
+	int i, k, n;
+
+	add_node(NULL, root);
+	if (!S_ISDIR(nodes[0].st.st_mode))
+		die(root, "not a directory");
+	for (i = 0; i < nnodes; i++) {
+		if (!S_ISDIR(nodes[i].st.st_mode))
+			continue;
+		if ((n = scandir(nodes[i].path, &list, skip_dot, alphasort)) < 0)
+			die(nodes[i].path, strerror(errno));
+		nodes[i].first = nnodes;
+		for (k = 0; k < n; k++) {
+			if (add_node(nodes[i].path, list[k]->d_name) >= 0)
+				nodes[i].count++;
+			free(list[k]);
+		}
+		free(list);
+		if (nodes[i].count > MAX_DIR_ENTRIES)
+			die(nodes[i].path, "too many entries for a TFS directory");
+	}
+}
+
+static int blocks_for(const struct node *n) {
+	if (S_ISDIR(n->st.st_mode))
+		return (n->count + DIRENTS_PER_BLOCK - 1) / DIRENTS_PER_BLOCK;
+	return (n->st.st_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+}
+
+static void emit_dir(struct stream *w, const struct node *n) {
+	struct dirent *block = NULL;
+	int k;
+
+	for (k = 0; k < n->count; k++) {
+		if (k % DIRENTS_PER_BLOCK == 0)
+			block = (struct dirent *)stream_reserve(w, BLOCK_SIZE);
+		block[k % DIRENTS_PER_BLOCK].ino = n->first + k;
+		block[k % DIRENTS_PER_BLOCK].valid = 1;
+		block[k % DIRENTS_PER_BLOCK].len = strlen(nodes[n->first + k].name);
+		strcpy(block[k % DIRENTS_PER_BLOCK].name, nodes[n->first + k].name);
+	}
+}
+
+/* Copy a file's data, returning the bytes actually read */
+static size_t emit_file(struct stream *w, const struct node *n) {
+	size_t size = blocks_for(n) * BLOCK_SIZE, got = 0;
+	char *p = stream_reserve(w, size);
+	ssize_t r;
+	int fd;
+
+	if ((fd = open(n->path, O_RDONLY)) < 0)
+		die(n->path, strerror(errno));
+	while (got < size && (r = read(fd, p + got, size - got)) > 0)
+		got += r;
+	close(fd);
+	return got;
+}
+
+int main(int argc, char **argv) {
+	struct superblock *sb;
+	struct inode *itab;
+	bitmap_t ibm, dbm;
+	struct stream w;
+	struct timespec t0, t1;
+	int opt, i, k, next = 0, used = 0, files = 0, ninode_blk;
+
+	while ((opt = getopt(argc, argv, "vu:h")) != -1) {
+		switch (opt) {
+		case 'v': verbose = 1; break;
+		case 'u': dev_stripe_unit(atoi(optarg)); break;
+		default:
+			fprintf(stderr, "usage: %s [-v] [-u UNIT] SRCDIR IMAGE\n", argv[0]);
+			return 2;
+		}
+	}
+	if (optind != argc - 2) {
+		fprintf(stderr, "usage: %s [-v] [-u UNIT] SRCDIR IMAGE\n", argv[0]);
+		return 2;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	scan_tree(argv[optind]);
+
+	if (tfs_mkfs(argv[optind + 1]) < 0) {
+		fprintf(stderr, "tfs_mkimage: cannot create %s\n", argv[optind + 1]);
+		return 1;
+	}
+	sb = malloc(BLOCK_SIZE);
+	bio_read(0, sb);
+	ninode_blk = (sb->max_inum + INODES_PER_BLOCK - 1) / INODES_PER_BLOCK;
+	itab = calloc(ninode_blk * INODES_PER_BLOCK, sizeof(struct inode));
+	ibm = calloc(1, BLOCK_SIZE);
+	dbm = calloc(1, BLOCK_SIZE);
+
+	/* Inodes and their block maps, in the same order the data is written */
+	for (i = 0; i < nnodes; i++) {
+		struct inode *inode = &itab[i];
+		int dir = S_ISDIR(nodes[i].st.st_mode);
+		int g = group_of(sb->max_inum, sb->groups, i);
+
+		inode->ino = i;
+		inode->valid = 1;
+		inode->type = dir ? TFS_DIRECTORY : TFS_FILE;
+		inode->link = dir ? 2 : 1;
+		inode->size = dir ? nodes[i].count * sizeof(struct dirent) : nodes[i].st.st_size;
+		inode->vstat.st_mode = (dir ? S_IFDIR : S_IFREG) | (nodes[i].st.st_mode & 07777);
+		inode->vstat.st_mtime = nodes[i].st.st_mtime;
+		if (next < group_start(sb->max_dnum, sb->groups, g))
+			next = group_start(sb->max_dnum, sb->groups, g);
+		for (k = 0; k < 16; k++)
+			inode->direct_ptr[k] = k < blocks_for(&nodes[i]) ? next++ : -1;
+		if (next > sb->max_dnum)
+			die(argv[optind], "does not fit in the TFS data region");
+		for (k = 0; k < blocks_for(&nodes[i]); k++)
+			set_bitmap(dbm, inode->direct_ptr[k]);
+		used += blocks_for(&nodes[i]);
+		set_bitmap(ibm, i);
+		files += !dir;
+	}
+
+	/* Data region, one sequential stream */
+	w.blk = sb->d_start_blk;
+	w.buf = malloc(STREAM_SIZE);
+	w.len = 0;
+	for (i = 0; i < nnodes; i++) {
+		if (itab[i].direct_ptr[0] >= 0)
+			stream_seek(&w, sb->d_start_blk + itab[i].direct_ptr[0]);
+		if (S_ISDIR(nodes[i].st.st_mode)) {
+			emit_dir(&w, &nodes[i]);
+		} else {
+			size_t got = emit_file(&w, &nodes[i]);
+			if (got < itab[i].size)
+				itab[i].size = got;
+		}
+		if (verbose)
+			printf("%4d %s\n", i, nodes[i].path);
+	}
+	stream_flush(&w);
+
+	/* Inode table in one write, then the bitmaps and the superblock */
+	write_blocks(sb->i_start_blk, (char *)itab, ninode_blk * BLOCK_SIZE);
+	sb->free_inum = sb->max_inum - nnodes;
+	sb->free_dnum = sb->max_dnum - used;
+	tfs_group_counts(sb, ibm, dbm, sb->gd);
+	bio_write(sb->i_bitmap_blk, ibm);
+	bio_write(sb->d_bitmap_blk, dbm);
+	bio_write(0, sb);
+	dev_sync();
+	dev_close();
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	printf("%s: %d files, %d directories, %d blocks (%.1f MiB) in %.3f s\n",
+		argv[optind + 1], files, nnodes - files, used,
+		(double)used * BLOCK_SIZE / (1024 * 1024),
+		(t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9);
+	return 0;
+}
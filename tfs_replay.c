@@ -0,0 +1,479 @@
+/*
+ *	Tiny File System
+ *	File:	tfs_replay.c
+ *
+ *	Re-executes a trace recorded with tfs -o trace=FILE (see tfs_trace.h)
+ *	and reports the latency distribution of each kind of call, so two
+ *	builds or two sets of options can be compared on the same workload.
+ *
+ *	By default the calls go straight to the core, on a fresh image made
+ *	with tfs_mkfs (a temporary file unless -f names one): each record is
+ *	turned into the libtfs calls its FUSE callback makes, and only those
+ *	are timed. With -m the trace is replayed through a TFS mount at DIR
+ *	instead, as the system calls that lead to each callback; that mount
+ *	should start from a fresh image as well. Opendir, releasedir and
+ *	flush are not replayed through a mount, since the kernel issues them
+ *	on its own around the calls that are.
+ *
+ *	Records run one at a time in trace order, back to back unless -p
+ *	spaces them out to their recorded start times. File data is not in
+ *	the trace; writes carry a pattern made from the handle and offset. A
+ *	call whose result differs from the recorded one is counted as
+ *	diverged: a replay with divergences no longer sees the tree the trace
+ *	was taken on, and its latencies should be read with that in mind.
+ *
+ *	-s prints the latencies recorded in the trace instead of replaying
+ *	it. -z, -d, -a, -r and -u set up the core as the matching tfs mount
+ *	options would (compress, dedup, delalloc, ram, stripe_unit).
+ *
+ *	usage: tfs_replay [-s] [-p] [-m DIR] [-f IMAGE] [-z] [-d] [-a] [-r] [-u UNIT] TRACE
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <limits.h>
+#include <sys/mman.h>
+
+/* The host's struct dirent clashes with the TFS one; rename it here */
+#define dirent host_dirent
+#include <dirent.h>
+#undef dirent
+
+#include "libtfs.h"
+#include "tfs_trace.h"
+
+/* Latencies of one kind of call */
+struct lat {
+	uint32_t	*ns;
+	size_t		n, cap;
+	long		diverged;
+};
+
+/* A handle from the trace and what stands in for it in the replay */
+struct handle {
+	uint64_t		fh;
+	struct tfs_file	*f;		/* core replay */
+	int				fd;		/* replay through a mount */
+};
+
+static struct lat lat[TRACE_OPS];
+static struct handle *handles;
+static int nhandles, maxhandles;
+
+static struct tfs_vol *vol;
+static const char *mnt;
+static int ram;
+static uint64_t call_start;
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Marks where the timed part of a call begins */
+#define BEGIN() (call_start = now_ns())
+
+static void lat_add(struct lat *l, uint32_t ns) {
+	if (l->n == l->cap) {
+		l->cap = l->cap ? l->cap * 2 : 1024;
+		l->ns = realloc(l->ns, l->cap * sizeof(uint32_t));
+	}
+	l->ns[l->n++] = ns;
+}
+
+static int cmp_u32(const void *a, const void *b) {
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static double pct(const struct lat *l, double p) {
+	size_t i = (size_t)(p * (l->n - 1) + 0.5);
+
+	return l->ns[i] / 1000.0;
+}
+
+static void report(void) {
+	double sum;
+	size_t i;
+	int op;
+
+	printf("%-10s %9s %9s %10s %10s %10s %10s %10s\n", "op", "calls", "diverged",
+		"mean us", "p50", "p90", "p99", "max");
+	for (op = 0; op < TRACE_OPS; op++) {
+		struct lat *l = &lat[op];
+
+		if (l->n == 0)
+			continue;
+		qsort(l->ns, l->n, sizeof(uint32_t), cmp_u32);
+		for (sum = 0, i = 0; i < l->n; i++)
+			sum += l->ns[i];
+		printf("%-10s %9zu %9ld %10.2f %10.2f %10.2f %10.2f %10.2f\n",
+			tfs_trace_names[op], l->n, l->diverged, sum / l->n / 1000.0,
+			pct(l, 0.5), pct(l, 0.9), pct(l, 0.99), l->ns[l->n - 1] / 1000.0);
+	}
+}
+
+static struct handle *handle_find(uint64_t fh) {
+	int i;
+
+	for (i = 0; i < nhandles; i++)
+		if (handles[i].fh == fh)
+			return &handles[i];
+	return NULL;
+}
+
+static void handle_add(uint64_t fh, struct tfs_file *f, int fd) {
+	if (nhandles == maxhandles) {
+		maxhandles = maxhandles ? maxhandles * 2 : 64;
+		handles = realloc(handles, maxhandles * sizeof(struct handle));
+	}
+	handles[nhandles].fh = fh;
+	handles[nhandles].f = f;
+	handles[nhandles].fd = fd;
+	nhandles++;
+}
+
+static void handle_drop(struct handle *h) {
+	*h = handles[--nhandles];
+}
+
+/* Stand-in data for a write: xorshift seeded by the handle and offset */
+static void fill(char *buf, uint64_t fh, uint64_t offset, size_t size) {
+	uint64_t x = (fh ^ (offset * 0x9e3779b97f4a7c15ULL)) | 1;
+	size_t i;
+
+	for (i = 0; i < size; i += sizeof(x)) {
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		memcpy(buf + i, &x, size - i < sizeof(x) ? size - i : sizeof(x));
+	}
+}
+
+static int skip_entry(void *ctx, const char *name, uint16_t ino) {
+	return 0;
+}
+
+/* Replay r against the core, doing what the tfs.c callback does */
+static int run_core(const struct tfs_trace_rec *r, const char *path, const char *to, char *buf, struct handle *h) {
+	struct inode inode;
+	struct statvfs st;
+	struct tfs_file *f;
+	uint16_t ino;
+	int ret;
+
+	BEGIN();
+	switch (r->op) {
+	case TRACE_GETATTR:
+	case TRACE_OPENDIR:
+		return tfs_vol_lookup(vol, path, &inode);
+	case TRACE_STATFS:
+		tfs_vol_statfs(vol, &st);
+		return 0;
+	case TRACE_READDIR:
+		if ((ret = tfs_vol_lookup(vol, path, &inode)) < 0)
+			return ret;
+		return tfs_vol_readdir(vol, inode.ino, skip_entry, NULL);
+	case TRACE_MKDIR:
+		return tfs_vol_mkdir(vol, path, r->arg);
+	case TRACE_RMDIR:
+		return tfs_vol_rmdir(vol, path);
+	case TRACE_CREATE:
+		if ((ret = tfs_vol_create(vol, path, r->arg, &ino)) < 0)
+			return ret;
+		ret = tfs_file_open(vol, ino, &f);
+		break;
+	case TRACE_OPEN:
+		if ((ret = tfs_vol_lookup(vol, path, &inode)) < 0)
+			return ret;
+		ret = tfs_file_open(vol, inode.ino, &f);
+		break;
+	case TRACE_READ:
+		return tfs_file_read(vol, h->f, buf, r->size, r->offset);
+	case TRACE_WRITE:
+		return tfs_file_write(vol, h->f, buf, r->size, r->offset);
+	case TRACE_UNLINK:
+		return tfs_vol_unlink(vol, path);
+	case TRACE_RENAME:
+		return tfs_vol_rename(vol, path, to, 0);
+	case TRACE_TRUNCATE:
+		if ((ret = tfs_vol_lookup(vol, path, &inode)) < 0)
+			return ret;
+		return tfs_vol_truncate(vol, inode.ino, r->offset);
+	case TRACE_FALLOCATE:
+		return tfs_vol_fallocate(vol, h->f->ino, r->arg, r->offset, r->size);
+	case TRACE_FSYNC:
+		ret = tfs_file_sync(vol, h->f);
+		if (ret == 0 && ram)
+			ret = tfs_vol_snapshot(vol);
+		return ret;
+	case TRACE_RELEASE:
+		tfs_file_close(vol, h->f);
+		handle_drop(h);
+		return 0;
+	default:
+		/* releasedir, flush and utimens do nothing in tfs.c */
+		return 0;
+	}
+
+	/* create and open: keep the handle if the traced call got one */
+	if (ret == 0) {
+		if (r->fh != 0)
+			handle_add(r->fh, f, -1);
+		else
+			tfs_file_close(vol, f);
+	}
+	return ret;
+}
+
+/* Replay r through the mount, as the system call behind the callback */
+static int run_mount(const struct tfs_trace_rec *r, const char *path, const char *to, char *buf, struct handle *h) {
+	char p[PATH_MAX], q[PATH_MAX];
+	struct host_dirent *d;
+	struct statvfs sv;
+	struct stat st;
+	DIR *dir;
+	int ret;
+
+	snprintf(p, sizeof(p), "%s%s", mnt, path ? path : "");
+	snprintf(q, sizeof(q), "%s%s", mnt, to ? to : "");
+	BEGIN();
+	switch (r->op) {
+	case TRACE_GETATTR:
+		ret = lstat(p, &st);
+		break;
+	case TRACE_STATFS:
+		ret = statvfs(p, &sv);
+		break;
+	case TRACE_READDIR:
+		if ((dir = opendir(p)) == NULL)
+			return -errno;
+		while ((d = readdir(dir)) != NULL)
+			;
+		closedir(dir);
+		return 0;
+	case TRACE_MKDIR:
+		ret = mkdir(p, r->arg & 07777);
+		break;
+	case TRACE_RMDIR:
+		ret = rmdir(p);
+		break;
+	case TRACE_CREATE:
+	case TRACE_OPEN:
+		/* the kernel sends O_TRUNC as a truncate, which is traced on its own */
+		if (r->op == TRACE_CREATE)
+			ret = open(p, O_CREAT | O_RDWR, r->arg & 07777);
+		else
+			ret = open(p, r->arg & O_ACCMODE);
+		if (ret < 0)
+			return -errno;
+		if (r->fh != 0)
+			handle_add(r->fh, NULL, ret);
+		else
+			close(ret);
+		return 0;
+	case TRACE_READ:
+		ret = pread(h->fd, buf, r->size, r->offset);
+		break;
+	case TRACE_WRITE:
+		ret = pwrite(h->fd, buf, r->size, r->offset);
+		break;
+	case TRACE_UNLINK:
+		ret = unlink(p);
+		break;
+	case TRACE_RENAME:
+		ret = rename(p, q);
+		break;
+	case TRACE_TRUNCATE:
+		ret = truncate(p, r->offset);
+		break;
+	case TRACE_FALLOCATE:
+		ret = fallocate(h->fd, r->arg, r->offset, r->size);
+		break;
+	case TRACE_FSYNC:
+		ret = r->arg ? fdatasync(h->fd) : fsync(h->fd);
+		break;
+	case TRACE_UTIMENS:
+		ret = utimensat(AT_FDCWD, p, NULL, AT_SYMLINK_NOFOLLOW);
+		break;
+	case TRACE_RELEASE:
+		close(h->fd);
+		handle_drop(h);
+		return 0;
+	default:
+		return 0;
+	}
+	return ret < 0 ? -errno : ret;
+}
+
+/* Calls the kernel makes by itself around the replayed system calls */
+static int mount_skips(int op) {
+	return op == TRACE_OPENDIR || op == TRACE_RELEASEDIR || op == TRACE_FLUSH;
+}
+
+static int on_handle(int op) {
+	return op == TRACE_READ || op == TRACE_WRITE || op == TRACE_FALLOCATE ||
+		op == TRACE_FSYNC || op == TRACE_RELEASE;
+}
+
+static void usage(const char *prog) {
+	fprintf(stderr, "usage: %s [-s] [-p] [-m DIR] [-f IMAGE] [-z] [-d] [-a] [-r] [-u UNIT] TRACE\n", prog);
+	exit(2);
+}
+
+int main(int argc, char **argv) {
+	char image[] = "/tmp/tfs_replay.XXXXXX";
+	const char *img = NULL;
+	int opt, fd, summary = 0, pace = 0, compress = 0, dedup = 0, delalloc = 0;
+	const struct tfs_trace_hdr *hdr;
+	struct tfs_trace_rec r;
+	size_t pos, size, bufsize = 0;
+	uint64_t t0, t1, calls = 0, diverged = 0;
+	struct stat st;
+	char *map, *buf = NULL;
+
+	while ((opt = getopt(argc, argv, "spm:f:zdaru:h")) != -1) {
+		switch (opt) {
+		case 's': summary = 1; break;
+		case 'p': pace = 1; break;
+		case 'm': mnt = optarg; break;
+		case 'f': img = optarg; break;
+		case 'z': compress = 1; break;
+		case 'd': dedup = 1; break;
+		case 'a': delalloc = 1; break;
+		case 'r': ram = 1; break;
+		case 'u': dev_stripe_unit(atoi(optarg)); break;
+		default: usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1)
+		usage(argv[0]);
+
+	if ((fd = open(argv[optind], O_RDONLY)) < 0 || fstat(fd, &st) < 0) {
+		perror(argv[optind]);
+		return 1;
+	}
+	size = st.st_size;
+	map = size ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+	close(fd);
+	hdr = (const struct tfs_trace_hdr *)map;
+	if (map == MAP_FAILED || size < sizeof(*hdr) ||
+			memcmp(hdr->magic, TFS_TRACE_MAGIC, sizeof(hdr->magic)) != 0 ||
+			hdr->version != TFS_TRACE_VERSION || hdr->rec_size != sizeof(struct tfs_trace_rec)) {
+		fprintf(stderr, "tfs_replay: %s: not a TFS trace\n", argv[optind]);
+		return 1;
+	}
+
+	if (!summary && mnt == NULL) {
+		if (img == NULL) {
+			if ((fd = mkstemp(image)) < 0) {
+				perror("mkstemp");
+				return 1;
+			}
+			close(fd);
+			img = image;
+		}
+		dev_ram(ram);
+		if (tfs_mkfs(img) < 0 || (vol = tfs_mount(img)) == NULL) {
+			fprintf(stderr, "tfs_replay: cannot create image %s\n", img);
+			return 1;
+		}
+		vol->compress = compress;
+		if (dedup && tfs_vol_dedup(vol) < 0)
+			fprintf(stderr, "tfs_replay: no room for the dedup table, dedup is off\n");
+		if (delalloc && tfs_vol_delalloc(vol) < 0)
+			fprintf(stderr, "tfs_replay: cannot start the flusher, delalloc is off\n");
+	}
+
+	t0 = now_ns();
+	for (pos = sizeof(*hdr); pos + sizeof(r) <= size; pos += sizeof(r) + r.pathlen) {
+		const char *p = NULL, *to = NULL;
+		char from[PATH_MAX];
+		struct handle *h = NULL;
+		uint64_t due, now;
+		int ret;
+
+		memcpy(&r, map + pos, sizeof(r));
+		if (r.op >= TRACE_OPS || pos + sizeof(r) + r.pathlen > size ||
+				r.pathlen >= sizeof(from)) {
+			fprintf(stderr, "tfs_replay: %s: bad record at byte %zu\n", argv[optind], pos);
+			return 1;
+		}
+		if (summary) {
+			lat_add(&lat[r.op], r.dur);
+			calls++;
+			continue;
+		}
+		if (mnt != NULL && mount_skips(r.op))
+			continue;
+
+		if (r.pathlen > 0) {
+			memcpy(from, map + pos + sizeof(r), r.pathlen);
+			from[r.pathlen] = '\0';
+			p = from;
+			if (r.op == TRACE_RENAME && strlen(from) < r.pathlen)
+				to = from + strlen(from) + 1;
+		}
+		if ((r.op == TRACE_READ || r.op == TRACE_WRITE) && r.size > bufsize) {
+			bufsize = r.size;
+			buf = realloc(buf, bufsize);
+		}
+		if (r.op == TRACE_WRITE)
+			fill(buf, r.fh, r.offset, r.size);
+		if (pace) {
+			due = t0 + r.start;
+			while ((now = now_ns()) < due) {
+				struct timespec ts = { (due - now) / 1000000000, (due - now) % 1000000000 };
+				nanosleep(&ts, NULL);
+			}
+		}
+
+		if (on_handle(r.op) && (h = handle_find(r.fh)) == NULL) {
+			/* its open failed in this replay */
+			BEGIN();
+			ret = -EBADF;
+		} else if (mnt != NULL) {
+			ret = run_mount(&r, p, to, buf, h);
+		} else {
+			ret = run_core(&r, p, to, buf, h);
+		}
+		lat_add(&lat[r.op], now_ns() - call_start);
+		calls++;
+		if (ret != r.ret) {
+			lat[r.op].diverged++;
+			diverged++;
+		}
+	}
+	t1 = now_ns();
+
+	/* handles the trace never released */
+	while (nhandles > 0) {
+		if (mnt != NULL)
+			close(handles[0].fd);
+		else
+			tfs_file_close(vol, handles[0].f);
+		handle_drop(&handles[0]);
+	}
+	if (vol != NULL)
+		tfs_unmount(vol);
+	if (img == image)
+		unlink(image);
+
+	report();
+	if (summary)
+		printf("%lu calls recorded\n", (unsigned long)calls);
+	else
+		printf("%lu calls replayed in %.3f s, %lu diverged\n", (unsigned long)calls,
+			(t1 - t0) / 1e9, (unsigned long)diverged);
+	munmap(map, size);
+	return 0;
+}
@@ -0,0 +1,94 @@
+/*
+ *	Tiny File System
+ *	File:	tfs_trace.h
+ *
+ *	Operation trace format, written by tfs -o trace=FILE and read back
+ *	by tfs_replay.
+ *
+ *	A trace is a struct tfs_trace_hdr followed by records. Each record is
+ *	a struct tfs_trace_rec and then pathlen bytes of path, unterminated;
+ *	a rename stores both of its paths as "from\0to". Calls on an open
+ *	file carry no path: they name the handle (fh) set up by the open or
+ *	create that returned it, and the inode it is on. File data is not
+ *	recorded, only offsets and sizes. Integers are in host byte order.
+ *
+ *	Records are appended as calls complete, so a call always comes after
+ *	every call that finished before it started; replaying them one at a
+ *	time in file order keeps each call's view of the tree.
+ */
+
+#ifndef _TFS_TRACE_H
+#define _TFS_TRACE_H
+
+#include <stdint.h>
+
+#define TFS_TRACE_MAGIC		"TFSTRACE"
+#define TFS_TRACE_VERSION	1
+
+enum tfs_trace_op {
+	TRACE_GETATTR,
+	TRACE_STATFS,
+	TRACE_OPENDIR,
+	TRACE_READDIR,
+	TRACE_RELEASEDIR,
+	TRACE_MKDIR,
+	TRACE_RMDIR,
+	TRACE_CREATE,
+	TRACE_OPEN,
+	TRACE_READ,
+	TRACE_WRITE,
+	TRACE_UNLINK,
+	TRACE_RENAME,
+	TRACE_TRUNCATE,
+	TRACE_FALLOCATE,
+	TRACE_FLUSH,
+	TRACE_FSYNC,
+	TRACE_UTIMENS,
+	TRACE_RELEASE,
+	TRACE_OPS
+};
+
+static const char *const tfs_trace_names[TRACE_OPS] = {
+	[TRACE_GETATTR]		= "getattr",
+	[TRACE_STATFS]		= "statfs",
+	[TRACE_OPENDIR]		= "opendir",
+	[TRACE_READDIR]		= "readdir",
+	[TRACE_RELEASEDIR]	= "releasedir",
+	[TRACE_MKDIR]		= "mkdir",
+	[TRACE_RMDIR]		= "rmdir",
+	[TRACE_CREATE]		= "create",
+	[TRACE_OPEN]		= "open",
+	[TRACE_READ]		= "read",
+	[TRACE_WRITE]		= "write",
+	[TRACE_UNLINK]		= "unlink",
+	[TRACE_RENAME]		= "rename",
+	[TRACE_TRUNCATE]	= "truncate",
+	[TRACE_FALLOCATE]	= "fallocate",
+	[TRACE_FLUSH]		= "flush",
+	[TRACE_FSYNC]		= "fsync",
+	[TRACE_UTIMENS]		= "utimens",
+	[TRACE_RELEASE]		= "release",
+};
+
+struct tfs_trace_hdr {
+	char		magic[8];		/* TFS_TRACE_MAGIC */
+	uint32_t	version;		/* TFS_TRACE_VERSION */
+	uint32_t	rec_size;		/* sizeof(struct tfs_trace_rec) */
+	int64_t		epoch;			/* wall clock (s) when the trace began */
+};
+
+struct tfs_trace_rec {
+	uint64_t	start;			/* ns from the start of the trace */
+	uint64_t	offset;			/* read/write/fallocate offset, truncate length */
+	uint64_t	size;			/* read/write/fallocate length */
+	uint64_t	fh;				/* open handle, 0 for calls by path */
+	uint32_t	dur;			/* ns spent in the call */
+	int32_t		ret;			/* what the call returned, bytes for read/write */
+	uint32_t	arg;			/* mode (mkdir, create), open flags, fallocate mode, datasync */
+	uint16_t	op;				/* enum tfs_trace_op */
+	uint16_t	ino;			/* inode of an open handle */
+	uint16_t	pathlen;		/* bytes of path following the record */
+	uint16_t	pad[3];
+};
+
+#endif